@@ -10,36 +10,356 @@
 #include <esp_partition.h>
 #include <sdkconfig.h>
 #include <esp_attr.h>
+#if CONFIG_ESP_SELF_REFLASHER_STATS_EVENTS
+#include <esp_event.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define SHA256_DIGEST_SIZE                        32
+
 typedef struct {
     uint32_t  region_address;
     size_t    region_size;
 } addr_region_t;
 
+typedef enum {
+    ESP_SELF_REFLASHER_PHASE_ERASE = 0,           /*!< Staging partition erase by esp_self_reflasher_init and esp_self_reflasher_upd_next_config */
+    ESP_SELF_REFLASHER_PHASE_DOWNLOAD,            /*!< esp_self_reflasher_download_bin, or the download steps */
+    ESP_SELF_REFLASHER_PHASE_COPY,                /*!< esp_self_reflasher_copy_to_region up to the verification, or the copy steps */
+    ESP_SELF_REFLASHER_PHASE_VERIFY,              /*!< Destination region verification, with verify_after_copy set */
+    ESP_SELF_REFLASHER_PHASE_MAX,
+} esp_self_reflasher_phase_t;
+
+typedef struct {
+    esp_self_reflasher_phase_t     phase;
+    size_t                         bytes_done;   /*!< Bytes of the image the phase went through */
+    size_t                         bytes_total;  /*!< Image size, 0 while unknown */
+} esp_self_reflasher_progress_t;
+
+/**
+ * @brief  Progress callback, called from the task running the phase as the image goes through it.
+ */
+typedef void (*esp_self_reflasher_progress_cb_t)(const esp_self_reflasher_progress_t *progress, void *arg);
+
+/**
+ * @brief  Operations of an image source, all called from the task running the download with the source `ctx`.
+ *
+ * A source hands the image out once, from its start, per opening. `read` returns the
+ * number of bytes copied to `buffer`, 0 at the end of the image and a negative value
+ * on error. `map` is optional: it lends a pointer to up to `len` bytes of the image at
+ * the current position and moves past them, so that data already in internal RAM is
+ * staged without being copied. The pointer stays valid until the next call.
+ */
+typedef struct {
+    esp_err_t (*open)(void *ctx);
+    size_t    (*size)(void *ctx);                 /*!< Image length once opened, 0 if unknown */
+    int       (*read)(void *ctx, char *buffer, size_t len);
+    int       (*map)(void *ctx, const char **data, size_t len);
+    void      (*close)(void *ctx);
+} esp_self_reflasher_source_ops_t;
+
+typedef struct {
+    const esp_self_reflasher_source_ops_t *ops;
+    void                           *ctx;
+} esp_self_reflasher_source_t;
+
+/**
+ * @brief  Byte stream read callback of a stream source, e.g. wrapping uart_read_bytes.
+ *
+ * @return Number of bytes read, 0 if none arrived in time, negative on error
+ */
+typedef int (*esp_self_reflasher_stream_read_t)(void *arg, char *buffer, size_t len);
+
 typedef struct {
     const esp_http_client_config_t *http_config;   /*!< ESP HTTP client configuration */
+    const esp_self_reflasher_source_t *source;     /*!< Optional source the image is read from instead of http_config, see esp_self_reflasher_source_file_create */
     const esp_partition_t          *target_partition;
     addr_region_t                  src_region;
     addr_region_t                  dest_region;
     size_t                         src_bin_size;
+    bool                           erase_on_demand; /*!< Erase the staging partition as the download arrives instead of all up front */
+    bool                           erase_clear_tail; /*!< Erase the whole destination region instead of only the image footprint */
+    bool                           differential_copy; /*!< Skip destination sectors that already hold the staged content */
+    bool                           commit_header_last; /*!< Copy the first destination sector, holding the image header, once the others are written and verified */
+    bool                           pipelined_download; /*!< Receive the download while a separate task writes it to flash */
+    bool                           segmented_download; /*!< Download byte ranges of the image over several concurrent connections, when the server supports it */
+    bool                           direct_stream; /*!< Download straight into dest_region, without a staging partition */
+    const uint8_t                  *expected_sha256; /*!< Optional SHA-256 digest (SHA256_DIGEST_SIZE bytes) the image must match */
+    size_t                         expected_size; /*!< Optional image length the image must match, 0 if unknown */
+    bool                           verify_after_copy; /*!< Read back the destination region after copying and compare it with the source */
+    bool                           compressed; /*!< The image is compressed (see tools/compress_image.py) and is decompressed into the destination region */
+    bool                           delta_patch; /*!< The download is a patch (see tools/delta_image.py) applied to base_region while staging */
+    addr_region_t                  base_region; /*!< Region holding the image the patch was made from, dest_region when its size is 0 */
+    bool                           resumable; /*!< Journal the download progress in NVS and resume interrupted downloads with HTTP Range requests */
+    bool                           copy_journal; /*!< Record the copy progress in the copy journal partition, see esp_self_reflasher_resume_pending_copy */
+    esp_self_reflasher_progress_cb_t progress_cb; /*!< Optional download and copy progress callback */
+    void                           *progress_cb_arg; /*!< Argument passed to progress_cb */
 } esp_self_reflasher_config_t;
 
 typedef void *esp_self_reflasher_handle_t;
 
+typedef struct {
+    const char                     *url;          /*!< Image URL, the connection is shared when the server is the same as the previous image one */
+    addr_region_t                  dest_region;
+    const uint8_t                  *expected_sha256; /*!< Optional SHA-256 digest (SHA256_DIGEST_SIZE bytes) the image must match */
+    size_t                         expected_size; /*!< Optional image length the image must match, 0 if unknown */
+} esp_self_reflasher_job_image_t;
+
+/*
+ * Counters accumulated by a handle over all the phases it ran. Time spent in
+ * flash and network operations overlaps when the download is pipelined or segmented.
+ */
+typedef struct {
+    int64_t   phase_time_us[ESP_SELF_REFLASHER_PHASE_MAX];  /*!< Wall clock time spent in each phase */
+    int64_t   erase_time_us;        /*!< Time spent in flash erase operations */
+    int64_t   write_time_us;        /*!< Time spent in flash write operations */
+    int64_t   read_time_us;         /*!< Time spent in flash read operations */
+    int64_t   http_read_time_us;    /*!< Time spent waiting for esp_http_client_read, or for the configured source */
+    uint64_t  bytes_erased;
+    uint64_t  bytes_written;        /*!< Bytes programmed, blank pages left out */
+    uint64_t  bytes_read;           /*!< Flash bytes read, including those read through mmap windows */
+    uint32_t  block_erases;         /*!< Number of 64KB block erases */
+    uint32_t  sector_erases;        /*!< Number of 4KB sector erases */
+    uint32_t  write_calls;
+    uint32_t  blank_pages_skipped;  /*!< Number of 256 bytes flash pages not programmed as their data was all 0xFF */
+    uint32_t  read_calls;           /*!< Number of flash read calls, mmap windows excluded */
+    uint32_t  flash_critical_sections;  /*!< Erase, write and read operations, each run by the flash driver with the cache disabled */
+    uint32_t  http_read_calls;      /*!< Number of esp_http_client_read or source read calls that returned data */
+    uint64_t  http_bytes_read;      /*!< Divided by http_read_calls, the average received chunk size */
+    uint32_t  stack_high_water_mark;  /*!< Lowest free stack of the calling task seen at the end of a phase, in bytes */
+    size_t    min_free_heap;        /*!< Lowest free heap since boot, as of the end of the last phase */
+} esp_self_reflasher_stats_t;
+
+/*
+ * Duration of the flash operations on a chip, and optionally of the download,
+ * that esp_self_reflasher_plan estimates a reflash from.
+ */
+typedef struct {
+    uint32_t  sector_erase_us;      /*!< 4KB sector erase */
+    uint32_t  block_erase_us;       /*!< 64KB block erase */
+    uint32_t  page_program_us;      /*!< 256 bytes page program */
+    uint32_t  read_kb_us;           /*!< 1KB read through an mmap window */
+    uint32_t  download_kb_us;       /*!< 1KB received from the network or source, 0 to leave the download out of the estimate */
+} esp_self_reflasher_cost_t;
+
+/*
+ * What a reflash would do, as computed by esp_self_reflasher_plan. Pages are
+ * counted as if none were blank, so the flash figures are upper bounds.
+ */
+typedef struct {
+    const esp_partition_t *staging_partition;  /*!< Partition the image is staged in, NULL when it is not staged */
+    uint32_t  staging_address;      /*!< Absolute address the (first) image is staged at */
+    size_t    staging_size;         /*!< Staging area size, beyond staging_partition when the image spans the next partitions */
+    size_t    download_bytes;       /*!< Bytes received from the network or source */
+    size_t    staged_bytes;         /*!< Bytes written to the staging area */
+    size_t    copied_bytes;         /*!< Bytes written to the destination regions */
+    uint32_t  block_erases;         /*!< Number of 64KB block erases */
+    uint32_t  sector_erases;        /*!< Number of 4KB sector erases */
+    uint64_t  bytes_erased;
+    uint64_t  bytes_programmed;
+    uint64_t  bytes_read;           /*!< Flash bytes read by the copy and the verification */
+    int64_t   phase_time_us[ESP_SELF_REFLASHER_PHASE_MAX];  /*!< Estimated duration of each phase */
+    int64_t   flash_time_us;        /*!< Estimated time spent in flash operations */
+    int64_t   total_time_us;        /*!< Estimated duration of the whole reflash */
+    int64_t   longest_operation_us; /*!< Longest single flash operation, which must fit in the watchdog timeout */
+} esp_self_reflasher_plan_t;
+
+/*
+ * Limits a plan must fit in, e.g. for a fleet scheduler to hold back devices
+ * low on battery. A limit of 0 is not checked.
+ */
+typedef struct {
+    int64_t   max_total_time_us;
+    int64_t   max_flash_time_us;    /*!< Flash operations draw the most current, to budget battery charge */
+    int64_t   max_operation_us;     /*!< Watchdog timeout, minus a margin for the other tasks */
+} esp_self_reflasher_plan_budget_t;
+
+#if CONFIG_ESP_SELF_REFLASHER_STATS_EVENTS
+/*
+ * At the end of each phase, an event whose id is the esp_self_reflasher_phase_t
+ * is posted to the default event loop, with the esp_self_reflasher_stats_t as data.
+ */
+ESP_EVENT_DECLARE_BASE(ESP_SELF_REFLASHER_EVENT);
+#endif
+
 esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t *handle);
 
 esp_err_t esp_self_reflasher_download_bin(esp_self_reflasher_handle_t handle);
 
 esp_err_t esp_self_reflasher_copy_to_region(esp_self_reflasher_handle_t handle);
 
+esp_err_t esp_self_reflasher_get_copy_skipped_sectors(esp_self_reflasher_handle_t handle, uint32_t *skipped_sectors);
+
+/**
+ * @brief  Get the performance counters the handle accumulated since esp_self_reflasher_init.
+ *
+ * Flash operations of esp_self_reflasher_directly_copy_to_region and
+ * esp_self_reflasher_resume_pending_copy are not counted, as they run without a handle.
+ */
+esp_err_t esp_self_reflasher_get_stats(esp_self_reflasher_handle_t handle, esp_self_reflasher_stats_t *stats);
+
+/**
+ * @brief  Compare `len` bytes at `dest_address` with `src_address` through flash mmap windows.
+ *
+ * @return ESP_OK when both match, ESP_ERR_INVALID_CRC otherwise, with the offset
+ *         of the first differing byte stored in `mismatch_offset` when not NULL.
+ */
+esp_err_t esp_self_reflasher_verify_region(uint32_t dest_address, uint32_t src_address, size_t len, uint32_t *mismatch_offset);
+
+/**
+ * @brief  Move the download, copy and verification of the configured image forward by a bounded amount of work.
+ *
+ * Meant to be called repeatedly from an application loop instead of esp_self_reflasher_download_bin
+ * and esp_self_reflasher_copy_to_region. Each call processes at least one chunk of ESP_SELF_REFLASHER_BUFFER_SIZE
+ * bytes, then returns once `budget_bytes` bytes were processed or `budget_us` microseconds elapsed,
+ * a 0 budget not limiting the call. The first call only opens the connection. Segmented and pipelined
+ * downloads are not used, and differential or compressed copies run in a single call. Set `erase_on_demand`
+ * so the staging partition is not erased as a whole by esp_self_reflasher_init. As the application
+ * runs between the calls, the destination region must not overlap the running partition: once the
+ * download is done, the step gives ESP_ERR_INVALID_STATE instead of copying over it.
+ *
+ * @param progress  Where the step leaves off, may be NULL
+ *
+ * @return ESP_ERR_NOT_FINISHED while there is work left, ESP_OK once the image is in place (and
+ *         for any further call until esp_self_reflasher_upd_next_config), or the error that stopped it.
+ */
+esp_err_t esp_self_reflasher_step(esp_self_reflasher_handle_t handle, size_t budget_bytes, uint32_t budget_us,
+                                  esp_self_reflasher_progress_t *progress);
+
 esp_err_t esp_self_reflasher_upd_next_config(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t handle);
 
 esp_err_t esp_self_reflasher_directly_copy_to_region(const esp_self_reflasher_config_t *self_reflasher_config);
 
+/**
+ * @brief  Download several images over a single kept-alive HTTP connection, then copy them to their destination regions.
+ *
+ * `self_reflasher_config` provides the HTTP client configuration, whose URL is replaced by the one of
+ * each image, the staging partition and the options applied to every image. All images are staged
+ * and verified before the first destination region is written, so a failed download leaves every
+ * destination region untouched. The staging partition must be large enough to hold all of them.
+ * `direct_stream`, `resumable` and `source` are not supported, and give ESP_ERR_INVALID_ARG.
+ */
+esp_err_t esp_self_reflasher_run_job(const esp_self_reflasher_config_t *self_reflasher_config,
+                                     const esp_self_reflasher_job_image_t *images, size_t image_count);
+
+/**
+ * @brief  Complete a journaled copy interrupted by a reset or a power loss.
+ *
+ * Meant to be called early at boot, before `esp_self_reflasher_init` erases the
+ * staging partition. Destination sectors recorded as done are not copied again.
+ *
+ * @return ESP_OK when a pending copy was completed, ESP_ERR_NOT_FOUND when none is pending
+ */
+esp_err_t esp_self_reflasher_resume_pending_copy(void);
+
+/*
+ * Image sources. Setting `source` in the configuration makes esp_self_reflasher_download_bin and
+ * esp_self_reflasher_step read the image from it, staged or streamed to dest_region and decoded
+ * as configured. Resumable and segmented downloads need HTTP and are not used with a source.
+ * A source is opened at the start of each download and closed at its end, it may be reused.
+ */
+
+/**
+ * @brief  Create a source downloading the image over HTTP with a single connection, see `http_config` for the defaults.
+ *
+ * `http_config` must stay valid while the source is in use.
+ */
+esp_err_t esp_self_reflasher_source_http_create(const esp_http_client_config_t *http_config, esp_self_reflasher_source_t **source);
+
+/**
+ * @brief  Create a source reading the image from a file of a mounted VFS (SD card, SPIFFS, FAT, ...).
+ */
+esp_err_t esp_self_reflasher_source_file_create(const char *path, esp_self_reflasher_source_t **source);
+
+/**
+ * @brief  Create a source reading a `size` bytes image from a byte stream, such as UART or USB-CDC.
+ *
+ * A stream has no end of its own, so `size` must be given. The download fails when
+ * `read` returns 0 before the whole image arrived.
+ */
+esp_err_t esp_self_reflasher_source_stream_create(esp_self_reflasher_stream_read_t read, void *arg, size_t size,
+                                                  esp_self_reflasher_source_t **source);
+
+/**
+ * @brief  Create a source reading the image from `size` bytes of flash at `address`, through mmap windows.
+ *
+ * The region must not overlap where the image is written to.
+ */
+esp_err_t esp_self_reflasher_source_flash_create(uint32_t address, size_t size, esp_self_reflasher_source_t **source);
+
+/**
+ * @brief  Create a source reading the image from `size` bytes of memory at `data`.
+ *
+ * Data in internal RAM is staged from `data` itself, without being copied. It must stay valid while the source is in use.
+ */
+esp_err_t esp_self_reflasher_source_memory_create(const void *data, size_t size, esp_self_reflasher_source_t **source);
+
+/**
+ * @brief  Delete a source made by one of the esp_self_reflasher_source_*_create functions.
+ */
+esp_err_t esp_self_reflasher_source_delete(esp_self_reflasher_source_t *source);
+
+/*
+ * Dry-run planning. A plan is computed from the configuration and the partition table only,
+ * with the same staging partition choice and erase operations a real run would make,
+ * without touching flash. Its durations are estimated from a cost table.
+ */
+
+/**
+ * @brief  Get the typical flash costs of the target, from a built-in table.
+ */
+esp_err_t esp_self_reflasher_get_default_cost(esp_self_reflasher_cost_t *cost);
+
+/**
+ * @brief  Measure the flash costs of this chip with a short micro-benchmark, about a quarter of a second.
+ *
+ * A 64KB block of `scratch_partition` is erased, programmed and read back, its content is lost.
+ * It must not be the running partition. `download_kb_us` is left as it is: it can be derived
+ * from the http_read figures of esp_self_reflasher_get_stats after a previous download.
+ */
+esp_err_t esp_self_reflasher_calibrate_cost(const esp_partition_t *scratch_partition, esp_self_reflasher_cost_t *cost);
+
+/**
+ * @brief  Plan the reflash of a single image as esp_self_reflasher_init would run it with `self_reflasher_config`.
+ *
+ * The download is planned when `http_config` or `source` is set, otherwise a copy by
+ * esp_self_reflasher_directly_copy_to_region of `src_bin_size` bytes.
+ *
+ * @param self_reflasher_config  Configuration the reflash would be run with
+ * @param image_size             Size of the image once in dest_region. The download size is taken
+ *                               from `expected_size` when it differs, as for compressed images
+ * @param cost                   Flash costs, the target defaults when NULL
+ * @param plan                   Plan output
+ *
+ * @return ESP_ERR_INVALID_SIZE when the image does not fit, ESP_ERR_NOT_FOUND when no staging partition is free
+ */
+esp_err_t esp_self_reflasher_plan(const esp_self_reflasher_config_t *self_reflasher_config, size_t image_size,
+                                  const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan);
+
+/**
+ * @brief  Plan a job as esp_self_reflasher_run_job would run it, every image needs an `expected_size`.
+ *
+ * The configurations esp_self_reflasher_run_job rejects give ESP_ERR_INVALID_ARG here too.
+ *
+ * @param staging_addresses  Optional output of `image_count` absolute addresses the images are staged at
+ */
+esp_err_t esp_self_reflasher_plan_job(const esp_self_reflasher_config_t *self_reflasher_config,
+                                      const esp_self_reflasher_job_image_t *images, size_t image_count,
+                                      const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan,
+                                      uint32_t *staging_addresses);
+
+/**
+ * @brief  Check a plan against a budget.
+ *
+ * @return ESP_OK when it fits, ESP_ERR_TIMEOUT when a limit is exceeded
+ */
+esp_err_t esp_self_reflasher_plan_check(const esp_self_reflasher_plan_t *plan, const esp_self_reflasher_plan_budget_t *budget);
+
+esp_err_t esp_self_reflasher_deinit(esp_self_reflasher_handle_t handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,106 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "self_reflasher_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Commit phase: the routines erasing and rewriting the destination region. They
+ * stay in IRAM whatever the code placement selected in the configuration.
+ *
+ * Every flash operation runs with the cache disabled, so the copies move data
+ * in batches of whole destination sectors: each batch is read from the source
+ * with a single read, its sectors are erased, and it is programmed with a
+ * single write (one per run of non-blank pages).
+ */
+
+#define COPY_BATCH_SIZE                           CONFIG_ESP_SELF_REFLASHER_COPY_BATCH_SIZE
+
+/* Buffer a copy moves its data through */
+typedef struct {
+    char    *data;
+    size_t  size;
+    bool    allocated;      /* Taken from the heap for the copy, rather than lent by the caller */
+} esp_self_reflasher_batch_buffer_t;
+
+/* Destination region being rewritten, erased just ahead of the writes */
+typedef struct {
+    uint32_t  dest_address;  /* Absolute address offset 0 of the written data goes to */
+    uint32_t  erase_addr;    /* Destination erased up to this absolute address */
+    uint32_t  erase_end;     /* Absolute address the destination must be erased up to once the data is written, never erased past */
+} esp_self_reflasher_region_sink_t;
+
+/**
+ * @brief  Get a COPY_BATCH_SIZE bytes buffer for a copy, or lend `fallback` (BUFFER_SIZE bytes) when there is not enough memory.
+ *
+ * With `fallback` NULL, a BUFFER_SIZE bytes buffer is allocated instead.
+ *
+ * @return ESP_ERR_NO_MEM when no buffer could be had at all
+ */
+esp_err_t esp_self_reflasher_batch_buffer_get(esp_self_reflasher_batch_buffer_t *buffer, char *fallback);
+
+void esp_self_reflasher_batch_buffer_put(esp_self_reflasher_batch_buffer_t *buffer);
+
+/**
+ * @brief  Copy `len` bytes from the staging partition offset `part_offset` to the already erased flash address `address_write`.
+ *
+ * The data goes through `data`, `data_size` bytes at a time. Progress is not reported.
+ */
+esp_err_t esp_self_reflasher_copy_range(esp_self_reflasher_t *self_reflasher_handle, uint32_t part_offset,
+                                        uint32_t address_write, size_t len, char *data, size_t data_size,
+                                        esp_self_reflasher_copy_journal_t *journal);
+
+/**
+ * @brief  Hash `len` bytes of the staged data at the staging partition offset `part_offset` into `sha256_ctx`.
+ *
+ * The data is read the way esp_self_reflasher_copy_range reads it, through `data`, `data_size` bytes at a time.
+ */
+esp_err_t esp_self_reflasher_sha256_update_staged(esp_self_reflasher_t *self_reflasher_handle, uint32_t part_offset,
+                                                  size_t len, char *data, size_t data_size,
+                                                  mbedtls_sha256_context *sha256_ctx);
+
+/**
+ * @brief  Write `len` bytes of data at `offset` into the esp_self_reflasher_region_sink_t `ctx`, erasing ahead of them.
+ *
+ * Data sink of the decompressor when it outputs to the destination region.
+ */
+esp_err_t esp_self_reflasher_region_sink(void *ctx, uint32_t offset, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Copy `src_len` bytes from the flash address `src_address` into `region`, then erase the rest of it up to its erase_end.
+ *
+ * When `src_overlaps_dest` is set, erase operations never reach source data not
+ * read yet. The data goes through `data`, `data_size` bytes at a time, and
+ * the progress is recorded in `journal` when not NULL.
+ */
+esp_err_t esp_self_reflasher_commit_region(esp_self_reflasher_region_sink_t *region, uint32_t src_address, size_t src_len,
+                                           bool src_overlaps_dest, char *data, size_t data_size,
+                                           esp_self_reflasher_copy_journal_t *journal);
+
+/**
+ * @brief  Copy `len` bytes from the flash address `src_address` to `dest_start`, its first sector last, erasing up to `erase_end`.
+ *
+ * The other sectors are written and compared with the source before the first sector,
+ * holding the image header, is erased and programmed from `header`, which must hold the
+ * first source sector. The caller checks the source digest first. The data goes through
+ * `data`, `data_size` bytes at a time, and the copy is recorded in `journal`, when not
+ * NULL, only once complete, so an interrupted copy is resumed the same way from the start.
+ */
+esp_err_t esp_self_reflasher_commit_header_last(uint32_t dest_start, uint32_t erase_end, uint32_t src_address, size_t len,
+                                                const char *header, char *data, size_t data_size,
+                                                esp_self_reflasher_copy_journal_t *journal);
+
+#ifdef __cplusplus
+}
+#endif
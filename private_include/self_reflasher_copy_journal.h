@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COPY_JOURNAL_MAGIC                        0x4a434652    /* "RFCJ" */
+
+#define COPY_JOURNAL_FLAG_COMPRESSED              (1 << 0)      /* Source is a compressed image, the copy restarts as a whole */
+#define COPY_JOURNAL_FLAG_CLEAR_TAIL              (1 << 1)      /* The whole destination region is erased */
+#define COPY_JOURNAL_FLAG_HEADER_LAST             (1 << 2)      /* The first destination sector is written last, the copy restarts as a whole */
+
+/*
+ * Copy being journaled, written at the start of the journal sector. It is followed
+ * by one progress byte per destination sector, programmed from 0xFF to 0x00 once the
+ * sector holds its final content, so no erase is needed until the copy is complete.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t  magic;
+    uint32_t  flags;
+    uint32_t  src_address;                      /* Absolute address of the data being copied */
+    uint32_t  src_len;
+    uint32_t  dest_address;                     /* Absolute address of the destination region */
+    uint32_t  dest_size;
+    uint32_t  crc;                              /* CRC32 of the fields above */
+} esp_self_reflasher_copy_journal_header_t;
+
+typedef struct {
+    const esp_partition_t                     *partition;
+    esp_self_reflasher_copy_journal_header_t  header;
+    uint32_t                                  sectors_done;   /* Leading destination sectors holding their final content */
+} esp_self_reflasher_copy_journal_t;
+
+/**
+ * @brief  Start journaling a copy, replacing any previous journal.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND when there is no journal partition, or
+ *         ESP_ERR_INVALID_SIZE when the copy has more sectors than the journal can track.
+ */
+esp_err_t esp_self_reflasher_copy_journal_begin(esp_self_reflasher_copy_journal_t *journal,
+                                                const esp_self_reflasher_copy_journal_header_t *header);
+
+/**
+ * @brief  Read the journal of an interrupted copy.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND when no copy is pending
+ */
+esp_err_t esp_self_reflasher_copy_journal_load(esp_self_reflasher_copy_journal_t *journal);
+
+/**
+ * @brief  Record that the destination holds its final content up to the absolute address `done_address`.
+ */
+esp_err_t esp_self_reflasher_copy_journal_mark(esp_self_reflasher_copy_journal_t *journal, uint32_t done_address);
+
+/**
+ * @brief  Number of source bytes already copied, sector aligned unless the copy is complete.
+ */
+uint32_t esp_self_reflasher_copy_journal_done_len(const esp_self_reflasher_copy_journal_t *journal);
+
+/**
+ * @brief  Erase the journal once the copy is complete.
+ */
+esp_err_t esp_self_reflasher_copy_journal_end(esp_self_reflasher_copy_journal_t *journal);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,64 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <esp_partition.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLASH_BLOCK_SIZE                          0x10000    /* 64KB */
+
+#define ALIGN_UP(addr, align)                     (((addr) + (align) - 1) & ~((align) - 1))
+#define ALIGN_DOWN(addr, align)                   ((addr) & ~((align) - 1))
+
+/*
+ * Minimum number of sectors that must be needed inside a 64KB block for the
+ * planner to round the erase up to the whole block, when the limit allows it.
+ * A block erase typically costs about as much as 4 to 6 sector erases.
+ * Destination erases pass the image footprint end as the limit unless
+ * erase_clear_tail is set, so data past the image is never erased to save time.
+ */
+#define ERASE_BLOCK_MIN_SECTORS                   6
+
+typedef struct {
+    uint32_t  start;         /* Absolute address of the first erased byte */
+    uint32_t  end;           /* Absolute address past the last erased byte */
+    uint32_t  block_count;   /* Number of 64KB block erases */
+    uint32_t  sector_count;  /* Number of 4KB sector erases */
+} esp_self_reflasher_erase_plan_t;
+
+/**
+ * @brief  Size of the cheapest erase operation starting at `address`.
+ *
+ * @param address  Sector aligned absolute address where the operation starts
+ * @param end      Absolute address where the data footprint ends
+ * @param limit    Absolute address up to which erasing is allowed, rounded up to a sector
+ *
+ * @return FLASH_BLOCK_SIZE or SPI_FLASH_SEC_SIZE
+ */
+uint32_t esp_self_reflasher_erase_op_size(uint32_t address, uint32_t end, uint32_t limit);
+
+/**
+ * @brief  Compute the erase operations covering [start, end) without executing them.
+ */
+void esp_self_reflasher_erase_plan(uint32_t start, uint32_t end, uint32_t limit, esp_self_reflasher_erase_plan_t *plan);
+
+/**
+ * @brief  Erase from `*erase_addr` until at least `until`, advancing `*erase_addr`.
+ *
+ * The operations are chosen by the planner for a footprint ending at `end`,
+ * never going past `limit`. When `partition` is NULL the flash chip is
+ * addressed directly, otherwise all addresses must lie inside the partition.
+ */
+esp_err_t esp_self_reflasher_erase_until(const esp_partition_t *partition, uint32_t *erase_addr,
+                                         uint32_t until, uint32_t end, uint32_t limit);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,66 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "self_reflasher.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMPRESSED_IMAGE_MAGIC                    0x315a4652    /* "RFZ1" */
+
+/*
+ * Compressed images start with this header, followed by a zlib stream of the
+ * image. The digest covers the decompressed image.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t  magic;
+    uint32_t  image_size;
+    uint8_t   image_sha256[SHA256_DIGEST_SIZE];
+} esp_self_reflasher_compressed_header_t;
+
+typedef struct esp_self_reflasher_inflate esp_self_reflasher_inflate_t;
+
+/**
+ * @brief  Receives decompressed data, in order, `offset` bytes into the image.
+ */
+typedef esp_err_t (*esp_self_reflasher_inflate_sink_t)(void *ctx, uint32_t offset, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Allocate a decompressor and its 32KB window from internal memory.
+ */
+esp_err_t esp_self_reflasher_inflate_start(esp_self_reflasher_inflate_sink_t sink, void *sink_ctx, esp_self_reflasher_inflate_t **inflate);
+
+/**
+ * @brief  Decompress the next `len` bytes of the compressed image, passing the output to the sink.
+ */
+esp_err_t esp_self_reflasher_inflate_feed(esp_self_reflasher_inflate_t *inflate, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Header of the image, or NULL while it has not been received yet.
+ */
+const esp_self_reflasher_compressed_header_t *esp_self_reflasher_inflate_header(const esp_self_reflasher_inflate_t *inflate);
+
+/**
+ * @brief  Check the stream ended with the whole image and its digest matches, then release the decompressor.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE for a truncated image or ESP_ERR_INVALID_CRC for a digest mismatch
+ */
+esp_err_t esp_self_reflasher_inflate_finish(esp_self_reflasher_inflate_t *inflate);
+
+/**
+ * @brief  Release the decompressor without checking the result.
+ */
+void esp_self_reflasher_inflate_abort(esp_self_reflasher_inflate_t *inflate);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOURNAL_ETAG_MAX_LEN                      64
+
+/*
+ * Progress of an interrupted download, persisted in NVS so it can be resumed
+ * after a reboot. All offsets are relative to the download target.
+ */
+typedef struct {
+    uint32_t  version;
+    uint32_t  url_crc;                          /* CRC32 of the image URL */
+    uint32_t  target_address;                   /* Absolute address of the staging partition, or of dest_region */
+    uint32_t  image_start;                      /* Offset of the image in the target */
+    uint32_t  bytes_done;                       /* Image bytes already written */
+    uint32_t  erased_end;                       /* Offset up to which the target was erased */
+    int64_t   content_length;                   /* Full image length, -1 if unknown */
+    char      etag[JOURNAL_ETAG_MAX_LEN];       /* Server ETag of the image, empty if none */
+} esp_self_reflasher_journal_t;
+
+/**
+ * @brief  CRC32 identifying the image URL of an HTTP configuration.
+ */
+uint32_t esp_self_reflasher_journal_url_crc(const esp_http_client_config_t *http_config);
+
+/**
+ * @brief  Read the persisted journal.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND when there is no valid journal
+ */
+esp_err_t esp_self_reflasher_journal_load(esp_self_reflasher_journal_t *journal);
+
+/**
+ * @brief  Persist the journal, replacing the previous one.
+ */
+esp_err_t esp_self_reflasher_journal_save(const esp_self_reflasher_journal_t *journal);
+
+/**
+ * @brief  Remove the persisted journal, if any.
+ */
+esp_err_t esp_self_reflasher_journal_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,85 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "esp_partition.h"
+#include "self_reflasher_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PARTITION_INDEX_MAX_COUNT                 (ESP_PARTITION_SUBTYPE_APP_OTA_MAX - ESP_PARTITION_SUBTYPE_APP_OTA_MIN)
+
+/**
+ * @brief  Partition the running code executes from, looked up once.
+ */
+const esp_partition_t *esp_self_reflasher_get_running_partition(void);
+
+/**
+ * @brief  Whether `region` overlaps the partition the running code executes from.
+ */
+bool esp_self_reflasher_overlaps_running(const addr_region_t *region);
+
+/**
+ * @brief  Check that the code placement allows rewriting `dest`.
+ *
+ * @return ESP_ERR_INVALID_STATE when ESP_SELF_REFLASHER_PLACE_COMMIT_IN_IRAM is selected and `dest`
+ *         overlaps the running partition, whose code would run from flash between the commit routines
+ */
+esp_err_t esp_self_reflasher_check_placement(const addr_region_t *dest);
+
+/*
+ * The OTA app partitions are indexed once, sorted by address, so that
+ * partitions lying back to back are also next to each other in the index.
+ */
+size_t esp_self_reflasher_partition_count(void);
+
+uint8_t esp_self_reflasher_get_ota_partition_count(void);
+
+const esp_partition_t *esp_self_reflasher_get_next_partition(const esp_partition_t *start_from);
+
+const esp_partition_t *esp_self_reflasher_partition_at(size_t index);
+
+/**
+ * @brief  Whether staged data can be written to `part`: it is not the running partition, and lies apart from `dest` and, when not NULL, from `base`.
+ *
+ * `base` is the region a delta patch reads its base image from.
+ */
+bool esp_self_reflasher_partition_apart(const esp_partition_t *part, const addr_region_t *dest, const addr_region_t *base);
+
+/**
+ * @brief  Select the staging partition of the handle for its current destination region.
+ *
+ * `configured` is used when not NULL. Otherwise the current staging partition is kept when it is
+ * still apart from the destination region, or else the first free OTA partition after the running
+ * one is picked, preferring one holding `expected_size` bytes when known. A staging area spanning
+ * several partitions is brought back to its first partition.
+ *
+ * @return ESP_ERR_NOT_FOUND when no partition is apart from the destination region
+ */
+esp_err_t esp_self_reflasher_staging_select(esp_self_reflasher_t *self_reflasher_handle, const esp_partition_t *configured);
+
+/**
+ * @brief  Find room in the staging area for the next image, of `image_len` bytes.
+ *
+ * The image is packed right after the previously staged one when it fits. Otherwise, unless
+ * `staging_pinned` is set, the staging area is reused from its start, and when the image is larger
+ * than the staging partition, the area is extended over the free OTA partitions lying right after it.
+ *
+ * @return ESP_ERR_INVALID_SIZE when the image cannot be staged
+ */
+esp_err_t esp_self_reflasher_staging_place(esp_self_reflasher_t *self_reflasher_handle, size_t image_len);
+
+/**
+ * @brief  Partition to pass to the flash accessors for staging area addresses, NULL when the area spans several partitions.
+ */
+const esp_partition_t *esp_self_reflasher_staging_partition(const esp_self_reflasher_t *self_reflasher_handle);
+
+#ifdef __cplusplus
+}
+#endif
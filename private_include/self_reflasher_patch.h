@@ -0,0 +1,79 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "self_reflasher.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PATCH_IMAGE_MAGIC                         0x31444652    /* "RFD1" */
+
+/*
+ * Delta patches start with this header, followed by bsdiff style records:
+ * a control block, `diff_len` bytes added bytewise to the base image at the
+ * current base position, then `extra_len` bytes copied as is. The base
+ * position then moves by `diff_len + seek`.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t  magic;
+    uint32_t  base_size;
+    uint32_t  target_size;
+    uint8_t   base_sha256[SHA256_DIGEST_SIZE];
+    uint8_t   target_sha256[SHA256_DIGEST_SIZE];
+} esp_self_reflasher_patch_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t  diff_len;
+    uint32_t  extra_len;
+    int32_t   seek;
+} esp_self_reflasher_patch_control_t;
+
+typedef struct esp_self_reflasher_patch esp_self_reflasher_patch_t;
+
+/**
+ * @brief  Receives the patched image, in order, `offset` bytes into it.
+ */
+typedef esp_err_t (*esp_self_reflasher_patch_sink_t)(void *ctx, uint32_t offset, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Start applying a patch against the base image stored at `base_region`.
+ */
+esp_err_t esp_self_reflasher_patch_start(const addr_region_t *base_region, esp_self_reflasher_patch_sink_t sink, void *sink_ctx,
+                                         esp_self_reflasher_patch_t **patch);
+
+/**
+ * @brief  Apply the next `len` bytes of the patch, passing the patched image to the sink.
+ *
+ * The base region digest is checked against the header before any output is produced.
+ */
+esp_err_t esp_self_reflasher_patch_feed(esp_self_reflasher_patch_t *patch, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Header of the patch, or NULL while it has not been received yet.
+ */
+const esp_self_reflasher_patch_header_t *esp_self_reflasher_patch_header(const esp_self_reflasher_patch_t *patch);
+
+/**
+ * @brief  Flush the patched image, check its size and digest, then release the patch context.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE for a truncated patch or ESP_ERR_INVALID_CRC for a digest mismatch
+ */
+esp_err_t esp_self_reflasher_patch_finish(esp_self_reflasher_patch_t *patch);
+
+/**
+ * @brief  Release the patch context without checking the result.
+ */
+void esp_self_reflasher_patch_abort(esp_self_reflasher_patch_t *patch);
+
+#ifdef __cplusplus
+}
+#endif
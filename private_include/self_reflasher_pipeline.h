@@ -0,0 +1,49 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "self_reflasher_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_self_reflasher_pipeline esp_self_reflasher_pipeline_t;
+
+/**
+ * @brief  Allocate a ring of `buffer_count` download buffers and start the flash writer task.
+ */
+esp_err_t esp_self_reflasher_pipeline_start(esp_self_reflasher_t *self_reflasher_handle, size_t buffer_count,
+                                            esp_self_reflasher_pipeline_t **pipeline);
+
+/**
+ * @brief  Wait for a free buffer of BUFFER_SIZE bytes to receive into.
+ *
+ * @return ESP_OK, or the error reported by the flash writer task
+ */
+esp_err_t esp_self_reflasher_pipeline_acquire(esp_self_reflasher_pipeline_t *pipeline, char **buffer);
+
+/**
+ * @brief  Hand a filled buffer over to the flash writer task, to be staged at `offset`.
+ */
+esp_err_t esp_self_reflasher_pipeline_submit(esp_self_reflasher_pipeline_t *pipeline, char *buffer, size_t len, uint32_t offset);
+
+/**
+ * @brief  Give back an acquired buffer without writing it.
+ */
+void esp_self_reflasher_pipeline_release(esp_self_reflasher_pipeline_t *pipeline, char *buffer);
+
+/**
+ * @brief  Drain the pending buffers, stop the flash writer task and release the pipeline.
+ *
+ * @return ESP_OK if every submitted buffer was written, otherwise the first write error
+ */
+esp_err_t esp_self_reflasher_pipeline_finish(esp_self_reflasher_pipeline_t *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+/*
+ * Code placement. REFLASHER_COMMIT_ATTR marks the routines running while the
+ * destination region is being erased and rewritten, which are always placed in
+ * IRAM. The rest of the component, marked REFLASHER_ATTR, is placed in IRAM too
+ * unless ESP_SELF_REFLASHER_PLACE_COMMIT_IN_IRAM is selected, in which case it
+ * runs from flash.
+ *
+ * Commit routines may only call code placed in IRAM or ROM, whatever the mode:
+ * the flash accessors, the erase planner and the copy journal updates of the
+ * component, the libraries esp_self_reflasher.lf keeps in IRAM, and the
+ * ESP_DRAM_LOGx macros for logging. They get sections of their own, within
+ * .iram1.*, which tools/iram_report.py checks once the application is linked.
+ */
+#if CONFIG_IDF_TARGET_LINUX
+#define REFLASHER_COMMIT_ATTR                     IRAM_ATTR
+#else
+#define REFLASHER_COMMIT_ATTR                     _SECTION_ATTR_IMPL(".iram1.reflasher_commit", __COUNTER__)
+#endif
+
+#if CONFIG_ESP_SELF_REFLASHER_PLACE_COMMIT_IN_IRAM
+#define REFLASHER_ATTR
+#else
+#define REFLASHER_ATTR                            IRAM_ATTR
+#endif
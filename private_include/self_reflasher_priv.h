@@ -0,0 +1,174 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "mbedtls/sha256.h"
+#include "self_reflasher.h"
+#include "self_reflasher_inflate.h"
+#include "self_reflasher_patch.h"
+#include "self_reflasher_journal.h"
+#include "self_reflasher_copy_journal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESUME_CHECKPOINT_SIZE                    CONFIG_ESP_SELF_REFLASHER_RESUME_CHECKPOINT_SIZE
+#define BUFFER_SIZE                               CONFIG_ESP_SELF_REFLASHER_BUFFER_SIZE
+#define FLASH_PAGE_SIZE                           0x100      /* 256B */
+
+#define IS_REGION_OVERLAPPING(src_start, src_end, dest_start, dest_end)    ((src_start) < (dest_end) && (dest_start) < (src_end))
+
+_Static_assert(BUFFER_SIZE % FLASH_PAGE_SIZE == 0, "Buffer size must be a multiple of the flash page size");
+
+typedef enum {
+    STEP_STATE_IDLE = 0,
+    STEP_STATE_DOWNLOAD,
+    STEP_STATE_COPY,
+    STEP_STATE_VERIFY,
+    STEP_STATE_DONE,
+} esp_self_reflasher_step_state_t;
+
+/* Progress of the image moved forward by esp_self_reflasher_step */
+typedef struct {
+    esp_self_reflasher_step_state_t    state;
+    uint32_t                           offset;        /* Image bytes the current state went through */
+    uint32_t                           erase_addr;    /* Copy: destination erased up to this absolute address */
+    bool                               sha256_running; /* sha256_ctx of the handle holds a running digest */
+    esp_self_reflasher_copy_journal_t  copy_journal;
+    esp_self_reflasher_copy_journal_t  *journal;      /* &copy_journal when the copy is journaled */
+} esp_self_reflasher_step_t;
+
+struct esp_self_reflasher_handle {
+    const esp_http_client_config_t *http_config;   /* ESP HTTP client configuration */
+    const esp_self_reflasher_source_t *source;     /* Image source used instead of http_config when set */
+    esp_http_client_handle_t       http_client;
+    bool                           keep_connection;         /* Keep http_client open between downloads */
+    char                           *buffer;        /* Chunk buffer, BUFFER_SIZE bytes of DMA-capable memory */
+    const esp_partition_t          *target_partition;
+    size_t                         staging_size;            /* Staging area size, beyond target_partition when extended over the next partitions */
+    bool                           staging_pinned;          /* Staged images are kept until all are copied, the area is never reused */
+    addr_region_t                  dest_region;
+    size_t                         total_bin_data_size;
+    uint32_t                       partition_curr_download_addr;
+    uint32_t                       partition_curr_copy_offset;
+    uint32_t                       partition_erased_end;
+    uint32_t                       partition_expected_end;  /* Expected end of the image being staged */
+    uint32_t                       download_offset;         /* Image offset the next received byte is staged at */
+    size_t                         download_len;            /* Image length announced by the server, 0 if unknown */
+    bool                           download_segmented;      /* The current download is received as concurrent byte ranges */
+    /* In direct stream mode, the partition_* offsets are relative to dest_region instead */
+    bool                           erase_on_demand;
+    bool                           erase_clear_tail;
+    bool                           differential_copy;
+    bool                           commit_header_last;
+    bool                           copy_journal;
+    bool                           pipelined_download;
+    bool                           segmented_download;
+    bool                           direct_stream;
+    size_t                         expected_size;
+    bool                           verify_after_copy;
+    bool                           compressed;
+    bool                           delta_patch;
+    bool                           resumable;
+    bool                           journal_active;          /* Progress of the current download is being journaled */
+    esp_self_reflasher_journal_t   journal;
+    char                           etag[JOURNAL_ETAG_MAX_LEN];  /* ETag of the current download response */
+    addr_region_t                  base_region;             /* Image the delta patches apply to */
+    esp_self_reflasher_inflate_t   *inflate;                /* Decompressor of the download, when decompressed as it arrives */
+    esp_self_reflasher_patch_t     *patch;                  /* Patch being applied to the download */
+    esp_self_reflasher_compressed_header_t inflated_header; /* Header of the last image decompressed by a copy */
+    bool                           verify_sha256;
+    bool                           staged_sha256_valid;     /* Data written by the last download was verified against staged_sha256 */
+    uint8_t                        expected_sha256[SHA256_DIGEST_SIZE];
+    uint8_t                        staged_sha256[SHA256_DIGEST_SIZE];  /* Digest of the data written by the last download */
+    mbedtls_sha256_context         sha256_ctx;
+    uint32_t                       copy_skipped_sectors;
+    esp_self_reflasher_stats_t     stats;
+    esp_self_reflasher_progress_cb_t progress_cb;
+    void                           *progress_cb_arg;
+    esp_self_reflasher_step_t      step;
+};
+
+typedef struct esp_self_reflasher_handle esp_self_reflasher_t;
+
+void http_cleanup(esp_http_client_handle_t client);
+
+/**
+ * @brief  Allocate a chunk buffer from DMA-capable internal memory, to be released with heap_caps_free.
+ */
+char *esp_self_reflasher_alloc_buffer(size_t size);
+
+/**
+ * @brief  Apply the per-image options of a configuration to the handle.
+ */
+void esp_self_reflasher_apply_config(esp_self_reflasher_t *self_reflasher_handle, const esp_self_reflasher_config_t *self_reflasher_config);
+
+/**
+ * @brief  Write a downloaded chunk to the staging partition at `offset`, erasing ahead of it if needed.
+ */
+esp_err_t esp_self_reflasher_stage_write(esp_self_reflasher_t *self_reflasher_handle, uint32_t offset, const char *data, size_t len);
+
+/*
+ * Stage downloaded data, decompressing it first when a compressed image is
+ * streamed directly to the destination region.
+ */
+esp_err_t esp_self_reflasher_stage_input(esp_self_reflasher_t *self_reflasher_handle, uint32_t offset, const char *data, size_t len);
+
+void esp_self_reflasher_report_progress(const esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_phase_t phase,
+                                        size_t bytes_done, size_t bytes_total);
+
+void esp_self_reflasher_sha256_start(mbedtls_sha256_context *ctx);
+
+void esp_self_reflasher_sha256_finish(mbedtls_sha256_context *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+esp_err_t esp_self_reflasher_sha256_check(const uint8_t expected[SHA256_DIGEST_SIZE], const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/*
+ * A download is split into these stages: begin sends the request and sets the
+ * handle up for the response (download_segmented tells whether it goes on as
+ * concurrent ranges, which only happens with `allow_segmented`), each burst then
+ * receives and stages the next BUFFER_SIZE bytes at most, and end checks and
+ * records what was staged, releasing the connection. End must also be called
+ * after a failed burst, with the error.
+ */
+esp_err_t esp_self_reflasher_download_begin(esp_self_reflasher_t *self_reflasher_handle, bool allow_segmented);
+
+esp_err_t esp_self_reflasher_receive_burst(esp_self_reflasher_t *self_reflasher_handle, bool *finished);
+
+esp_err_t esp_self_reflasher_download_end(esp_self_reflasher_t *self_reflasher_handle, esp_err_t err);
+
+/**
+ * @brief  Check the staged image can be copied and start journaling the copy when enabled, setting `*journal` to `copy_journal`.
+ */
+esp_err_t esp_self_reflasher_copy_prepare(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_copy_journal_t *copy_journal,
+                                          esp_self_reflasher_copy_journal_t **journal);
+
+/**
+ * @brief  Copy the staged image to the destination region as a whole, as esp_self_reflasher_copy_to_region does before verifying.
+ */
+esp_err_t esp_self_reflasher_copy(esp_self_reflasher_t *self_reflasher_handle);
+
+/**
+ * @brief  Whether a reflash is being stepped, which the blocking download and copy must not interfere with.
+ */
+bool esp_self_reflasher_step_busy(const esp_self_reflasher_t *self_reflasher_handle);
+
+/**
+ * @brief  Abort a reflash being stepped, releasing what it holds. The journals are kept.
+ */
+void esp_self_reflasher_step_abort(esp_self_reflasher_t *self_reflasher_handle);
+
+/**
+ * @brief  Staging partition of a job, free to stage into for each of its images, see esp_self_reflasher_partition_apart. NULL when there is none.
+ */
+const esp_partition_t *esp_self_reflasher_job_partition(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                        const esp_self_reflasher_job_image_t *images, size_t image_count);
+
+#ifdef __cplusplus
+}
+#endif
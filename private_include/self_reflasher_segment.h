@@ -0,0 +1,31 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "self_reflasher_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief  Download the `image_len` bytes image as concurrent byte ranges, each over its own HTTP client.
+ *
+ * `probe_client` must have been opened with a "Range: bytes=0-" request answered with
+ * 206, and is used for the first range. Every range is written at its own offset of the
+ * target through a single flash writer task, after the image footprint was erased.
+ * A failed range is requested again from where it stopped, up to
+ * CONFIG_ESP_SELF_REFLASHER_SEGMENT_RETRIES times.
+ *
+ * @return ESP_OK once the whole image was written, otherwise the first error
+ */
+esp_err_t esp_self_reflasher_segmented_download(esp_self_reflasher_t *self_reflasher_handle, esp_http_client_handle_t probe_client,
+                                                size_t image_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "self_reflasher.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief  Open `source`, its image length is stored in `size`, 0 if unknown.
+ */
+esp_err_t esp_self_reflasher_source_open(const esp_self_reflasher_source_t *source, size_t *size);
+
+/**
+ * @brief  Read the next bytes of the image, accounted to the stats as network reads.
+ *
+ * @return Number of bytes read, 0 at the end of the image, negative on error
+ */
+int esp_self_reflasher_source_read(const esp_self_reflasher_source_t *source, char *buffer, size_t len);
+
+/**
+ * @brief  Whether the source lends pointers to its data, see esp_self_reflasher_source_map.
+ */
+bool esp_self_reflasher_source_can_map(const esp_self_reflasher_source_t *source);
+
+/**
+ * @brief  Borrow a pointer to the next bytes of the image, accounted as esp_self_reflasher_source_read.
+ */
+int esp_self_reflasher_source_map(const esp_self_reflasher_source_t *source, const char **data, size_t len);
+
+void esp_self_reflasher_source_close(const esp_self_reflasher_source_t *source);
+
+#ifdef __cplusplus
+}
+#endif
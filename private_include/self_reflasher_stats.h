@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "esp_http_client.h"
+#include "self_reflasher.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Flash and network operations of the component go through these accessors,
+ * which account them to the stats of the handle running the current phase.
+ * Only one phase is expected to run at a time.
+ */
+
+/**
+ * @brief  Start accounting operations to `stats`.
+ *
+ * @return Phase start time, to be passed to esp_self_reflasher_stats_phase_end
+ */
+int64_t esp_self_reflasher_stats_phase_begin(esp_self_reflasher_stats_t *stats);
+
+/**
+ * @brief  Stop accounting operations, add the time since `start` to the phase and sample the stack and heap usage.
+ */
+void esp_self_reflasher_stats_phase_pause(esp_self_reflasher_stats_t *stats, esp_self_reflasher_phase_t phase, int64_t start);
+
+/**
+ * @brief  As esp_self_reflasher_stats_phase_pause, for the last part of the phase, also posting the stats when enabled.
+ */
+void esp_self_reflasher_stats_phase_end(esp_self_reflasher_stats_t *stats, esp_self_reflasher_phase_t phase, int64_t start);
+
+/**
+ * @brief  Account `len` bytes read from flash through a mmap window.
+ */
+void esp_self_reflasher_stats_count_mapped(size_t len);
+
+/**
+ * @brief  Erase `len` bytes at the absolute flash address `address`.
+ *
+ * When `partition` is NULL the flash chip is addressed directly, otherwise the
+ * range must lie inside the partition. The same goes for the write and read accessors.
+ */
+esp_err_t esp_self_reflasher_flash_erase(const esp_partition_t *partition, uint32_t address, size_t len);
+
+esp_err_t esp_self_reflasher_flash_write(const esp_partition_t *partition, uint32_t address, const void *data, size_t len);
+
+esp_err_t esp_self_reflasher_flash_read(const esp_partition_t *partition, uint32_t address, void *data, size_t len);
+
+/**
+ * @brief  Number of flash erase, write and read operations made through the accessors since boot.
+ */
+uint32_t esp_self_reflasher_flash_op_count(void);
+
+/**
+ * @brief  Account an image read from the network or from the configured source, that took `duration_us`.
+ */
+void esp_self_reflasher_stats_count_input(int64_t duration_us, int data_read);
+
+/**
+ * @brief  esp_http_client_read, accounted.
+ */
+int esp_self_reflasher_http_read(esp_http_client_handle_t client, char *buffer, int len);
+
+#ifdef __cplusplus
+}
+#endif
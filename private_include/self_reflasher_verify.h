@@ -0,0 +1,41 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "spi_flash_mmap.h"
+#include "mbedtls/sha256.h"
+#include "self_reflasher.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VERIFY_WINDOW_SIZE                        CONFIG_ESP_SELF_REFLASHER_VERIFY_WINDOW_SIZE
+
+/**
+ * @brief  Map [address, address + len) for data reads, setting `*ptr` to the mapped address.
+ *
+ * The mapping is released with spi_flash_munmap(*mmap_handle).
+ */
+esp_err_t esp_self_reflasher_map_window(uint32_t address, size_t len, const uint8_t **ptr, spi_flash_mmap_handle_t *mmap_handle);
+
+/**
+ * @brief  Feed [address, address + len) to a running SHA-256 computation through flash mmap windows.
+ */
+esp_err_t esp_self_reflasher_sha256_update_region(mbedtls_sha256_context *sha256_ctx, uint32_t address, size_t len);
+
+/**
+ * @brief  Compute the SHA-256 digest of [address, address + len) through flash mmap windows.
+ */
+esp_err_t esp_self_reflasher_sha256_region(uint32_t address, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
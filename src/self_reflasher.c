@@ -12,136 +12,243 @@
 #include "esp_log.h"
 #include "esp_event.h"
 #include "esp_flash.h"
+#include "esp_heap_caps.h"
 #include "spi_flash_mmap.h"
-#include "self_reflasher.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_pipeline.h"
+#include "self_reflasher_segment.h"
+#include "self_reflasher_verify.h"
+#include "self_reflasher_inflate.h"
+#include "self_reflasher_journal.h"
+#include "self_reflasher_stats.h"
+#include "self_reflasher_partition.h"
+#include "self_reflasher_commit.h"
+#include "self_reflasher_source.h"
 
 static const char *TAG = "self_reflasher";
 
-struct esp_self_reflasher_handle {
-    const esp_http_client_config_t *http_config;   /* ESP HTTP client configuration */
-    esp_http_client_handle_t       http_client;
-    const esp_partition_t          *target_partition;
-    addr_region_t                  dest_region;
-    size_t                         total_bin_data_size;
-    uint32_t                       partition_curr_download_addr;
-    uint32_t                       partition_curr_copy_offset;
-};
+REFLASHER_ATTR void http_cleanup(esp_http_client_handle_t client)
+{
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+}
 
-typedef struct esp_self_reflasher_handle esp_self_reflasher_t;
+/*
+ * Chunk buffers are used as the source of flash writes, so they are taken from
+ * DMA-capable internal RAM to spare the flash driver a bounce buffer.
+ */
+REFLASHER_ATTR char *esp_self_reflasher_alloc_buffer(size_t size)
+{
+    return heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
 
-#define BUFFER_SIZE                               0x400      /* 1KB */
+/*
+ * SHA-256 helpers. mbedtls is backed by the SHA peripheral when
+ * CONFIG_MBEDTLS_HARDWARE_SHA is enabled, which is the default.
+ */
+REFLASHER_ATTR void esp_self_reflasher_sha256_start(mbedtls_sha256_context *ctx)
+{
+    mbedtls_sha256_init(ctx);
+    mbedtls_sha256_starts(ctx, 0);
+}
 
-extern esp_flash_t *esp_flash_default_chip;
+REFLASHER_ATTR void esp_self_reflasher_sha256_finish(mbedtls_sha256_context *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    mbedtls_sha256_finish(ctx, digest);
+    mbedtls_sha256_free(ctx);
+}
 
-IRAM_ATTR void http_cleanup(esp_http_client_handle_t client)
+REFLASHER_ATTR esp_err_t esp_self_reflasher_sha256_check(const uint8_t expected[SHA256_DIGEST_SIZE], const uint8_t digest[SHA256_DIGEST_SIZE])
 {
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+    if (memcmp(expected, digest, SHA256_DIGEST_SIZE) != 0) {
+        ESP_LOGE(TAG, "%s: SHA-256 digest mismatch", __func__);
+        ESP_LOG_BUFFER_HEX_LEVEL(TAG, digest, SHA256_DIGEST_SIZE, ESP_LOG_ERROR);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
 }
 
-static const esp_partition_t* esp_self_reflasher_get_running_partition(void)
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_verify_digest(uint32_t address, size_t len, const uint8_t expected[SHA256_DIGEST_SIZE])
 {
-    static const esp_partition_t *curr_partition = NULL;
+    uint8_t digest[SHA256_DIGEST_SIZE];
 
-    /*
-     * Currently running partition is unlikely to change across reset cycle,
-     * so it can be cached here, and avoid lookup on every flash write operation.
-     */
-    if (curr_partition != NULL) {
-        return curr_partition;
+    esp_err_t err = esp_self_reflasher_sha256_region(address, len, digest);
+    if (err != ESP_OK) {
+        return err;
     }
 
-    /* Find the flash address of this exact function. By definition that is part
-       of the currently running firmware. Then find the enclosing partition. */
-    size_t phys_offs = spi_flash_cache2phys(esp_self_reflasher_get_running_partition);
-
-    assert (phys_offs != SPI_FLASH_CACHE2PHYS_FAIL); /* indicates cache2phys lookup is buggy */
+    err = esp_self_reflasher_sha256_check(expected, digest);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Region 0x%08lx digest verified", address);
+    }
+    return err;
+}
 
-    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP,
-                                                     ESP_PARTITION_SUBTYPE_ANY,
-                                                     NULL);
-    assert(it != NULL); /* has to be at least one app partition */
+REFLASHER_ATTR static void esp_self_reflasher_free_handle(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_self_reflasher_step_abort(self_reflasher_handle);
+    if (self_reflasher_handle->http_client != NULL) {
+        http_cleanup(self_reflasher_handle->http_client);
+    }
+    heap_caps_free(self_reflasher_handle->buffer);
+    free(self_reflasher_handle);
+}
 
-    while (it != NULL) {
-        const esp_partition_t *p = esp_partition_get(it);
-        if (p->address <= phys_offs && p->address + p->size > phys_offs) {
-            esp_partition_iterator_release(it);
-            curr_partition = p;
-            return p;
-        }
-        it = esp_partition_next(it);
+REFLASHER_ATTR void esp_self_reflasher_apply_config(esp_self_reflasher_t *self_reflasher_handle, const esp_self_reflasher_config_t *self_reflasher_config)
+{
+    self_reflasher_handle->dest_region.region_address = self_reflasher_config->dest_region.region_address;
+    self_reflasher_handle->dest_region.region_size = self_reflasher_config->dest_region.region_size;
+    self_reflasher_handle->http_config = self_reflasher_config->http_config;
+    self_reflasher_handle->source = self_reflasher_config->source;
+    self_reflasher_handle->erase_on_demand = self_reflasher_config->erase_on_demand;
+    self_reflasher_handle->erase_clear_tail = self_reflasher_config->erase_clear_tail;
+    self_reflasher_handle->differential_copy = self_reflasher_config->differential_copy;
+    self_reflasher_handle->commit_header_last = self_reflasher_config->commit_header_last;
+    self_reflasher_handle->copy_journal = self_reflasher_config->copy_journal;
+    self_reflasher_handle->pipelined_download = self_reflasher_config->pipelined_download;
+    self_reflasher_handle->segmented_download = self_reflasher_config->segmented_download;
+    self_reflasher_handle->direct_stream = self_reflasher_config->direct_stream;
+    self_reflasher_handle->expected_size = self_reflasher_config->expected_size;
+    self_reflasher_handle->verify_after_copy = self_reflasher_config->verify_after_copy;
+    self_reflasher_handle->compressed = self_reflasher_config->compressed;
+    self_reflasher_handle->delta_patch = self_reflasher_config->delta_patch;
+    self_reflasher_handle->resumable = self_reflasher_config->resumable;
+    self_reflasher_handle->base_region = self_reflasher_config->base_region.region_size > 0 ?
+                                         self_reflasher_config->base_region : self_reflasher_config->dest_region;
+    self_reflasher_handle->verify_sha256 = (self_reflasher_config->expected_sha256 != NULL);
+    if (self_reflasher_handle->verify_sha256) {
+        memcpy(self_reflasher_handle->expected_sha256, self_reflasher_config->expected_sha256, SHA256_DIGEST_SIZE);
     }
+    self_reflasher_handle->staged_sha256_valid = false;
+    self_reflasher_handle->progress_cb = self_reflasher_config->progress_cb;
+    self_reflasher_handle->progress_cb_arg = self_reflasher_config->progress_cb_arg;
+}
 
-    abort(); /* Partition table is invalid or corrupt */
+/*
+ * Downloaded data is written to the staging partition, or straight to the
+ * destination region in direct stream mode. These return the flash address and
+ * size of where it lands, to which download offsets are relative.
+ */
+REFLASHER_ATTR static uint32_t esp_self_reflasher_target_address(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    if (self_reflasher_handle->direct_stream) {
+        return self_reflasher_handle->dest_region.region_address;
+    }
+    return self_reflasher_handle->target_partition->address;
 }
 
-IRAM_ATTR uint8_t esp_self_reflasher_get_ota_partition_count()
+REFLASHER_ATTR static size_t esp_self_reflasher_target_size(const esp_self_reflasher_t *self_reflasher_handle)
 {
-    uint8_t count = 0;
-    for (esp_partition_subtype_t t = ESP_PARTITION_SUBTYPE_APP_OTA_0;
-         t != ESP_PARTITION_SUBTYPE_APP_OTA_MAX;
-         t++) {
-        const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_APP, t, NULL);
-        if (p == NULL) {
-            continue;
-        }
-        count++;
+    if (self_reflasher_handle->direct_stream) {
+        return self_reflasher_handle->dest_region.region_size;
     }
-    return count;
+    return self_reflasher_handle->staging_size;
 }
 
-IRAM_ATTR const esp_partition_t* esp_self_reflasher_get_next_partition(const esp_partition_t *start_from)
+/*
+ * Ensure the download target is erased up to the `until` offset.
+ * `end` is the expected end of the staged data, used by the erase planner to
+ * pick block erases; the target end is the limit that is never crossed.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_erase_target_until(esp_self_reflasher_t *self_reflasher_handle, uint32_t until, uint32_t end)
 {
-    const esp_partition_t *default_ota = NULL;
-    bool next_is_result = false;
-    if (start_from == NULL) {
-        start_from = esp_self_reflasher_get_running_partition();
+    const esp_partition_t *part = self_reflasher_handle->direct_stream ? NULL : esp_self_reflasher_staging_partition(self_reflasher_handle);
+    uint32_t target_address = esp_self_reflasher_target_address(self_reflasher_handle);
+    size_t target_size = esp_self_reflasher_target_size(self_reflasher_handle);
+    uint32_t erase_addr = target_address + self_reflasher_handle->partition_erased_end;
+    // Past the image, the staging area is free, but a streamed destination is only erased with erase_clear_tail
+    size_t limit = (self_reflasher_handle->direct_stream && !self_reflasher_handle->erase_clear_tail) ? MIN(end, target_size) : target_size;
+
+    if (self_reflasher_handle->partition_erased_end >= until) {
+        return ESP_OK;
     }
 
-    assert (start_from != NULL);
-    /* 'start_from' points to actual partition table data in flash */
+    esp_err_t err = esp_self_reflasher_erase_until(part, &erase_addr, target_address + until,
+                                                   target_address + MIN(end, target_size),
+                                                   target_address + MAX(limit, until));
+    self_reflasher_handle->partition_erased_end = erase_addr - target_address;
 
-    /* Two possibilities: either we want the OTA partition immediately after the current running OTA partition, or we
-       want the first OTA partition in the table (for the case when the last OTA partition is the running partition, or
-       if the current running partition is not OTA.)
+    return err;
+}
 
-       This loop iterates subtypes instead of using esp_partition_find, so we
-       get all OTA partitions in a known order (low slot to high slot).
-    */
+/*
+ * Direct streaming writes the destination while the application keeps running,
+ * so the destination must not overlap the running partition.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_check_direct_stream(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    const addr_region_t *dest = &self_reflasher_handle->dest_region;
 
-    for (esp_partition_subtype_t t = ESP_PARTITION_SUBTYPE_APP_OTA_0;
-         t != ESP_PARTITION_SUBTYPE_APP_OTA_MAX;
-         t++) {
-        const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_APP, t, NULL);
-        if (p == NULL) {
-            continue;
-        }
+    if (dest->region_address % SPI_FLASH_SEC_SIZE != 0) {
+        ESP_LOGE(TAG, "%s: Destination address 0x%08lx is not sector aligned", __func__, dest->region_address);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-        if (default_ota == NULL) {
-            /* Default to first OTA partition we find,
-               will be used if nothing else matches */
-            default_ota = p;
-        }
+    if (esp_self_reflasher_overlaps_running(dest)) {
+        ESP_LOGE(TAG, "%s: Destination overlaps the running partition", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-        if (p == start_from) {
-            /* Next OTA partition is the one to use */
-            next_is_result = true;
-        } else if (next_is_result) {
-            return p;
-        }
+    // The patched image would overwrite the base it is being read from
+    const addr_region_t *base = &self_reflasher_handle->base_region;
+    if (self_reflasher_handle->delta_patch &&
+        IS_REGION_OVERLAPPING(base->region_address, base->region_address + base->region_size,
+                              dest->region_address, dest->region_address + dest->region_size)) {
+        ESP_LOGE(TAG, "%s: Delta patch base region overlaps the destination", __func__);
+        return ESP_ERR_INVALID_ARG;
     }
 
-    return default_ota;
+    ESP_LOGI(TAG, "Streaming directly to dest_start 0x%08lx dest_end 0x%08lx",
+             dest->region_address, dest->region_address + dest->region_size);
+
+    return ESP_OK;
+}
+
+/*
+ * Resuming needs the data written to the target to be the downloaded data
+ * itself, as decoders keep state that cannot be restored.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_can_resume(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    return self_reflasher_handle->source == NULL && self_reflasher_handle->resumable && !self_reflasher_handle->delta_patch &&
+           !(self_reflasher_handle->compressed && self_reflasher_handle->direct_stream);
+}
+
+/*
+ * Ranges are received out of order, which only works when the downloaded
+ * data is written to the target as is.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_can_segment(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    return self_reflasher_handle->source == NULL && self_reflasher_handle->segmented_download &&
+           !self_reflasher_handle->resumable && !self_reflasher_handle->delta_patch &&
+           !(self_reflasher_handle->compressed && self_reflasher_handle->direct_stream);
 }
 
-#define IS_REGION_OVERLAPPING(src_start, src_end, dest_start, dest_end)    ((src_start >= dest_start && src_start < dest_end) || \
-                                                                           (src_end >= dest_start && src_end <= dest_end))
+/*
+ * Look for the journal of an interrupted download of the image the handle is
+ * about to download, to the same place.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_find_journal(const esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_journal_t *journal)
+{
+    if (!esp_self_reflasher_can_resume(self_reflasher_handle) || self_reflasher_handle->http_config == NULL ||
+        esp_self_reflasher_journal_load(journal) != ESP_OK) {
+        return false;
+    }
+
+    return journal->url_crc == esp_self_reflasher_journal_url_crc(self_reflasher_handle->http_config) &&
+           journal->target_address == esp_self_reflasher_target_address(self_reflasher_handle) &&
+           journal->image_start == self_reflasher_handle->partition_curr_download_addr;
+}
 
-IRAM_ATTR esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t *handle)
+REFLASHER_ATTR esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t *handle)
 {
     esp_err_t err = ESP_OK;
 
-    if (handle == NULL || self_reflasher_config == NULL || self_reflasher_config->http_config == NULL) {
+    if (handle == NULL || self_reflasher_config == NULL ||
+        (self_reflasher_config->http_config == NULL && self_reflasher_config->source == NULL)) {
         ESP_LOGE(TAG, "%s: Invalid argument", __func__);
         if (handle) {
             *handle = NULL;
@@ -149,6 +256,14 @@ IRAM_ATTR esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *s
         return ESP_ERR_INVALID_ARG;
     }
 
+    // The staging partition may still hold the source of an interrupted copy
+    esp_self_reflasher_copy_journal_t copy_journal;
+    if (self_reflasher_config->copy_journal && esp_self_reflasher_copy_journal_load(&copy_journal) == ESP_OK) {
+        ESP_LOGE(TAG, "%s: An interrupted copy is pending, complete it with esp_self_reflasher_resume_pending_copy first", __func__);
+        *handle = NULL;
+        return ESP_ERR_INVALID_STATE;
+    }
+
     esp_self_reflasher_t *self_reflasher_handle = calloc(1, sizeof(esp_self_reflasher_t));
     if (!self_reflasher_handle) {
         ESP_LOGE(TAG, "%s: Couldn't allocate memory to upgrade data buffer", __func__);
@@ -156,39 +271,32 @@ IRAM_ATTR esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *s
         return ESP_ERR_NO_MEM;
     }
 
-    self_reflasher_handle->dest_region.region_address = self_reflasher_config->dest_region.region_address;
-    self_reflasher_handle->dest_region.region_size = self_reflasher_config->dest_region.region_size;
-    self_reflasher_handle->http_config = self_reflasher_config->http_config;
-    self_reflasher_handle->http_client = NULL;
+    self_reflasher_handle->buffer = esp_self_reflasher_alloc_buffer(BUFFER_SIZE);
+    if (!self_reflasher_handle->buffer) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory to upgrade data buffer", __func__);
+        esp_self_reflasher_free_handle(self_reflasher_handle);
+        *handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
 
-    if (self_reflasher_config->target_partition != NULL) {
-        if (!IS_REGION_OVERLAPPING(self_reflasher_config->target_partition->address,
-                                   self_reflasher_config->target_partition->address + self_reflasher_config->target_partition->size,
-                                   self_reflasher_handle->dest_region.region_address,
-                                   self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size)) {
-            self_reflasher_handle->target_partition = self_reflasher_config->target_partition;
-        }
-    } else {
-        const esp_partition_t *part = NULL;
-        uint8_t part_count = esp_self_reflasher_get_ota_partition_count();
-        ESP_LOGD(TAG, "Partition count: %d", part_count);
-
-        for (uint8_t i = 0; i < part_count; i++) {
-            part = esp_self_reflasher_get_next_partition(part);
-            // Check if the partition overlaps destination region
-            if (!IS_REGION_OVERLAPPING(part->address,
-                                       part->address + part->size,
-                                       self_reflasher_handle->dest_region.region_address,
-                                       self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size)) {
-                self_reflasher_handle->target_partition = part;
-                break;
-            }
+    esp_self_reflasher_apply_config(self_reflasher_handle, self_reflasher_config);
+
+    if (self_reflasher_handle->direct_stream) {
+        // No staging partition: the destination is erased ahead of each write during the download
+        err = esp_self_reflasher_check_direct_stream(self_reflasher_handle);
+        if (err != ESP_OK) {
+            esp_self_reflasher_free_handle(self_reflasher_handle);
+            *handle = NULL;
+            return err;
         }
+        *handle = (esp_self_reflasher_handle_t)self_reflasher_handle;
+        return ESP_OK;
     }
-    if (self_reflasher_handle->target_partition == NULL) {
-        err = ESP_ERR_NOT_FOUND;
+
+    err = esp_self_reflasher_staging_select(self_reflasher_handle, self_reflasher_config->target_partition);
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "%s: Partition overlaps destination", __func__);
-        free(self_reflasher_handle);
+        esp_self_reflasher_free_handle(self_reflasher_handle);
         *handle = NULL;
         return err;
     }
@@ -198,348 +306,1489 @@ IRAM_ATTR esp_err_t esp_self_reflasher_init(const esp_self_reflasher_config_t *s
              self_reflasher_handle->dest_region.region_address,
              self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size);
 
-    // Erase the partition before writing the first time
-    err = esp_partition_erase_range(self_reflasher_handle->target_partition, 0, self_reflasher_handle->target_partition->size);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "%s: Failed to erase partition: %s", __func__, esp_err_to_name(err));
-        free(self_reflasher_handle);
-        *handle = NULL;
-        return err;
-    }
+    esp_self_reflasher_journal_t journal;
+    self_reflasher_handle->partition_erased_end = 0;
+    if (self_reflasher_handle->erase_on_demand) {
+        // Sectors are erased by esp_self_reflasher_download_bin right before they are first written
+        ESP_LOGI(TAG, "Partition will be erased on demand");
+    } else if (esp_self_reflasher_find_journal(self_reflasher_handle, &journal)) {
+        ESP_LOGI(TAG, "Interrupted download found, partition kept to resume it");
+    } else {
+        // Erase the partition before writing the first time
+        int64_t start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+        err = esp_self_reflasher_erase_target_until(self_reflasher_handle,
+                                                       self_reflasher_handle->target_partition->size,
+                                                       self_reflasher_handle->target_partition->size);
+        esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, ESP_SELF_REFLASHER_PHASE_ERASE, start);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase partition: %s", __func__, esp_err_to_name(err));
+            esp_self_reflasher_free_handle(self_reflasher_handle);
+            *handle = NULL;
+            return err;
+        }
 
-    ESP_LOGI(TAG, "Partition erased successfully");
+        ESP_LOGI(TAG, "Partition erased successfully");
+    }
 
     *handle = (esp_self_reflasher_handle_t)self_reflasher_handle;
 
     return err;
 }
 
-IRAM_ATTR esp_err_t esp_self_reflasher_download_bin(esp_self_reflasher_handle_t handle)
+REFLASHER_ATTR esp_err_t esp_self_reflasher_stage_write(esp_self_reflasher_t *self_reflasher_handle, uint32_t offset, const char *data, size_t len)
 {
-    esp_err_t err = ESP_OK;
-    int status_code;
-    char data[BUFFER_SIZE] = {0};
-    uint32_t curr_offset = 0;
-
-    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+    esp_err_t err;
 
-    if (self_reflasher_handle == NULL ||
-        self_reflasher_handle->target_partition == NULL ||
-        self_reflasher_handle->http_config == NULL) {
-        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
-        return ESP_ERR_INVALID_ARG;
+    // Ensure that we don't exceed the partition size
+    if (offset + len > esp_self_reflasher_target_size(self_reflasher_handle)) {
+        ESP_LOGE(TAG, "%s: Blob size exceeds partition size", __func__);
+        return ESP_FAIL;
     }
 
-    self_reflasher_handle->http_client = esp_http_client_init(self_reflasher_handle->http_config);
-    if (self_reflasher_handle->http_client == NULL) {
-        ESP_LOGE(TAG, "%s: Failed to initialise HTTP connection", __func__);
-        err = ESP_FAIL;
+    // Nothing to do when the partition was erased up front, unless the staging area was reused or extended since
+    err = esp_self_reflasher_erase_target_until(self_reflasher_handle, offset + len,
+                                                self_reflasher_handle->partition_expected_end);
+    if (err != ESP_OK) {
         return err;
     }
 
-    err = esp_http_client_open(self_reflasher_handle->http_client, 0);
+    // Write the received data to the flash partition, or to the destination region directly
+    const esp_partition_t *part = self_reflasher_handle->direct_stream ? NULL : esp_self_reflasher_staging_partition(self_reflasher_handle);
+    err = esp_self_reflasher_flash_write(part, esp_self_reflasher_target_address(self_reflasher_handle) + offset, data, len);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "%s: Failed to open HTTP connection: %s", __func__, esp_err_to_name(err));
-        esp_http_client_cleanup(self_reflasher_handle->http_client);
-        return err;
+        ESP_LOGE(TAG, "%s: Failed to write data to partition: %s", __func__, esp_err_to_name(err));
+        return ESP_FAIL;
     }
 
-    self_reflasher_handle->partition_curr_copy_offset = self_reflasher_handle->partition_curr_download_addr;
-    self_reflasher_handle->total_bin_data_size = 0;
-    esp_http_client_fetch_headers(self_reflasher_handle->http_client);
-    status_code = esp_http_client_get_status_code(self_reflasher_handle->http_client);
-    if (status_code != HttpStatus_Ok) {
-        ESP_LOGE(TAG, "%s: HTTP request error", __func__);
-        return ESP_ERR_HTTP_CONNECT;
-    }
+    return ESP_OK;
+}
 
-    while (1) {
-        int data_read = esp_http_client_read(self_reflasher_handle->http_client, data, BUFFER_SIZE);
-        if (data_read < 0) {
-            ESP_LOGE(TAG, "%s: Error: SSL data read error", __func__);
-            http_cleanup(self_reflasher_handle->http_client);
-            err = ESP_ERR_HTTP_EAGAIN;
-            return err;
-        } else if (data_read > 0) {
-            // Ensure that we don't exceed the partition size
-            if (self_reflasher_handle->total_bin_data_size + data_read > self_reflasher_handle->target_partition->size) {
-                ESP_LOGE(TAG, "%s: Blob size exceeds partition size", __func__);
-                return ESP_FAIL;
-            }
+/*
+ * Decoded download data is staged through these sinks: the decompressor output
+ * goes to the patch when there is one, and the patch output to the target.
+ * By the first output the header is complete, and tells the real image
+ * footprint to plan erases for.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_stage_sink(void *ctx, uint32_t offset, const uint8_t *data, size_t len)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)ctx;
 
-            // Write the received data to the flash partition
-            esp_err_t err = esp_partition_write(self_reflasher_handle->target_partition,
-                                                self_reflasher_handle->partition_curr_download_addr + curr_offset,
-                                                data, data_read);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "%s: Failed to write data to partition: %s", __func__, esp_err_to_name(err));
-                return ESP_FAIL;
-            }
+    if (offset == 0) {
+        const esp_self_reflasher_patch_header_t *header = esp_self_reflasher_patch_header(self_reflasher_handle->patch);
+        self_reflasher_handle->partition_expected_end = self_reflasher_handle->partition_curr_download_addr + header->target_size;
+    }
 
-            if (err != ESP_OK) {
-                http_cleanup(self_reflasher_handle->http_client);
-                ESP_LOGE(TAG, "%s: Error while writing to partition", __func__);
-                return err;
-            }
-            curr_offset += data_read;
-            self_reflasher_handle->total_bin_data_size += data_read;
+    return esp_self_reflasher_stage_write(self_reflasher_handle, self_reflasher_handle->partition_curr_download_addr + offset,
+                                          (const char *)data, len);
+}
 
-            ESP_LOGD(TAG, "Chunk length written: %d partial downloaded length %d", data_read, self_reflasher_handle->total_bin_data_size);
-        } else if (data_read == 0) {
-           /*
-            * As esp_http_client_read never returns negative error code, we rely on
-            * `errno` to check for underlying transport connectivity closure if any
-            */
-            if (errno == ECONNRESET || errno == ENOTCONN) {
-                ESP_LOGE(TAG, "%s: Connection closed, errno = %d", __func__, errno);
-                break;
-            }
-            if (esp_http_client_is_complete_data_received(self_reflasher_handle->http_client) == true) {
-                ESP_LOGI(TAG, "Connection closed");
-                break;
-            }
-        }
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_inflate_stage_sink(void *ctx, uint32_t offset, const uint8_t *data, size_t len)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)ctx;
+
+    if (self_reflasher_handle->patch != NULL) {
+        return esp_self_reflasher_patch_feed(self_reflasher_handle->patch, data, len);
     }
-    self_reflasher_handle->partition_curr_download_addr += self_reflasher_handle->total_bin_data_size;
 
-    ESP_LOGI(TAG, "Total downloaded binary length: %d (0x%x)", self_reflasher_handle->total_bin_data_size, self_reflasher_handle->total_bin_data_size);
-    if (esp_http_client_is_complete_data_received(self_reflasher_handle->http_client) != true) {
-        ESP_LOGE(TAG, "%s: Error in receiving complete data", __func__);
-        http_cleanup(self_reflasher_handle->http_client);
-        err = ESP_ERR_HTTP_WRITE_DATA;
-        return err;
+    if (offset == 0) {
+        const esp_self_reflasher_compressed_header_t *header = esp_self_reflasher_inflate_header(self_reflasher_handle->inflate);
+        self_reflasher_handle->partition_expected_end = self_reflasher_handle->partition_curr_download_addr + header->image_size;
     }
-    ESP_LOGI(TAG, "File downloaded successfully");
-    http_cleanup(self_reflasher_handle->http_client);
 
-    return err;
+    return esp_self_reflasher_stage_write(self_reflasher_handle, self_reflasher_handle->partition_curr_download_addr + offset,
+                                          (const char *)data, len);
 }
 
-IRAM_ATTR esp_err_t esp_self_reflasher_copy_to_region(esp_self_reflasher_handle_t handle)
+REFLASHER_ATTR esp_err_t esp_self_reflasher_stage_input(esp_self_reflasher_t *self_reflasher_handle, uint32_t offset, const char *data, size_t len)
 {
-    esp_err_t err;
-    char data[BUFFER_SIZE] = {0};
-    size_t data_len = BUFFER_SIZE;
+    if (self_reflasher_handle->inflate != NULL) {
+        return esp_self_reflasher_inflate_feed(self_reflasher_handle->inflate, (const uint8_t *)data, len);
+    }
+    if (self_reflasher_handle->patch != NULL) {
+        return esp_self_reflasher_patch_feed(self_reflasher_handle->patch, (const uint8_t *)data, len);
+    }
 
-    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+    esp_err_t err = esp_self_reflasher_stage_write(self_reflasher_handle, offset, data, len);
 
-    if (self_reflasher_handle == NULL || self_reflasher_handle->target_partition == NULL) {
-        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
-        return ESP_ERR_INVALID_ARG;
+    // Everything up to here is in flash, record it once enough progress was made
+    esp_self_reflasher_journal_t *journal = &self_reflasher_handle->journal;
+    if (err == ESP_OK && self_reflasher_handle->journal_active &&
+        offset + len - journal->image_start >= journal->bytes_done + RESUME_CHECKPOINT_SIZE) {
+        journal->bytes_done = offset + len - journal->image_start;
+        journal->erased_end = self_reflasher_handle->partition_erased_end;
+        esp_self_reflasher_journal_save(journal);
     }
 
-    uint32_t part_curr_offset = self_reflasher_handle->partition_curr_copy_offset;
-    uint32_t address_write = self_reflasher_handle->dest_region.region_address;
-
-    ESP_LOGI(TAG, "Starting copy 0x%08x bytes from address 0x%08lx to address 0x%08lx",
-             self_reflasher_handle->total_bin_data_size, self_reflasher_handle->target_partition->address + part_curr_offset, address_write);
+    return err;
+}
 
-    // Erase the flash region before writing
-    err = esp_flash_erase_region(esp_flash_default_chip,
-                                 self_reflasher_handle->dest_region.region_address,
-                                 self_reflasher_handle->dest_region.region_size);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
-        return err;
+REFLASHER_ATTR static void esp_self_reflasher_abort_decoders(esp_self_reflasher_t *self_reflasher_handle)
+{
+    if (self_reflasher_handle->inflate != NULL) {
+        esp_self_reflasher_inflate_abort(self_reflasher_handle->inflate);
+        self_reflasher_handle->inflate = NULL;
     }
-    ESP_LOGI(TAG, "Flash destination region erased successfully");
-
-    while (part_curr_offset < self_reflasher_handle->partition_curr_copy_offset + self_reflasher_handle->total_bin_data_size) {
-        data_len = MIN((self_reflasher_handle->partition_curr_copy_offset + self_reflasher_handle->total_bin_data_size - part_curr_offset),
-                        BUFFER_SIZE);
-        ESP_LOGD(TAG, "Reading 0x%08x bytes (data_len) from address 0x%08lx",
-                 data_len, self_reflasher_handle->target_partition->address + part_curr_offset);
+    if (self_reflasher_handle->patch != NULL) {
+        esp_self_reflasher_patch_abort(self_reflasher_handle->patch);
+        self_reflasher_handle->patch = NULL;
+    }
+}
 
-        err = esp_partition_read(self_reflasher_handle->target_partition, part_curr_offset, data, data_len);
+/*
+ * Check the decoders reached the end of their streams, and record the size and
+ * digest of the data they staged.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_finish_decoders(esp_self_reflasher_t *self_reflasher_handle, size_t *image_size)
+{
+    esp_err_t err = ESP_OK;
 
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, self_reflasher_handle->target_partition->address + part_curr_offset, esp_err_to_name(err));
-            return err;
+    if (self_reflasher_handle->inflate != NULL) {
+        const esp_self_reflasher_compressed_header_t *header = esp_self_reflasher_inflate_header(self_reflasher_handle->inflate);
+        if (header == NULL) {
+            ESP_LOGE(TAG, "%s: Compressed image header is truncated", __func__);
+            esp_self_reflasher_abort_decoders(self_reflasher_handle);
+            return ESP_ERR_INVALID_SIZE;
         }
+        *image_size = header->image_size;
+        memcpy(self_reflasher_handle->staged_sha256, header->image_sha256, SHA256_DIGEST_SIZE);
+        err = esp_self_reflasher_inflate_finish(self_reflasher_handle->inflate);
+        self_reflasher_handle->inflate = NULL;
+    }
 
-        err = esp_flash_write(esp_flash_default_chip, data, address_write, data_len);
+    if (self_reflasher_handle->patch != NULL) {
+        const esp_self_reflasher_patch_header_t *header = esp_self_reflasher_patch_header(self_reflasher_handle->patch);
+        if (err == ESP_OK && header == NULL) {
+            ESP_LOGE(TAG, "%s: Patch header is truncated", __func__);
+            err = ESP_ERR_INVALID_SIZE;
+        }
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: %s", __func__, address_write, esp_err_to_name(err));
+            esp_self_reflasher_abort_decoders(self_reflasher_handle);
             return err;
         }
-        ESP_LOGD(TAG, "Data written to address 0x%08lx successfully", address_write);
+        *image_size = header->target_size;
+        memcpy(self_reflasher_handle->staged_sha256, header->target_sha256, SHA256_DIGEST_SIZE);
+        err = esp_self_reflasher_patch_finish(self_reflasher_handle->patch);
+        self_reflasher_handle->patch = NULL;
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_flush_burst(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_pipeline_t *pipeline,
+                                                               const char *buffer, size_t len, uint32_t offset)
+{
+    esp_err_t err;
 
-        part_curr_offset += data_len;
-        address_write += data_len;
+    // Bursts are flushed in stream order, so the digest is computed as they go
+    if (self_reflasher_handle->verify_sha256) {
+        mbedtls_sha256_update(&self_reflasher_handle->sha256_ctx, (const unsigned char *)buffer, len);
     }
 
-#if (CONFIG_LOG_DEFAULT_LEVEL >= ESP_LOG_DEBUG)
-    // Read first bytes to verify
-    uint32_t read_data = 0;
-    err = esp_flash_read(esp_flash_default_chip, &read_data, self_reflasher_handle->dest_region.region_address, 4);
+    if (pipeline != NULL) {
+        // Pipelined bursts are always received into a buffer acquired from the pipeline
+        err = esp_self_reflasher_pipeline_submit(pipeline, (char *)buffer, len, offset);
+    } else {
+        err = esp_self_reflasher_stage_input(self_reflasher_handle, offset, buffer, len);
+    }
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "%s: Failed to read from flash, error: %s", __func__, esp_err_to_name(err));
-        return err;
+        ESP_LOGE(TAG, "%s: Error while writing to partition", __func__);
     }
-    ESP_LOGD(TAG, "Data read from flash: 0x%08lx", read_data);
-#endif
-
-    ESP_LOGI(TAG, "Data copied from partition address 0x%08lx offset 0x%08lx to region: 0x%08lx",
-             self_reflasher_handle->target_partition->address, self_reflasher_handle->partition_curr_copy_offset,
-             self_reflasher_handle->dest_region.region_address);
 
     return err;
 }
 
-IRAM_ATTR esp_err_t esp_self_reflasher_upd_next_config(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t handle)
+/*
+ * Release the HTTP client at the end of a download. A kept connection stays open
+ * for the next image, unless the download failed and left it in an unknown state.
+ */
+REFLASHER_ATTR static void esp_self_reflasher_http_release(esp_self_reflasher_t *self_reflasher_handle, bool failed)
 {
-    esp_err_t err;
-    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
-
-    ESP_LOGI(TAG, "Updating configuration for next download");
-    if (self_reflasher_handle == NULL ||
-        self_reflasher_config == NULL ||
-        self_reflasher_handle->http_config == NULL) {
-        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
-        return ESP_ERR_INVALID_ARG;
+    if (!self_reflasher_handle->keep_connection) {
+        http_cleanup(self_reflasher_handle->http_client);
+        self_reflasher_handle->http_client = NULL;
+    } else if (failed) {
+        esp_http_client_close(self_reflasher_handle->http_client);
     }
+}
 
-    self_reflasher_handle->dest_region.region_address = self_reflasher_config->dest_region.region_address;
-    self_reflasher_handle->dest_region.region_size = self_reflasher_config->dest_region.region_size;
-    self_reflasher_handle->http_config = self_reflasher_config->http_config;
-    self_reflasher_handle->http_client = NULL;
-
-    const esp_partition_t *handle_partition = self_reflasher_handle->target_partition;
-    if (self_reflasher_config->target_partition == NULL) {
-        ESP_LOGD(TAG, "handle_partition_start 0x%08lx handle_partition_end 0x%08lx dest_start 0x%08lx dest_end 0x%08lx",
-                 self_reflasher_handle->target_partition->address,
-                 self_reflasher_handle->target_partition->address + self_reflasher_handle->target_partition->size,
-                 self_reflasher_handle->dest_region.region_address,
-                 self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size);
-
-        // Check if current target partition overlaps with the new destination region
-        if (IS_REGION_OVERLAPPING(self_reflasher_handle->target_partition->address,
-                                  self_reflasher_handle->target_partition->address + self_reflasher_handle->target_partition->size,
-                                  self_reflasher_handle->dest_region.region_address,
-                                  self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size)) {
-            ESP_LOGI(TAG, "Current used partition overlaps with destination. Trying to fetch next partition...");
-
-            // Search for a new target partition
-            self_reflasher_handle->target_partition = NULL;
-            const esp_partition_t *part = handle_partition;
-            uint8_t part_count = esp_self_reflasher_get_ota_partition_count();
-
-            for (uint8_t i = 0; i < part_count; i++) {
-                part = esp_self_reflasher_get_next_partition(part);
-                // Check if the partition overlaps destination region
-                if (!IS_REGION_OVERLAPPING(part->address,
-                                           part->address + part->size,
-                                           self_reflasher_handle->dest_region.region_address,
-                                           self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size)) {
-                    self_reflasher_handle->target_partition = part;
-                    break;
-                }
-            }
-        }
+/*
+ * Close the configured source at the end of a download, or release the HTTP client.
+ */
+REFLASHER_ATTR static void esp_self_reflasher_input_release(esp_self_reflasher_t *self_reflasher_handle, bool failed)
+{
+    if (self_reflasher_handle->source != NULL) {
+        esp_self_reflasher_source_close(self_reflasher_handle->source);
     } else {
-        if (!IS_REGION_OVERLAPPING(self_reflasher_config->target_partition->address,
-                                   self_reflasher_config->target_partition->address + self_reflasher_config->target_partition->size,
-                                   self_reflasher_handle->dest_region.region_address,
-                                   self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size)) {
-            self_reflasher_handle->target_partition = self_reflasher_config->target_partition;
-        } else {
-            // New target partition overlaps the destination region
-            self_reflasher_handle->target_partition = NULL;
-        }
+        esp_self_reflasher_http_release(self_reflasher_handle, failed);
     }
+}
 
-    if (self_reflasher_handle->target_partition == NULL) {
-        ESP_LOGE(TAG, "%s: Partition overlaps destination", __func__);
-        free(self_reflasher_handle);
-        return ESP_ERR_NOT_FOUND;
+/*
+ * Whether the whole image was received. A source only tells its end, which is
+ * checked against its length when it has one.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_input_complete(const esp_self_reflasher_t *self_reflasher_handle, size_t received_size)
+{
+    if (self_reflasher_handle->source != NULL) {
+        return self_reflasher_handle->download_len == 0 || received_size == self_reflasher_handle->download_len;
     }
+    return self_reflasher_handle->download_segmented ||
+           esp_http_client_is_complete_data_received(self_reflasher_handle->http_client) == true;
+}
 
-    if (self_reflasher_handle->target_partition->size - self_reflasher_handle->partition_curr_download_addr
-            < self_reflasher_handle->dest_region.region_size ||
-        handle_partition != self_reflasher_handle->target_partition) {
-        if (handle_partition != self_reflasher_handle->target_partition) {
-            ESP_LOGI(TAG, "New partition target set");
-        } else {
-            ESP_LOGI(TAG, "Current selected partition for download placement will be erased");
-        }
-
-        self_reflasher_handle->partition_curr_copy_offset = 0;
-        self_reflasher_handle->partition_curr_download_addr = 0;
-        // Erase the set partition before writing the first time
-        err = esp_partition_erase_range(self_reflasher_handle->target_partition, 0, self_reflasher_handle->target_partition->size);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "%s: Failed to erase partition: %s", __func__, esp_err_to_name(err));
-            free(self_reflasher_handle);
-            return err;
-        }
+/*
+ * Response headers are only reported through the event handler, so the user
+ * one is wrapped to pick the ETag up.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_http_event_handler(esp_http_client_event_t *evt)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)evt->user_data;
 
-        ESP_LOGI(TAG, "Partition erased successfully");
+    if (evt->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt->header_key, "ETag") == 0) {
+        strlcpy(self_reflasher_handle->etag, evt->header_value, sizeof(self_reflasher_handle->etag));
     }
 
+    if (self_reflasher_handle->http_config->event_handler != NULL) {
+        evt->user_data = self_reflasher_handle->http_config->user_data;
+        return self_reflasher_handle->http_config->event_handler(evt);
+    }
     return ESP_OK;
 }
 
-IRAM_ATTR esp_err_t esp_self_reflasher_directly_copy_to_region(const esp_self_reflasher_config_t *self_reflasher_config)
-{
+/*
+ * The server sent the whole image instead of the rest of it, so the part
+ * written by the interrupted download has to be erased again.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_restart_download(esp_self_reflasher_t *self_reflasher_handle)
+{
+    uint32_t image_start = self_reflasher_handle->partition_curr_download_addr;
+    uint32_t target_size = esp_self_reflasher_target_size(self_reflasher_handle);
+
+    if (image_start % SPI_FLASH_SEC_SIZE != 0) {
+        ESP_LOGE(TAG, "%s: Image does not start on a sector boundary, it cannot be downloaded again in place", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    self_reflasher_handle->partition_erased_end = image_start;
+    if (self_reflasher_handle->erase_on_demand || self_reflasher_handle->direct_stream) {
+        return ESP_OK;
+    }
+
+    return esp_self_reflasher_erase_target_until(self_reflasher_handle, target_size, target_size);
+}
+
+REFLASHER_ATTR void esp_self_reflasher_report_progress(const esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_phase_t phase,
+                                                       size_t bytes_done, size_t bytes_total)
+{
+    if (self_reflasher_handle->progress_cb != NULL) {
+        esp_self_reflasher_progress_t progress = {
+            .phase = phase,
+            .bytes_done = bytes_done,
+            .bytes_total = bytes_total,
+        };
+        self_reflasher_handle->progress_cb(&progress, self_reflasher_handle->progress_cb_arg);
+    }
+}
+
+/*
+ * Incoming data is coalesced into bursts so flash is always programmed in whole pages:
+ * the first burst ends on a page boundary, the following ones are BUFFER_SIZE long.
+ * Receive and flush the next burst at download_offset, `*finished` is set once the
+ * response body, or the image of the configured source, is over.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_receive_burst_to(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_pipeline_t *pipeline,
+                                                                    bool *finished)
+{
     esp_err_t err = ESP_OK;
-    char data[BUFFER_SIZE] = {0};
-    size_t data_len = BUFFER_SIZE;
+    char *buffer;
+    const char *data;
+    size_t buffer_fill = 0;
+    uint32_t offset = self_reflasher_handle->partition_curr_download_addr + self_reflasher_handle->download_offset;
+    const esp_self_reflasher_source_t *source = self_reflasher_handle->source;
+    bool mapped = (pipeline == NULL && source != NULL && esp_self_reflasher_source_can_map(source));
+
+    *finished = false;
+    if (pipeline != NULL) {
+        err = esp_self_reflasher_pipeline_acquire(pipeline, &buffer);
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else {
+        buffer = self_reflasher_handle->buffer;
+    }
+    size_t burst_len = BUFFER_SIZE - ((esp_self_reflasher_target_address(self_reflasher_handle) + offset) % FLASH_PAGE_SIZE);
+    data = buffer;
+
+    // A source lending its data is staged from it, unless the writer task needs it in one of its buffers
+    if (mapped) {
+        int data_read = esp_self_reflasher_source_map(source, &data, burst_len);
+        if (data_read < 0) {
+            ESP_LOGE(TAG, "%s: Error: image source read error", __func__);
+            return ESP_FAIL;
+        }
+        *finished = (data_read == 0);
+        buffer_fill = data_read;
+        self_reflasher_handle->total_bin_data_size += data_read;
+    }
+
+    while (!mapped && buffer_fill < burst_len) {
+        int data_read;
+        if (source != NULL) {
+            data_read = esp_self_reflasher_source_read(source, buffer + buffer_fill, burst_len - buffer_fill);
+        } else {
+            data_read = esp_self_reflasher_http_read(self_reflasher_handle->http_client, buffer + buffer_fill, burst_len - buffer_fill);
+        }
+        if (data_read < 0) {
+            ESP_LOGE(TAG, "%s: Error: %s read error", __func__, (source != NULL) ? "image source" : "SSL data");
+            err = (source != NULL) ? ESP_FAIL : ESP_ERR_HTTP_EAGAIN;
+            break;
+        } else if (data_read > 0) {
+            buffer_fill += data_read;
+            self_reflasher_handle->total_bin_data_size += data_read;
+            ESP_LOGD(TAG, "Chunk length received: %d partial downloaded length %d", data_read, self_reflasher_handle->total_bin_data_size);
+        } else if (source != NULL) {
+            // Sources only return 0 at the end of the image
+            *finished = true;
+            break;
+        } else if (data_read == 0) {
+           /*
+            * As esp_http_client_read never returns negative error code, we rely on
+            * `errno` to check for underlying transport connectivity closure if any
+            */
+            if (errno == ECONNRESET || errno == ENOTCONN) {
+                ESP_LOGE(TAG, "%s: Connection closed, errno = %d", __func__, errno);
+                *finished = true;
+                break;
+            }
+            if (esp_http_client_is_complete_data_received(self_reflasher_handle->http_client) == true) {
+                ESP_LOGI(TAG, "Connection closed");
+                *finished = true;
+                break;
+            }
+        }
+    }
+
+    if (err != ESP_OK || buffer_fill == 0) {
+        if (pipeline != NULL) {
+            esp_self_reflasher_pipeline_release(pipeline, buffer);
+        }
+        return err;
+    }
+
+    err = esp_self_reflasher_flush_burst(self_reflasher_handle, pipeline, data, buffer_fill, offset);
+    if (err == ESP_OK) {
+        self_reflasher_handle->download_offset += buffer_fill;
+        esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_DOWNLOAD,
+                                           self_reflasher_handle->total_bin_data_size, self_reflasher_handle->download_len);
+    }
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_receive_burst(esp_self_reflasher_t *self_reflasher_handle, bool *finished)
+{
+    return esp_self_reflasher_receive_burst_to(self_reflasher_handle, NULL, finished);
+}
+
+/*
+ * Receive the response body over the single download connection, or the image of the configured source.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_receive_stream(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_err_t err = ESP_OK;
+    bool finished = false;
+    esp_self_reflasher_pipeline_t *pipeline = NULL;
+
+    if (self_reflasher_handle->pipelined_download) {
+        // Flash writes are handed over to a writer task while the next chunk is received
+        err = esp_self_reflasher_pipeline_start(self_reflasher_handle, CONFIG_ESP_SELF_REFLASHER_PIPELINE_BUFFERS, &pipeline);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    while (err == ESP_OK && !finished) {
+        err = esp_self_reflasher_receive_burst_to(self_reflasher_handle, pipeline, &finished);
+    }
+
+    if (pipeline != NULL) {
+        // Wait for the writer task to flush every received chunk
+        esp_err_t pipeline_err = esp_self_reflasher_pipeline_finish(pipeline);
+        if (err == ESP_OK) {
+            err = pipeline_err;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Open the HTTP connection, asking for the rest of the image when an interrupted
+ * download is resumed, or for a range to probe the server for segmented downloads.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_http_begin(esp_self_reflasher_t *self_reflasher_handle, bool allow_segmented,
+                                                              int64_t *image_length, uint32_t *image_offset, bool *image_segmented)
+{
+    esp_err_t err = ESP_OK;
+    int status_code;
+    int64_t content_length;
+
+    esp_http_client_config_t http_config = *self_reflasher_handle->http_config;
+    esp_self_reflasher_journal_t *journal = &self_reflasher_handle->journal;
+    bool resuming = false;
+    uint32_t resume_offset = 0;
+    char range[32];
+
+    if (esp_self_reflasher_can_resume(self_reflasher_handle)) {
+        http_config.event_handler = esp_self_reflasher_http_event_handler;
+        http_config.user_data = self_reflasher_handle;
+        resuming = esp_self_reflasher_find_journal(self_reflasher_handle, journal) && journal->bytes_done > 0;
+    }
+    self_reflasher_handle->etag[0] = '\0';
+
+    // A range request tells whether the server can serve the image over several connections
+    bool segmented = allow_segmented && !resuming && esp_self_reflasher_can_segment(self_reflasher_handle);
+
+    if (self_reflasher_handle->http_client != NULL) {
+        // Kept connection: the next request goes over it when the server is the same
+        err = esp_http_client_set_url(self_reflasher_handle->http_client, http_config.url);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to set the image URL: %s", __func__, esp_err_to_name(err));
+            return err;
+        }
+    } else {
+        self_reflasher_handle->http_client = esp_http_client_init(&http_config);
+        if (self_reflasher_handle->http_client == NULL) {
+            ESP_LOGE(TAG, "%s: Failed to initialise HTTP connection", __func__);
+            err = ESP_FAIL;
+            return err;
+        }
+    }
+
+    // Ask for the rest of the image only, unless it changed on the server since
+    if (resuming) {
+        ESP_LOGI(TAG, "Resuming interrupted download at 0x%08lx", journal->bytes_done);
+        snprintf(range, sizeof(range), "bytes=%lu-", journal->bytes_done);
+        esp_http_client_set_header(self_reflasher_handle->http_client, "Range", range);
+        if (journal->etag[0] != '\0') {
+            esp_http_client_set_header(self_reflasher_handle->http_client, "If-Range", journal->etag);
+        }
+    } else if (segmented) {
+        esp_http_client_set_header(self_reflasher_handle->http_client, "Range", "bytes=0-");
+    }
+
+    err = esp_http_client_open(self_reflasher_handle->http_client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to open HTTP connection: %s", __func__, esp_err_to_name(err));
+        esp_self_reflasher_http_release(self_reflasher_handle, true);
+        return err;
+    }
+
+    content_length = esp_http_client_fetch_headers(self_reflasher_handle->http_client);
+    status_code = esp_http_client_get_status_code(self_reflasher_handle->http_client);
+    if (resuming && status_code == HttpStatus_PartialContent) {
+        resume_offset = journal->bytes_done;
+        if (content_length > 0) {
+            content_length += resume_offset;
+        }
+        if (journal->content_length > 0 && content_length != journal->content_length) {
+            ESP_LOGE(TAG, "%s: Image length changed since the interrupted download", __func__);
+            esp_self_reflasher_journal_clear();
+            esp_self_reflasher_http_release(self_reflasher_handle, true);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        self_reflasher_handle->partition_erased_end = journal->erased_end;
+    } else if (resuming && status_code == HttpStatus_Ok) {
+        ESP_LOGW(TAG, "Server sent the whole image, restarting the download");
+        err = esp_self_reflasher_restart_download(self_reflasher_handle);
+        if (err != ESP_OK) {
+            esp_self_reflasher_journal_clear();
+            esp_self_reflasher_http_release(self_reflasher_handle, true);
+            return err;
+        }
+    } else if (segmented && status_code == HttpStatus_PartialContent) {
+        esp_http_client_delete_header(self_reflasher_handle->http_client, "Range");
+        if (content_length <= 0) {
+            ESP_LOGW(TAG, "Image length unknown, downloading over a single connection");
+            segmented = false;
+        }
+    } else if (status_code != HttpStatus_Ok) {
+        ESP_LOGE(TAG, "%s: HTTP request error", __func__);
+        esp_self_reflasher_http_release(self_reflasher_handle, true);
+        return ESP_ERR_HTTP_CONNECT;
+    }
+
+    if (segmented && status_code == HttpStatus_Ok) {
+        ESP_LOGW(TAG, "Server does not support range requests, downloading over a single connection");
+        esp_http_client_delete_header(self_reflasher_handle->http_client, "Range");
+        segmented = false;
+    }
+
+    *image_length = content_length;
+    *image_offset = resume_offset;
+    *image_segmented = segmented;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_download_begin(esp_self_reflasher_t *self_reflasher_handle, bool allow_segmented)
+{
+    esp_err_t err = ESP_OK;
+    int64_t content_length;
+    uint32_t resume_offset = 0;
+    bool segmented = false;
+    esp_self_reflasher_journal_t *journal = &self_reflasher_handle->journal;
+
+    self_reflasher_handle->journal_active = false;
+    if (self_reflasher_handle->source != NULL) {
+        size_t source_size;
+        err = esp_self_reflasher_source_open(self_reflasher_handle->source, &source_size);
+        content_length = source_size;
+    } else {
+        err = esp_self_reflasher_http_begin(self_reflasher_handle, allow_segmented, &content_length, &resume_offset, &segmented);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    self_reflasher_handle->partition_curr_copy_offset = self_reflasher_handle->partition_curr_download_addr;
+    self_reflasher_handle->total_bin_data_size = resume_offset;
+
+    if (content_length <= 0 && self_reflasher_handle->expected_size > 0) {
+        content_length = self_reflasher_handle->expected_size;
+    } else if (content_length > 0 && self_reflasher_handle->expected_size > 0 &&
+               content_length != (int64_t)self_reflasher_handle->expected_size) {
+        ESP_LOGE(TAG, "%s: Image length %lld does not match the expected size %u", __func__, content_length, self_reflasher_handle->expected_size);
+        esp_self_reflasher_input_release(self_reflasher_handle, true);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /*
+     * A fresh staged image is placed by its actual length, packed after the previous one when it fits.
+     * Without a known length, it is given room for the largest image the destination region takes,
+     * and when there is none, it is staged where it is and fails only if it turns out not to fit.
+     */
+    if (!self_reflasher_handle->direct_stream && resume_offset == 0) {
+        if (content_length > 0) {
+            err = esp_self_reflasher_staging_place(self_reflasher_handle, content_length);
+        } else if (esp_self_reflasher_staging_place(self_reflasher_handle, self_reflasher_handle->dest_region.region_size) != ESP_OK) {
+            ESP_LOGW(TAG, "%s: Image length unknown, staging it at offset 0x%08lx without room for the whole destination region",
+                     __func__, self_reflasher_handle->partition_curr_download_addr);
+        }
+        if (err != ESP_OK) {
+            esp_self_reflasher_input_release(self_reflasher_handle, true);
+            return err;
+        }
+    }
+
+    // When the image length is known, on-demand erasing plans for exactly its footprint
+    if (content_length > 0) {
+        if (self_reflasher_handle->partition_curr_download_addr + content_length > esp_self_reflasher_target_size(self_reflasher_handle)) {
+            ESP_LOGE(TAG, "%s: Blob size exceeds partition size", __func__);
+            esp_self_reflasher_input_release(self_reflasher_handle, true);
+            return ESP_FAIL;
+        }
+        self_reflasher_handle->partition_expected_end = self_reflasher_handle->partition_curr_download_addr + content_length;
+    } else {
+        self_reflasher_handle->partition_expected_end = esp_self_reflasher_target_size(self_reflasher_handle);
+    }
+
+    // Ranges are written out of order, so their whole footprint is erased up front
+    if (segmented) {
+        err = esp_self_reflasher_erase_target_until(self_reflasher_handle, self_reflasher_handle->partition_expected_end,
+                                                    self_reflasher_handle->partition_expected_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase the image footprint, error: %s", __func__, esp_err_to_name(err));
+            esp_self_reflasher_input_release(self_reflasher_handle, true);
+            return err;
+        }
+    }
+
+    self_reflasher_handle->staged_sha256_valid = false;
+    if (self_reflasher_handle->verify_sha256) {
+        esp_self_reflasher_sha256_start(&self_reflasher_handle->sha256_ctx);
+    }
+
+    // The digest also covers the part written by the interrupted download
+    if (resume_offset > 0 && self_reflasher_handle->verify_sha256) {
+        err = esp_self_reflasher_sha256_update_region(&self_reflasher_handle->sha256_ctx,
+                                                      esp_self_reflasher_target_address(self_reflasher_handle) +
+                                                      self_reflasher_handle->partition_curr_download_addr, resume_offset);
+        if (err != ESP_OK) {
+            mbedtls_sha256_free(&self_reflasher_handle->sha256_ctx);
+            esp_self_reflasher_input_release(self_reflasher_handle, true);
+            return err;
+        }
+    }
+
+    if (esp_self_reflasher_can_resume(self_reflasher_handle)) {
+        journal->url_crc = esp_self_reflasher_journal_url_crc(self_reflasher_handle->http_config);
+        journal->target_address = esp_self_reflasher_target_address(self_reflasher_handle);
+        journal->image_start = self_reflasher_handle->partition_curr_download_addr;
+        journal->bytes_done = resume_offset;
+        journal->erased_end = self_reflasher_handle->partition_erased_end;
+        journal->content_length = content_length > 0 ? content_length : -1;
+        strlcpy(journal->etag, self_reflasher_handle->etag, sizeof(journal->etag));
+        self_reflasher_handle->journal_active = (esp_self_reflasher_journal_save(journal) == ESP_OK);
+    }
+
+    /*
+     * Patches are applied as they are received, and so are decompressed first when compressed.
+     * Without a staging partition, compressed images are decompressed as they are received too.
+     */
+    if (self_reflasher_handle->delta_patch) {
+        err = esp_self_reflasher_patch_start(&self_reflasher_handle->base_region, esp_self_reflasher_patch_stage_sink,
+                                             self_reflasher_handle, &self_reflasher_handle->patch);
+    }
+    if (err == ESP_OK && self_reflasher_handle->compressed &&
+        (self_reflasher_handle->direct_stream || self_reflasher_handle->delta_patch)) {
+        err = esp_self_reflasher_inflate_start(esp_self_reflasher_inflate_stage_sink, self_reflasher_handle, &self_reflasher_handle->inflate);
+    }
+    if (err != ESP_OK) {
+        esp_self_reflasher_abort_decoders(self_reflasher_handle);
+        if (self_reflasher_handle->verify_sha256) {
+            mbedtls_sha256_free(&self_reflasher_handle->sha256_ctx);
+        }
+        esp_self_reflasher_input_release(self_reflasher_handle, true);
+        return err;
+    }
+
+    self_reflasher_handle->download_segmented = segmented;
+    self_reflasher_handle->download_offset = resume_offset;
+    self_reflasher_handle->download_len = content_length > 0 ? content_length : 0;
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_download_end(esp_self_reflasher_t *self_reflasher_handle, esp_err_t err)
+{
+    size_t received_size = self_reflasher_handle->total_bin_data_size;
+    size_t image_size = received_size;
+    bool decoded = (self_reflasher_handle->inflate != NULL || self_reflasher_handle->patch != NULL);
+    if (err == ESP_OK) {
+        err = esp_self_reflasher_finish_decoders(self_reflasher_handle, &image_size);
+    } else {
+        esp_self_reflasher_abort_decoders(self_reflasher_handle);
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (self_reflasher_handle->verify_sha256) {
+        esp_self_reflasher_sha256_finish(&self_reflasher_handle->sha256_ctx, digest);
+    }
+
+    if (err != ESP_OK) {
+        esp_self_reflasher_input_release(self_reflasher_handle, true);
+        return err;
+    }
+
+    // From here on, the size is the one of the data written to the target
+    self_reflasher_handle->partition_curr_download_addr += image_size;
+    self_reflasher_handle->total_bin_data_size = image_size;
+
+    ESP_LOGI(TAG, "Total downloaded binary length: %d (0x%x)", received_size, received_size);
+    if (!esp_self_reflasher_input_complete(self_reflasher_handle, received_size)) {
+        ESP_LOGE(TAG, "%s: Error in receiving complete data", __func__);
+        esp_self_reflasher_input_release(self_reflasher_handle, true);
+        err = ESP_ERR_HTTP_WRITE_DATA;
+        return err;
+    }
+    ESP_LOGI(TAG, "File downloaded successfully");
+    // The probe connection stopped reading after the first range, it cannot be reused
+    esp_self_reflasher_input_release(self_reflasher_handle, self_reflasher_handle->download_segmented);
+
+    if (self_reflasher_handle->journal_active) {
+        self_reflasher_handle->journal_active = false;
+        esp_self_reflasher_journal_clear();
+    }
+
+    if (self_reflasher_handle->expected_size > 0 && received_size != self_reflasher_handle->expected_size) {
+        ESP_LOGE(TAG, "%s: Downloaded length does not match the expected size %u", __func__, self_reflasher_handle->expected_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (self_reflasher_handle->verify_sha256) {
+        err = esp_self_reflasher_sha256_check(self_reflasher_handle->expected_sha256, digest);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Downloaded image digest does not match", __func__);
+            return err;
+        }
+        ESP_LOGI(TAG, "Downloaded image digest verified");
+        if (!decoded) {
+            memcpy(self_reflasher_handle->staged_sha256, self_reflasher_handle->expected_sha256, SHA256_DIGEST_SIZE);
+        }
+    }
+    // Decoded data was checked against the digest carried by its header
+    self_reflasher_handle->staged_sha256_valid = (decoded || self_reflasher_handle->verify_sha256);
+
+    if (self_reflasher_handle->direct_stream && self_reflasher_handle->erase_clear_tail) {
+        err = esp_self_reflasher_erase_target_until(self_reflasher_handle, self_reflasher_handle->dest_region.region_size,
+                                                    self_reflasher_handle->dest_region.region_size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_download(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_err_t err = esp_self_reflasher_download_begin(self_reflasher_handle, true);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (self_reflasher_handle->download_segmented) {
+        err = esp_self_reflasher_segmented_download(self_reflasher_handle, self_reflasher_handle->http_client,
+                                                    self_reflasher_handle->download_len);
+        if (err == ESP_OK && self_reflasher_handle->verify_sha256) {
+            // Ranges arrive out of order, so the digest is computed over the written image
+            err = esp_self_reflasher_sha256_update_region(&self_reflasher_handle->sha256_ctx,
+                                                          esp_self_reflasher_target_address(self_reflasher_handle) +
+                                                          self_reflasher_handle->partition_curr_download_addr,
+                                                          self_reflasher_handle->total_bin_data_size);
+        }
+    } else {
+        err = esp_self_reflasher_receive_stream(self_reflasher_handle);
+    }
+
+    return esp_self_reflasher_download_end(self_reflasher_handle, err);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_download_bin(esp_self_reflasher_handle_t handle)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL ||
+        (self_reflasher_handle->target_partition == NULL && !self_reflasher_handle->direct_stream) ||
+        (self_reflasher_handle->http_config == NULL && self_reflasher_handle->source == NULL)) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (esp_self_reflasher_step_busy(self_reflasher_handle)) {
+        ESP_LOGE(TAG, "%s: A reflash is being stepped with esp_self_reflasher_step", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    int64_t start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+    esp_err_t err = esp_self_reflasher_download(self_reflasher_handle);
+    esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, ESP_SELF_REFLASHER_PHASE_DOWNLOAD, start);
+
+    return err;
+}
+
+/*
+ * Compare `len` bytes of the staging partition at `part_offset` against the flash
+ * contents at `address`. The buffer is split in halves, one for each side.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_compare_range(esp_self_reflasher_t *self_reflasher_handle, uint32_t part_offset,
+                                                                 uint32_t address, size_t len, char *data, bool *match)
+{
+    esp_err_t err;
+    char *staged = data;
+    char *current = data + BUFFER_SIZE / 2;
+    size_t data_len;
+
+    *match = false;
+    while (len > 0) {
+        data_len = MIN(len, BUFFER_SIZE / 2);
+
+        err = esp_self_reflasher_flash_read(esp_self_reflasher_staging_partition(self_reflasher_handle),
+                                            self_reflasher_handle->target_partition->address + part_offset, staged, data_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, self_reflasher_handle->target_partition->address + part_offset, esp_err_to_name(err));
+            return err;
+        }
+
+        err = esp_self_reflasher_flash_read(NULL, address, current, data_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, address, esp_err_to_name(err));
+            return err;
+        }
+
+        if (memcmp(staged, current, data_len) != 0) {
+            return ESP_OK;
+        }
+
+        part_offset += data_len;
+        address += data_len;
+        len -= data_len;
+    }
+
+    *match = true;
+    return ESP_OK;
+}
+
+/*
+ * Differential copy: destination sectors already holding the staged content are left
+ * untouched, and each run of differing sectors is erased and programmed in one go.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_copy_differential(esp_self_reflasher_t *self_reflasher_handle, char *data,
+                                                                     esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err;
+    uint32_t part_start = self_reflasher_handle->partition_curr_copy_offset;
+    uint32_t dest_start = self_reflasher_handle->dest_region.region_address;
+    uint32_t dest_end = dest_start + self_reflasher_handle->dest_region.region_size;
+    uint32_t image_end = dest_start + self_reflasher_handle->total_bin_data_size;
+    uint32_t sector_addr = dest_start;
+    uint32_t run_start = 0;
+    bool in_run = false;
+    bool match;
+
+    while (sector_addr < image_end || in_run) {
+        if (sector_addr < image_end) {
+            size_t len = MIN(image_end - sector_addr, SPI_FLASH_SEC_SIZE);
+            err = esp_self_reflasher_compare_range(self_reflasher_handle, part_start + (sector_addr - dest_start),
+                                                   sector_addr, len, data, &match);
+            if (err != ESP_OK) {
+                return err;
+            }
+        } else {
+            // Past the image end: flush the pending run
+            match = true;
+        }
+
+        if (!match && !in_run) {
+            run_start = sector_addr;
+            in_run = true;
+        } else if (match && in_run) {
+            uint32_t run_end = MIN(sector_addr, image_end);
+            uint32_t erase_addr = run_start;
+
+            ESP_LOGD(TAG, "Updating differing sectors 0x%08lx-0x%08lx", run_start, sector_addr);
+            err = esp_self_reflasher_erase_until(NULL, &erase_addr, sector_addr, sector_addr, sector_addr);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+                return err;
+            }
+
+            err = esp_self_reflasher_copy_range(self_reflasher_handle, part_start + (run_start - dest_start),
+                                                run_start, run_end - run_start, data, BUFFER_SIZE, journal);
+            if (err != ESP_OK) {
+                return err;
+            }
+            in_run = false;
+        }
+
+        if (match && sector_addr < image_end) {
+            self_reflasher_handle->copy_skipped_sectors++;
+        }
+        if (journal != NULL && !in_run) {
+            err = esp_self_reflasher_copy_journal_mark(journal, MIN(sector_addr + SPI_FLASH_SEC_SIZE, image_end));
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        if (!in_run) {
+            esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_COPY,
+                                               MIN(sector_addr + SPI_FLASH_SEC_SIZE, image_end) - dest_start,
+                                               self_reflasher_handle->total_bin_data_size);
+        }
+        sector_addr += SPI_FLASH_SEC_SIZE;
+    }
+
+    uint32_t tail_addr = ALIGN_UP(image_end, SPI_FLASH_SEC_SIZE);
+    if (self_reflasher_handle->erase_clear_tail && tail_addr < dest_end) {
+        err = esp_self_reflasher_erase_until(NULL, &tail_addr, dest_end, dest_end, dest_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    ESP_LOGI(TAG, "Differential copy skipped %lu of %lu sectors",
+             self_reflasher_handle->copy_skipped_sectors,
+             (self_reflasher_handle->total_bin_data_size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE);
+
+    return ESP_OK;
+}
+
+/*
+ * Decompress the compressed image of `src_len` bytes found at the flash address
+ * `src_address`, inside `src_partition` unless NULL, into `dest_region`,
+ * erasing it just ahead of the writes. The header is checked before anything is erased.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_inflate_to_region(const esp_partition_t *src_partition, uint32_t src_address, size_t src_len,
+                                                                     const addr_region_t *dest_region, bool erase_clear_tail, char *data,
+                                                                     mbedtls_sha256_context *sha256_ctx,
+                                                                     esp_self_reflasher_compressed_header_t *header)
+{
+    esp_err_t err;
+    esp_self_reflasher_inflate_t *inflate;
+    uint32_t dest_end = dest_region->region_address + dest_region->region_size;
+
+    err = esp_self_reflasher_flash_read(src_partition, src_address, header, sizeof(esp_self_reflasher_compressed_header_t));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to read the compressed image header, error: %s", __func__, esp_err_to_name(err));
+        return err;
+    }
+    if (src_len < sizeof(esp_self_reflasher_compressed_header_t) || header->magic != COMPRESSED_IMAGE_MAGIC) {
+        ESP_LOGE(TAG, "%s: Not a compressed image", __func__);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (header->image_size > dest_region->region_size) {
+        ESP_LOGE(TAG, "%s: Decompressed image size 0x%08lx exceeds destination region size", __func__, header->image_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_self_reflasher_region_sink_t region = {
+        .dest_address = dest_region->region_address,
+        .erase_addr = dest_region->region_address,
+        .erase_end = erase_clear_tail ? dest_end : dest_region->region_address + header->image_size,
+    };
+
+    err = esp_self_reflasher_inflate_start(esp_self_reflasher_region_sink, &region, &inflate);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Decompressing 0x%08x bytes into 0x%08lx bytes at address 0x%08lx",
+             src_len, header->image_size, dest_region->region_address);
+
+    for (size_t offset = 0; offset < src_len; ) {
+        size_t data_len = MIN(src_len - offset, BUFFER_SIZE);
+
+        err = esp_self_reflasher_flash_read(src_partition, src_address + offset, data, data_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to read compressed data, address: 0x%08lx, error: %s", __func__, src_address + offset, esp_err_to_name(err));
+            esp_self_reflasher_inflate_abort(inflate);
+            return err;
+        }
+
+        if (sha256_ctx != NULL) {
+            mbedtls_sha256_update(sha256_ctx, (const unsigned char *)data, data_len);
+        }
+
+        err = esp_self_reflasher_inflate_feed(inflate, (const uint8_t *)data, data_len);
+        if (err != ESP_OK) {
+            esp_self_reflasher_inflate_abort(inflate);
+            return err;
+        }
+        offset += data_len;
+    }
+
+    err = esp_self_reflasher_inflate_finish(inflate);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Erase whatever the writes did not reach, the whole tail when erase_clear_tail is set
+    return esp_self_reflasher_erase_until(NULL, &region.erase_addr, region.erase_end, region.erase_end, region.erase_end);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_copy_prepare(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_copy_journal_t *copy_journal,
+                                                         esp_self_reflasher_copy_journal_t **journal)
+{
+    uint32_t src_address = self_reflasher_handle->target_partition->address + self_reflasher_handle->partition_curr_copy_offset;
+    uint32_t address_write = self_reflasher_handle->dest_region.region_address;
+
+    // A compressed image is checked against the region once its header has been read
+    bool staged_compressed = self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch;
+    if (!staged_compressed && self_reflasher_handle->total_bin_data_size > self_reflasher_handle->dest_region.region_size) {
+        ESP_LOGE(TAG, "%s: Blob size exceeds destination region size", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (self_reflasher_handle->verify_sha256 && !self_reflasher_handle->staged_sha256_valid) {
+        ESP_LOGE(TAG, "%s: Staged image digest was not verified, refusing to copy", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *journal = NULL;
+    if (self_reflasher_handle->copy_journal) {
+        esp_self_reflasher_copy_journal_header_t header = {
+            .flags = (staged_compressed ? COPY_JOURNAL_FLAG_COMPRESSED : 0) |
+                     (self_reflasher_handle->erase_clear_tail ? COPY_JOURNAL_FLAG_CLEAR_TAIL : 0) |
+                     ((self_reflasher_handle->commit_header_last && !staged_compressed) ? COPY_JOURNAL_FLAG_HEADER_LAST : 0),
+            .src_address = src_address,
+            .src_len = self_reflasher_handle->total_bin_data_size,
+            .dest_address = address_write,
+            .dest_size = self_reflasher_handle->dest_region.region_size,
+        };
+        esp_err_t err = esp_self_reflasher_copy_journal_begin(copy_journal, &header);
+        if (err != ESP_OK) {
+            return err;
+        }
+        *journal = copy_journal;
+    }
+
+    ESP_LOGI(TAG, "Starting copy 0x%08x bytes from address 0x%08lx to address 0x%08lx",
+             self_reflasher_handle->total_bin_data_size, src_address, address_write);
+
+    self_reflasher_handle->copy_skipped_sectors = 0;
+
+    return ESP_OK;
+}
+
+/*
+ * Everything the header-last commit needs is set up before the destination is
+ * touched: the buffers are allocated and the source header sector is read into
+ * one of its own. Used both for a staged image and to resume its journaled copy.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_copy_header_last(const esp_partition_t *src_partition, uint32_t src_address, size_t len,
+                                                                    uint32_t dest_start, uint32_t erase_end, char *fallback,
+                                                                    esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err;
+
+    char *header = esp_self_reflasher_alloc_buffer(SPI_FLASH_SEC_SIZE);
+    if (header == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the header sector", __func__);
+        return ESP_ERR_NO_MEM;
+    }
 
-    if (self_reflasher_config == NULL) {
+    err = esp_self_reflasher_flash_read(src_partition, src_address, header, MIN(len, SPI_FLASH_SEC_SIZE));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, src_address, esp_err_to_name(err));
+    } else {
+        esp_self_reflasher_batch_buffer_t batch;
+        err = esp_self_reflasher_batch_buffer_get(&batch, fallback);
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_commit_header_last(dest_start, erase_end, src_address, len, header, batch.data, batch.size, journal);
+            esp_self_reflasher_batch_buffer_put(&batch);
+        }
+    }
+
+    heap_caps_free(header);
+    return err;
+}
+
+/*
+ * Hash the staged data again before the destination is erased, to catch it
+ * changing after the download.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_check_staged(esp_self_reflasher_t *self_reflasher_handle)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    esp_self_reflasher_sha256_start(&self_reflasher_handle->sha256_ctx);
+    esp_err_t err = esp_self_reflasher_sha256_update_staged(self_reflasher_handle, self_reflasher_handle->partition_curr_copy_offset,
+                                                            self_reflasher_handle->total_bin_data_size,
+                                                            self_reflasher_handle->buffer, BUFFER_SIZE,
+                                                            &self_reflasher_handle->sha256_ctx);
+    esp_self_reflasher_sha256_finish(&self_reflasher_handle->sha256_ctx, digest);
+    if (err == ESP_OK) {
+        err = esp_self_reflasher_sha256_check(self_reflasher_handle->staged_sha256, digest);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Staged image could not be checked against its digest, destination region left untouched", __func__);
+    }
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_copy(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_err_t err;
+    char *data;
+
+    if (self_reflasher_handle->direct_stream) {
+        ESP_LOGI(TAG, "Data was streamed directly to region: 0x%08lx, nothing to copy", self_reflasher_handle->dest_region.region_address);
+        return ESP_OK;
+    }
+
+    uint32_t part_curr_offset = self_reflasher_handle->partition_curr_copy_offset;
+    uint32_t address_write = self_reflasher_handle->dest_region.region_address;
+    uint32_t dest_end = self_reflasher_handle->dest_region.region_address + self_reflasher_handle->dest_region.region_size;
+    uint32_t erase_end = self_reflasher_handle->erase_clear_tail ? dest_end : address_write + self_reflasher_handle->total_bin_data_size;
+    uint32_t erase_addr = address_write;
+    bool staged_compressed = self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch;
+
+    // Compressed images are hashed as they are decompressed
+    if (!staged_compressed && self_reflasher_handle->staged_sha256_valid) {
+        err = esp_self_reflasher_check_staged(self_reflasher_handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    esp_self_reflasher_copy_journal_t copy_journal;
+    esp_self_reflasher_copy_journal_t *journal;
+    err = esp_self_reflasher_copy_prepare(self_reflasher_handle, &copy_journal, &journal);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    data = self_reflasher_handle->buffer;
+
+    if (staged_compressed) {
+        if (self_reflasher_handle->differential_copy) {
+            ESP_LOGW(TAG, "%s: Differential copy is not supported for compressed images, copying all sectors", __func__);
+        }
+        if (self_reflasher_handle->commit_header_last) {
+            ESP_LOGW(TAG, "%s: Compressed images are decompressed in order, the header sector is not copied last", __func__);
+        }
+
+        mbedtls_sha256_context *sha256_ctx = NULL;
+        if (self_reflasher_handle->staged_sha256_valid) {
+            sha256_ctx = &self_reflasher_handle->sha256_ctx;
+            esp_self_reflasher_sha256_start(sha256_ctx);
+        }
+
+        err = esp_self_reflasher_inflate_to_region(esp_self_reflasher_staging_partition(self_reflasher_handle),
+                                                   self_reflasher_handle->target_partition->address + part_curr_offset,
+                                                   self_reflasher_handle->total_bin_data_size,
+                                                   &self_reflasher_handle->dest_region, self_reflasher_handle->erase_clear_tail,
+                                                   data, sha256_ctx, &self_reflasher_handle->inflated_header);
+
+        if (sha256_ctx != NULL) {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            esp_self_reflasher_sha256_finish(sha256_ctx, digest);
+            if (err == ESP_OK) {
+                err = esp_self_reflasher_sha256_check(self_reflasher_handle->staged_sha256, digest);
+            }
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else if (self_reflasher_handle->commit_header_last) {
+        if (self_reflasher_handle->differential_copy) {
+            ESP_LOGW(TAG, "%s: Differential copy is not supported with commit_header_last, copying all sectors", __func__);
+        }
+        err = esp_self_reflasher_copy_header_last(esp_self_reflasher_staging_partition(self_reflasher_handle),
+                                                  self_reflasher_handle->target_partition->address + part_curr_offset,
+                                                  self_reflasher_handle->total_bin_data_size, address_write, erase_end,
+                                                  self_reflasher_handle->buffer, journal);
+        if (err != ESP_OK) {
+            return err;
+        }
+        // Progress is only reported once the header is in place
+        esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_COPY,
+                                           self_reflasher_handle->total_bin_data_size, self_reflasher_handle->total_bin_data_size);
+    } else if (self_reflasher_handle->differential_copy) {
+        err = esp_self_reflasher_copy_differential(self_reflasher_handle, data, journal);
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else {
+        uint32_t flash_ops = esp_self_reflasher_flash_op_count();
+        esp_self_reflasher_erase_plan_t erase_plan;
+        esp_self_reflasher_erase_plan(erase_addr, erase_end, erase_end, &erase_plan);
+        ESP_LOGI(TAG, "Erasing 0x%08lx-0x%08lx with %lu block(s) and %lu sector(s)",
+                 erase_plan.start, erase_plan.end, erase_plan.block_count, erase_plan.sector_count);
+
+        // The staged data is moved in batches of whole sectors, in a buffer of its own when there is memory for it
+        esp_self_reflasher_batch_buffer_t batch;
+        err = esp_self_reflasher_batch_buffer_get(&batch, data);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        // Erase the image footprint of the flash region before writing
+        err = esp_self_reflasher_erase_until(NULL, &erase_addr, erase_end, erase_end, erase_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+        } else {
+            ESP_LOGI(TAG, "Flash destination region erased successfully");
+        }
+
+        // One mmap window at a time, reporting the progress in between
+        size_t len = self_reflasher_handle->total_bin_data_size;
+        for (size_t offset = 0; err == ESP_OK && offset < len; offset += VERIFY_WINDOW_SIZE) {
+            size_t chunk_len = MIN(len - offset, VERIFY_WINDOW_SIZE);
+            err = esp_self_reflasher_copy_range(self_reflasher_handle, part_curr_offset + offset, address_write + offset,
+                                                chunk_len, batch.data, batch.size, journal);
+            if (err == ESP_OK) {
+                esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_COPY, offset + chunk_len, len);
+            }
+        }
+        esp_self_reflasher_batch_buffer_put(&batch);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "Copied 0x%08x bytes in %lu flash operation(s)", self_reflasher_handle->total_bin_data_size,
+                 esp_self_reflasher_flash_op_count() - flash_ops);
+    }
+
+    if (journal != NULL) {
+        err = esp_self_reflasher_copy_journal_end(journal);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+#if (CONFIG_LOG_DEFAULT_LEVEL >= ESP_LOG_DEBUG)
+    // Read first bytes to verify
+    uint32_t read_data = 0;
+    err = esp_self_reflasher_flash_read(NULL, self_reflasher_handle->dest_region.region_address, &read_data, 4);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to read from flash, error: %s", __func__, esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGD(TAG, "Data read from flash: 0x%08lx", read_data);
+#endif
+
+    ESP_LOGI(TAG, "Data copied from partition address 0x%08lx offset 0x%08lx to region: 0x%08lx",
+             self_reflasher_handle->target_partition->address, self_reflasher_handle->partition_curr_copy_offset,
+             self_reflasher_handle->dest_region.region_address);
+
+    return err;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_verify_copy(esp_self_reflasher_t *self_reflasher_handle)
+{
+    const addr_region_t *dest = &self_reflasher_handle->dest_region;
+
+    if (self_reflasher_handle->direct_stream) {
+        // There is no staged copy to compare against, so only the digest can be checked
+        if (!self_reflasher_handle->staged_sha256_valid) {
+            ESP_LOGW(TAG, "%s: No expected digest set, destination region not verified", __func__);
+            return ESP_OK;
+        }
+        return esp_self_reflasher_verify_digest(dest->region_address, self_reflasher_handle->total_bin_data_size,
+                                                self_reflasher_handle->staged_sha256);
+    }
+
+    if (self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch) {
+        return esp_self_reflasher_verify_digest(dest->region_address, self_reflasher_handle->inflated_header.image_size,
+                                                self_reflasher_handle->inflated_header.image_sha256);
+    }
+
+    return esp_self_reflasher_verify_region(dest->region_address,
+                                            self_reflasher_handle->target_partition->address + self_reflasher_handle->partition_curr_copy_offset,
+                                            self_reflasher_handle->total_bin_data_size, NULL);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_copy_to_region(esp_self_reflasher_handle_t handle)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL || (self_reflasher_handle->target_partition == NULL && !self_reflasher_handle->direct_stream)) {
         ESP_LOGE(TAG, "%s: Invalid argument", __func__);
         return ESP_ERR_INVALID_ARG;
     }
 
-    uint32_t address_read = self_reflasher_config->src_region.region_address;
-    uint32_t address_write = self_reflasher_config->dest_region.region_address;
+    if (esp_self_reflasher_step_busy(self_reflasher_handle)) {
+        ESP_LOGE(TAG, "%s: A reflash is being stepped with esp_self_reflasher_step", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    ESP_LOGI(TAG, "Starting copy 0x%08x bytes from address 0x%08lx to address 0x%08lx",
-             self_reflasher_config->src_bin_size, address_read, address_write);
-
-    // Erase first flash sector from the destination region
-    err = esp_flash_erase_region(esp_flash_default_chip,
-                                 address_write,
-                                 SPI_FLASH_SEC_SIZE);
-    while (address_read < self_reflasher_config->src_region.region_address + self_reflasher_config->src_bin_size) {
-        data_len = MIN((self_reflasher_config->src_region.region_address + self_reflasher_config->src_bin_size - address_read),
-                        BUFFER_SIZE);
-        ESP_LOGD(TAG, "Reading 0x%08x bytes (data_len) from address 0x%08lx",
-                 data_len, address_read);
-
-        if (address_write % SPI_FLASH_SEC_SIZE == 0) {
-            // Erase the flash sector as data is being written
-            err = esp_flash_erase_region(esp_flash_default_chip,
-                                         address_write,
-                                         SPI_FLASH_SEC_SIZE);
+    esp_err_t err = esp_self_reflasher_check_placement(&self_reflasher_handle->dest_region);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    int64_t start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+    err = esp_self_reflasher_copy(self_reflasher_handle);
+    esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, ESP_SELF_REFLASHER_PHASE_COPY, start);
+
+    if (err != ESP_OK || !self_reflasher_handle->verify_after_copy) {
+        return err;
+    }
+
+    start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+    err = esp_self_reflasher_verify_copy(self_reflasher_handle);
+    esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, ESP_SELF_REFLASHER_PHASE_VERIFY, start);
+
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_get_copy_skipped_sectors(esp_self_reflasher_handle_t handle, uint32_t *skipped_sectors)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL || skipped_sectors == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *skipped_sectors = self_reflasher_handle->copy_skipped_sectors;
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_get_stats(esp_self_reflasher_handle_t handle, esp_self_reflasher_stats_t *stats)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL || stats == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *stats = self_reflasher_handle->stats;
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_upd_next_config(const esp_self_reflasher_config_t *self_reflasher_config, esp_self_reflasher_handle_t handle)
+{
+    esp_err_t err;
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    ESP_LOGI(TAG, "Updating configuration for next download");
+    if (self_reflasher_handle == NULL ||
+        self_reflasher_config == NULL ||
+        (self_reflasher_handle->http_config == NULL && self_reflasher_handle->source == NULL)) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // The next image starts over from the first step
+    esp_self_reflasher_step_abort(self_reflasher_handle);
+    esp_self_reflasher_apply_config(self_reflasher_handle, self_reflasher_config);
+
+    if (self_reflasher_handle->direct_stream) {
+        self_reflasher_handle->partition_curr_copy_offset = 0;
+        self_reflasher_handle->partition_curr_download_addr = 0;
+        self_reflasher_handle->partition_erased_end = 0;
+        return esp_self_reflasher_check_direct_stream(self_reflasher_handle);
+    }
+
+    if (self_reflasher_handle->target_partition == NULL) {
+        ESP_LOGE(TAG, "%s: Handle was not initialized with a staging partition", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The staging area is kept and packed further, unless it overlaps the new destination region
+    const esp_partition_t *handle_partition = self_reflasher_handle->target_partition;
+    err = esp_self_reflasher_staging_select(self_reflasher_handle, self_reflasher_config->target_partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Partition overlaps destination", __func__);
+        esp_self_reflasher_free_handle(self_reflasher_handle);
+        return err;
+    }
+
+    if (handle_partition != self_reflasher_handle->target_partition) {
+        ESP_LOGI(TAG, "New partition target set");
+
+        self_reflasher_handle->partition_curr_copy_offset = 0;
+        self_reflasher_handle->partition_curr_download_addr = 0;
+        self_reflasher_handle->partition_erased_end = 0;
+
+        esp_self_reflasher_journal_t journal;
+        if (!self_reflasher_handle->erase_on_demand && esp_self_reflasher_find_journal(self_reflasher_handle, &journal)) {
+            ESP_LOGI(TAG, "Interrupted download found, partition kept to resume it");
+        } else if (!self_reflasher_handle->erase_on_demand) {
+            // Erase the set partition before writing the first time
+            int64_t start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+            err = esp_self_reflasher_erase_target_until(self_reflasher_handle,
+                                                           self_reflasher_handle->target_partition->size,
+                                                           self_reflasher_handle->target_partition->size);
+            esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, ESP_SELF_REFLASHER_PHASE_ERASE, start);
             if (err != ESP_OK) {
-                ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+                ESP_LOGE(TAG, "%s: Failed to erase partition: %s", __func__, esp_err_to_name(err));
+                esp_self_reflasher_free_handle(self_reflasher_handle);
                 return err;
             }
-            ESP_LOGD(TAG, "Flash destination sector erased successfully");
+
+            ESP_LOGI(TAG, "Partition erased successfully");
         }
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * The data goes through `batch`. With `journal` set, the copy progress is recorded
+ * in it, started afresh unless `resume` is set, in which case the copy goes on from
+ * the recorded progress.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_directly_copy(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                                 const esp_self_reflasher_batch_buffer_t *batch,
+                                                                 esp_self_reflasher_copy_journal_t *journal, bool resume)
+{
+    esp_err_t err = ESP_OK;
+
+    uint32_t address_read = self_reflasher_config->src_region.region_address;
+    uint32_t address_write = self_reflasher_config->dest_region.region_address;
+    uint32_t src_end = self_reflasher_config->src_region.region_address + self_reflasher_config->src_bin_size;
+    uint32_t dest_end = self_reflasher_config->dest_region.region_address + self_reflasher_config->dest_region.region_size;
+    uint32_t erase_end = self_reflasher_config->erase_clear_tail ? dest_end : address_write + self_reflasher_config->src_bin_size;
+    uint32_t erase_addr = address_write;
+    bool src_overlaps_dest = IS_REGION_OVERLAPPING(address_read, src_end, address_write, dest_end);
+
+    if (!self_reflasher_config->compressed && self_reflasher_config->src_bin_size > self_reflasher_config->dest_region.region_size) {
+        ESP_LOGE(TAG, "%s: Blob size exceeds destination region size", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
 
-        err = esp_flash_read(esp_flash_default_chip, data, address_read, data_len);
+    if (self_reflasher_config->expected_size > 0 && self_reflasher_config->src_bin_size != self_reflasher_config->expected_size) {
+        ESP_LOGE(TAG, "%s: Blob size does not match the expected size %u", __func__, self_reflasher_config->expected_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
 
+    if (self_reflasher_config->expected_sha256 != NULL) {
+        // The source must be checked before the destination is touched, which takes a pass over it
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        err = esp_self_reflasher_sha256_region(address_read, self_reflasher_config->src_bin_size, digest);
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_sha256_check(self_reflasher_config->expected_sha256, digest);
+        }
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, self_reflasher_config->src_region.region_address + address_read, esp_err_to_name(err));
+            ESP_LOGE(TAG, "%s: Source image digest does not match, refusing to copy", __func__);
             return err;
         }
+    }
 
-        err = esp_flash_write(esp_flash_default_chip, data, address_write, data_len);
+    if (journal != NULL && !resume) {
+        esp_self_reflasher_copy_journal_header_t header = {
+            .flags = (self_reflasher_config->compressed ? COPY_JOURNAL_FLAG_COMPRESSED : 0) |
+                     (self_reflasher_config->erase_clear_tail ? COPY_JOURNAL_FLAG_CLEAR_TAIL : 0),
+            .src_address = address_read,
+            .src_len = self_reflasher_config->src_bin_size,
+            .dest_address = address_write,
+            .dest_size = self_reflasher_config->dest_region.region_size,
+        };
+        err = esp_self_reflasher_copy_journal_begin(journal, &header);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: %s", __func__, address_write, esp_err_to_name(err));
             return err;
         }
-        ESP_LOGD(TAG, "Data written to address 0x%08lx successfully", address_write);
+    }
+
+    if (self_reflasher_config->compressed) {
+        // Decompressed data grows past the compressed data it comes from, so the regions must be apart
+        if (src_overlaps_dest) {
+            ESP_LOGE(TAG, "%s: Compressed source must not overlap the destination region", __func__);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_self_reflasher_compressed_header_t header;
+        err = esp_self_reflasher_inflate_to_region(NULL, address_read, self_reflasher_config->src_bin_size,
+                                                   &self_reflasher_config->dest_region, self_reflasher_config->erase_clear_tail,
+                                                   batch->data, NULL, &header);
+        if (err == ESP_OK && journal != NULL) {
+            err = esp_self_reflasher_copy_journal_end(journal);
+        }
+        if (err == ESP_OK && self_reflasher_config->verify_after_copy) {
+            err = esp_self_reflasher_verify_digest(address_write, header.image_size, header.image_sha256);
+        }
+        return err;
+    }
+
+    // Sectors recorded as done by the interrupted copy are kept as they are
+    if (resume) {
+        uint32_t done_len = esp_self_reflasher_copy_journal_done_len(journal);
+        address_read += done_len;
+        address_write += done_len;
+        erase_addr = ALIGN_UP(address_write, SPI_FLASH_SEC_SIZE);
+    }
+
+    ESP_LOGI(TAG, "Starting copy 0x%08lx bytes from address 0x%08lx to address 0x%08lx",
+             src_end - address_read, address_read, address_write);
+
+    esp_self_reflasher_region_sink_t region = {
+        .dest_address = address_write,
+        .erase_addr = erase_addr,
+        .erase_end = erase_end,
+    };
+    err = esp_self_reflasher_commit_region(&region, address_read, src_end - address_read, src_overlaps_dest,
+                                           batch->data, batch->size, journal);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-        address_read += data_len;
-        address_write += data_len;
+    if (journal != NULL) {
+        err = esp_self_reflasher_copy_journal_end(journal);
+        if (err != ESP_OK) {
+            return err;
+        }
     }
 
 #if (CONFIG_LOG_DEFAULT_LEVEL >= ESP_LOG_DEBUG)
     // Read first bytes to verify
     uint32_t read_data = 0;
-    err = esp_flash_read(esp_flash_default_chip, &read_data, self_reflasher_config->dest_region.region_address, 4);
+    err = esp_self_reflasher_flash_read(NULL, self_reflasher_config->dest_region.region_address, &read_data, 4);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "%s: Failed to read from flash, error: %s", __func__, esp_err_to_name(err));
         return err;
@@ -551,6 +1800,116 @@ IRAM_ATTR esp_err_t esp_self_reflasher_directly_copy_to_region(const esp_self_re
              self_reflasher_config->src_region.region_address,
              self_reflasher_config->dest_region.region_address);
 
+    if (self_reflasher_config->verify_after_copy) {
+        uint32_t dest_address = self_reflasher_config->dest_region.region_address;
+        // An overlapping source was overwritten by the copy, so only the digest can be checked
+        if (!src_overlaps_dest) {
+            err = esp_self_reflasher_verify_region(dest_address, self_reflasher_config->src_region.region_address,
+                                                   self_reflasher_config->src_bin_size, NULL);
+        } else if (self_reflasher_config->expected_sha256 != NULL) {
+            err = esp_self_reflasher_verify_digest(dest_address, self_reflasher_config->src_bin_size,
+                                                   self_reflasher_config->expected_sha256);
+        } else {
+            ESP_LOGW(TAG, "%s: Source overlaps destination and no expected digest set, destination region not verified", __func__);
+        }
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_directly_copy_to_region(const esp_self_reflasher_config_t *self_reflasher_config)
+{
+    if (self_reflasher_config == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = esp_self_reflasher_check_placement(&self_reflasher_config->dest_region);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // An overlapping source is overwritten by the copy, which therefore cannot be started over
+    esp_self_reflasher_copy_journal_t copy_journal;
+    esp_self_reflasher_copy_journal_t *journal = NULL;
+    if (self_reflasher_config->copy_journal) {
+        uint32_t src_start = self_reflasher_config->src_region.region_address;
+        uint32_t dest_start = self_reflasher_config->dest_region.region_address;
+        if (IS_REGION_OVERLAPPING(src_start, src_start + self_reflasher_config->src_bin_size,
+                                  dest_start, dest_start + self_reflasher_config->dest_region.region_size)) {
+            ESP_LOGW(TAG, "%s: Source overlaps destination, the copy is not journaled", __func__);
+        } else {
+            journal = &copy_journal;
+        }
+    }
+
+    esp_self_reflasher_batch_buffer_t batch;
+    if (esp_self_reflasher_batch_buffer_get(&batch, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory to copy data buffer", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = esp_self_reflasher_directly_copy(self_reflasher_config, &batch, journal, false);
+    esp_self_reflasher_batch_buffer_put(&batch);
+
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_resume_pending_copy(void)
+{
+    esp_self_reflasher_copy_journal_t journal;
+
+    if (esp_self_reflasher_copy_journal_load(&journal) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const esp_self_reflasher_copy_journal_header_t *header = &journal.header;
+    esp_self_reflasher_config_t self_reflasher_config = {
+        .src_region = { header->src_address, header->src_len },
+        .src_bin_size = header->src_len,
+        .dest_region = { header->dest_address, header->dest_size },
+        .erase_clear_tail = (header->flags & COPY_JOURNAL_FLAG_CLEAR_TAIL) != 0,
+        .compressed = (header->flags & COPY_JOURNAL_FLAG_COMPRESSED) != 0,
+    };
+
+    ESP_LOGI(TAG, "Resuming interrupted copy of 0x%08lx bytes from address 0x%08lx to address 0x%08lx, 0x%08lx bytes already done",
+             header->src_len, header->src_address, header->dest_address,
+             self_reflasher_config.compressed ? 0 : esp_self_reflasher_copy_journal_done_len(&journal));
+
+    // The header sector was not rewritten before the rest of the image, whose copy starts over ahead of it
+    if (header->flags & COPY_JOURNAL_FLAG_HEADER_LAST) {
+        uint32_t dest_end = header->dest_address + header->dest_size;
+        uint32_t erase_end = self_reflasher_config.erase_clear_tail ? dest_end : header->dest_address + header->src_len;
+        esp_err_t err = esp_self_reflasher_copy_header_last(NULL, header->src_address, header->src_len, header->dest_address,
+                                                            erase_end, NULL, &journal);
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_copy_journal_end(&journal);
+        }
+        return err;
+    }
+
+    esp_self_reflasher_batch_buffer_t batch;
+    if (esp_self_reflasher_batch_buffer_get(&batch, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory to copy data buffer", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = esp_self_reflasher_directly_copy(&self_reflasher_config, &batch, &journal, true);
+    esp_self_reflasher_batch_buffer_put(&batch);
+
     return err;
 }
 
+REFLASHER_ATTR esp_err_t esp_self_reflasher_deinit(esp_self_reflasher_handle_t handle)
+{
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_free_handle(self_reflasher_handle);
+
+    return ESP_OK;
+}
@@ -0,0 +1,349 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "spi_flash_mmap.h"
+#include "esp_flash_encrypt.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_commit.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_stats.h"
+#include "self_reflasher_partition.h"
+#include "self_reflasher_verify.h"
+
+DRAM_ATTR static const char TAG[] = "self_reflasher_commit";
+
+_Static_assert(COPY_BATCH_SIZE % SPI_FLASH_SEC_SIZE == 0, "Copy batch size must be a multiple of the flash sector size");
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_batch_buffer_get(esp_self_reflasher_batch_buffer_t *buffer, char *fallback)
+{
+    buffer->data = esp_self_reflasher_alloc_buffer(COPY_BATCH_SIZE);
+    buffer->size = COPY_BATCH_SIZE;
+    buffer->allocated = true;
+
+    if (buffer->data == NULL) {
+        ESP_LOGW(TAG, "%s: Not enough memory for a 0x%x bytes batch, copying 0x%x bytes at a time", __func__, COPY_BATCH_SIZE, BUFFER_SIZE);
+        buffer->size = BUFFER_SIZE;
+        buffer->allocated = (fallback == NULL);
+        buffer->data = (fallback != NULL) ? fallback : esp_self_reflasher_alloc_buffer(BUFFER_SIZE);
+    }
+
+    return (buffer->data != NULL) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_batch_buffer_put(esp_self_reflasher_batch_buffer_t *buffer)
+{
+    if (buffer->allocated) {
+        heap_caps_free(buffer->data);
+    }
+    buffer->data = NULL;
+}
+
+/* Length of the batch written at `address_write`, ending on a sector boundary when the buffer holds whole sectors */
+REFLASHER_COMMIT_ATTR static size_t esp_self_reflasher_batch_len(uint32_t address_write, size_t remaining, size_t data_size)
+{
+    size_t len = data_size;
+
+    if (data_size >= SPI_FLASH_SEC_SIZE) {
+        len = ALIGN_DOWN(address_write + data_size, SPI_FLASH_SEC_SIZE) - address_write;
+    }
+    return MIN(remaining, len);
+}
+
+/* Mapping of the staged data a copy reads, moved along as the copy goes */
+typedef struct {
+    const uint8_t            *ptr;         /* Mapped address of start, NULL when nothing is mapped */
+    uint32_t                 start;        /* Absolute flash address range the mapping covers */
+    uint32_t                 end;
+    spi_flash_mmap_handle_t  mmap_handle;
+} esp_self_reflasher_staging_window_t;
+
+/* Staged data is read through the cache, unless it would decrypt data that was written in the clear */
+REFLASHER_COMMIT_ATTR static bool esp_self_reflasher_staging_mappable(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    const esp_partition_t *part = esp_self_reflasher_staging_partition(self_reflasher_handle);
+
+    return !esp_flash_encryption_enabled() || (part != NULL && part->encrypted);
+}
+
+REFLASHER_COMMIT_ATTR static void esp_self_reflasher_window_release(esp_self_reflasher_staging_window_t *window)
+{
+    if (window->ptr != NULL) {
+        spi_flash_munmap(window->mmap_handle);
+        window->ptr = NULL;
+    }
+}
+
+/*
+ * Read `len` bytes of the source at the absolute address `address` into `data`,
+ * from a mmap window of `window_size` bytes moved along with the copy, or with
+ * a flash read when `window` is NULL.
+ */
+REFLASHER_COMMIT_ATTR static esp_err_t esp_self_reflasher_window_read(esp_self_reflasher_staging_window_t *window, const esp_partition_t *part,
+                                                                      uint32_t address, char *data, size_t len, size_t window_size)
+{
+    if (window == NULL) {
+        return esp_self_reflasher_flash_read(part, address, data, len);
+    }
+
+    if (window->ptr == NULL || address < window->start || address + len > window->end) {
+        esp_self_reflasher_window_release(window);
+
+        size_t map_len = MAX(len, window_size);
+        esp_err_t err = esp_self_reflasher_map_window(address, map_len, &window->ptr, &window->mmap_handle);
+        if (err != ESP_OK) {
+            window->ptr = NULL;
+            return err;
+        }
+        window->start = address;
+        window->end = address + map_len;
+    }
+
+    // The flash driver cannot program from flash mapped memory, so the batch buffer serves as bounce buffer
+    memcpy(data, window->ptr + (address - window->start), len);
+    return ESP_OK;
+}
+
+/*
+ * Copy `len` bytes from the staging partition offset `part_offset` to the
+ * already erased flash address `address_write`, recording the progress in
+ * `journal` when not NULL. The staged data is read through mmap windows of
+ * VERIFY_WINDOW_SIZE bytes, sparing a pass through the SPI flash driver.
+ * Progress is left to the callers, as the callback may run from flash.
+ */
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_copy_range(esp_self_reflasher_t *self_reflasher_handle, uint32_t part_offset,
+                                                              uint32_t address_write, size_t len, char *data, size_t data_size,
+                                                              esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err = ESP_OK;
+    uint32_t part_end = part_offset + len;
+    const esp_partition_t *part = esp_self_reflasher_staging_partition(self_reflasher_handle);
+    esp_self_reflasher_staging_window_t staging_window = { 0 };
+    esp_self_reflasher_staging_window_t *window = esp_self_reflasher_staging_mappable(self_reflasher_handle) ? &staging_window : NULL;
+    size_t data_len;
+
+    while (part_offset < part_end) {
+        uint32_t address_read = self_reflasher_handle->target_partition->address + part_offset;
+        data_len = esp_self_reflasher_batch_len(address_write, part_end - part_offset, data_size);
+        ESP_DRAM_LOGD(TAG, "Reading 0x%08x bytes (data_len) from address 0x%08lx", data_len, address_read);
+
+        err = esp_self_reflasher_window_read(window, part, address_read, data, data_len, MIN(part_end - part_offset, VERIFY_WINDOW_SIZE));
+        if (err != ESP_OK && window != NULL) {
+            ESP_DRAM_LOGW(TAG, "%s: Staged data could not be mapped, reading it through the flash driver", __func__);
+            window = NULL;
+            err = esp_self_reflasher_window_read(NULL, part, address_read, data, data_len, 0);
+        }
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: 0x%x", __func__, address_read, err);
+            break;
+        }
+
+        err = esp_self_reflasher_flash_write(NULL, address_write, data, data_len);
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: 0x%x", __func__, address_write, err);
+            break;
+        }
+        ESP_DRAM_LOGD(TAG, "Data written to address 0x%08lx successfully", address_write);
+
+        if (journal != NULL) {
+            err = esp_self_reflasher_copy_journal_mark(journal, address_write + data_len);
+            if (err != ESP_OK) {
+                break;
+            }
+        }
+
+        part_offset += data_len;
+        address_write += data_len;
+    }
+
+    esp_self_reflasher_window_release(&staging_window);
+    return err;
+}
+
+/*
+ * Hash `len` bytes of the staged data at the staging partition offset `part_offset`,
+ * read the way the copy reads them, through `data`, `data_size` bytes at a time.
+ */
+REFLASHER_ATTR esp_err_t esp_self_reflasher_sha256_update_staged(esp_self_reflasher_t *self_reflasher_handle, uint32_t part_offset,
+                                                                 size_t len, char *data, size_t data_size,
+                                                                 mbedtls_sha256_context *sha256_ctx)
+{
+    esp_err_t err = ESP_OK;
+    uint32_t part_end = part_offset + len;
+    const esp_partition_t *part = esp_self_reflasher_staging_partition(self_reflasher_handle);
+    esp_self_reflasher_staging_window_t staging_window = { 0 };
+    esp_self_reflasher_staging_window_t *window = esp_self_reflasher_staging_mappable(self_reflasher_handle) ? &staging_window : NULL;
+
+    while (part_offset < part_end) {
+        uint32_t address_read = self_reflasher_handle->target_partition->address + part_offset;
+        size_t data_len = MIN(part_end - part_offset, data_size);
+
+        err = esp_self_reflasher_window_read(window, part, address_read, data, data_len, MIN(part_end - part_offset, VERIFY_WINDOW_SIZE));
+        if (err != ESP_OK && window != NULL) {
+            window = NULL;
+            err = esp_self_reflasher_window_read(NULL, part, address_read, data, data_len, 0);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: %s", __func__, address_read, esp_err_to_name(err));
+            break;
+        }
+
+        mbedtls_sha256_update(sha256_ctx, (const unsigned char *)data, data_len);
+        part_offset += data_len;
+    }
+
+    esp_self_reflasher_window_release(&staging_window);
+    return err;
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_region_sink(void *ctx, uint32_t offset, const uint8_t *data, size_t len)
+{
+    esp_self_reflasher_region_sink_t *region = (esp_self_reflasher_region_sink_t *)ctx;
+    uint32_t address_write = region->dest_address + offset;
+
+    esp_err_t err = esp_self_reflasher_erase_until(NULL, &region->erase_addr, address_write + len, region->erase_end, region->erase_end);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to erase flash destination region, error: 0x%x", __func__, err);
+        return err;
+    }
+
+    err = esp_self_reflasher_flash_write(NULL, address_write, data, len);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: 0x%x", __func__, address_write, err);
+    }
+    return err;
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_commit_region(esp_self_reflasher_region_sink_t *region, uint32_t src_address, size_t src_len,
+                                                                 bool src_overlaps_dest, char *data, size_t data_size,
+                                                                 esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err;
+    size_t data_len;
+    uint32_t address_read = src_address;
+    uint32_t address_write = region->dest_address;
+    uint32_t src_end = src_address + src_len;
+    uint32_t batches = 0;
+    uint32_t flash_ops = esp_self_reflasher_flash_op_count();
+
+    while (address_read < src_end) {
+        data_len = esp_self_reflasher_batch_len(address_write, src_end - address_read, data_size);
+        ESP_DRAM_LOGD(TAG, "Reading 0x%08x bytes (data_len) from address 0x%08lx",
+                      data_len, address_read);
+
+        err = esp_self_reflasher_flash_read(NULL, address_read, data, data_len);
+
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to read from flash, address: 0x%08lx, error: 0x%x", __func__, address_read, err);
+            return err;
+        }
+
+        /*
+         * Erase the destination as data is being written. When the source lies inside the
+         * destination region, erase operations must not reach source data not yet read.
+         */
+        uint32_t erase_limit = region->erase_end;
+        if (src_overlaps_dest && address_read + data_len < src_end) {
+            erase_limit = MIN(region->erase_end, MAX(address_read + data_len, address_write + data_len));
+        }
+        err = esp_self_reflasher_erase_until(NULL, &region->erase_addr, address_write + data_len, region->erase_end, erase_limit);
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to erase flash destination region, error: 0x%x", __func__, err);
+            return err;
+        }
+
+        err = esp_self_reflasher_flash_write(NULL, address_write, data, data_len);
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: 0x%x", __func__, address_write, err);
+            return err;
+        }
+        ESP_DRAM_LOGD(TAG, "Data written to address 0x%08lx successfully", address_write);
+
+        if (journal != NULL) {
+            err = esp_self_reflasher_copy_journal_mark(journal, address_write + data_len);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        address_read += data_len;
+        address_write += data_len;
+        batches++;
+    }
+
+    // Erase whatever the writes did not reach, the whole tail when erase_clear_tail is set
+    err = esp_self_reflasher_erase_until(NULL, &region->erase_addr, region->erase_end, region->erase_end, region->erase_end);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to erase flash destination region, error: 0x%x", __func__, err);
+        return err;
+    }
+
+    ESP_DRAM_LOGI(TAG, "Copied 0x%08x bytes in %lu batch(es) and %lu flash operation(s)", src_len, batches,
+                  esp_self_reflasher_flash_op_count() - flash_ops);
+    return ESP_OK;
+}
+
+/*
+ * Until the first sector is rewritten, the destination still starts with the
+ * previous image header, which the bootloader checks the rest of the image
+ * against. Nothing is allocated or hashed here: the caller has read the first
+ * source sector into `header` and checked the source digest before the first erase.
+ */
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_commit_header_last(uint32_t dest_start, uint32_t erase_end, uint32_t src_address, size_t len,
+                                                                      const char *header, char *data, size_t data_size,
+                                                                      esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err;
+    uint32_t header_end = dest_start + SPI_FLASH_SEC_SIZE;
+    size_t header_len = MIN(len, SPI_FLASH_SEC_SIZE);
+    uint32_t erase_addr;
+    uint32_t flash_ops = esp_self_reflasher_flash_op_count();
+
+    // Sectors marked in the journal must hold their final content, which is not known before the header is written
+    esp_self_reflasher_region_sink_t region = {
+        .dest_address = header_end,
+        .erase_addr = header_end,
+        .erase_end = MAX(erase_end, header_end),
+    };
+    err = esp_self_reflasher_commit_region(&region, src_address + header_len, len - header_len, false, data, data_size, NULL);
+    if (err == ESP_OK) {
+        err = esp_self_reflasher_verify_region(header_end, src_address + header_len, len - header_len, NULL);
+    }
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Image body not committed, header sector 0x%08lx left untouched", __func__, dest_start);
+        return err;
+    }
+
+    erase_addr = dest_start;
+    err = esp_self_reflasher_erase_until(NULL, &erase_addr, header_end, header_end, header_end);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to erase the header sector, error: 0x%x", __func__, err);
+        return err;
+    }
+    err = esp_self_reflasher_flash_write(NULL, dest_start, header, header_len);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to write to flash, address: 0x%08lx, error: 0x%x", __func__, dest_start, err);
+        return err;
+    }
+    err = esp_self_reflasher_verify_region(dest_start, src_address, header_len, NULL);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (journal != NULL) {
+        err = esp_self_reflasher_copy_journal_mark(journal, dest_start + len);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    ESP_DRAM_LOGI(TAG, "Copied 0x%08x bytes in %lu flash operation(s), header sector 0x%08lx last", len,
+                  esp_self_reflasher_flash_op_count() - flash_ops, dest_start);
+    return ESP_OK;
+}
@@ -0,0 +1,145 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_copy_journal.h"
+#include "self_reflasher_stats.h"
+
+DRAM_ATTR static const char TAG[] = "self_reflasher_copy_journal";
+
+#define COPY_JOURNAL_PARTITION_LABEL              CONFIG_ESP_SELF_REFLASHER_COPY_JOURNAL_PARTITION_LABEL
+#define COPY_JOURNAL_PROGRESS_OFFSET              64
+#define COPY_JOURNAL_MAX_SECTORS                  (SPI_FLASH_SEC_SIZE - COPY_JOURNAL_PROGRESS_OFFSET)
+#define COPY_JOURNAL_CHUNK_SIZE                   64
+
+REFLASHER_ATTR static uint32_t esp_self_reflasher_copy_journal_crc(const esp_self_reflasher_copy_journal_header_t *header)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(esp_self_reflasher_copy_journal_header_t, crc));
+}
+
+REFLASHER_COMMIT_ATTR static uint32_t esp_self_reflasher_copy_journal_sectors(const esp_self_reflasher_copy_journal_header_t *header)
+{
+    return (header->src_len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+}
+
+REFLASHER_ATTR static const esp_partition_t *esp_self_reflasher_copy_journal_partition(void)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, COPY_JOURNAL_PARTITION_LABEL);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_copy_journal_begin(esp_self_reflasher_copy_journal_t *journal,
+                                                               const esp_self_reflasher_copy_journal_header_t *header)
+{
+    journal->partition = esp_self_reflasher_copy_journal_partition();
+    if (journal->partition == NULL) {
+        ESP_LOGE(TAG, "%s: Copy journal partition \"%s\" not found", __func__, COPY_JOURNAL_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (esp_self_reflasher_copy_journal_sectors(header) > COPY_JOURNAL_MAX_SECTORS) {
+        ESP_LOGE(TAG, "%s: Copy of 0x%08lx bytes is too large to be journaled", __func__, header->src_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    journal->header = *header;
+    journal->header.magic = COPY_JOURNAL_MAGIC;
+    journal->header.crc = esp_self_reflasher_copy_journal_crc(&journal->header);
+    journal->sectors_done = 0;
+
+    // The header is only valid once fully programmed, before anything in the destination changes
+    esp_err_t err = esp_self_reflasher_flash_erase(NULL, journal->partition->address, SPI_FLASH_SEC_SIZE);
+    if (err == ESP_OK) {
+        err = esp_self_reflasher_flash_write(NULL, journal->partition->address, &journal->header, sizeof(journal->header));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to write the copy journal, error: %s", __func__, esp_err_to_name(err));
+    }
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_copy_journal_load(esp_self_reflasher_copy_journal_t *journal)
+{
+    uint8_t progress[COPY_JOURNAL_CHUNK_SIZE];
+
+    journal->partition = esp_self_reflasher_copy_journal_partition();
+    if (journal->partition == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t err = esp_self_reflasher_flash_read(NULL, journal->partition->address, &journal->header, sizeof(journal->header));
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (journal->header.magic != COPY_JOURNAL_MAGIC ||
+        journal->header.crc != esp_self_reflasher_copy_journal_crc(&journal->header) ||
+        esp_self_reflasher_copy_journal_sectors(&journal->header) > COPY_JOURNAL_MAX_SECTORS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Count the leading sectors marked as done
+    uint32_t sectors = esp_self_reflasher_copy_journal_sectors(&journal->header);
+    journal->sectors_done = 0;
+    while (journal->sectors_done < sectors) {
+        size_t len = MIN(sectors - journal->sectors_done, COPY_JOURNAL_CHUNK_SIZE);
+        err = esp_self_reflasher_flash_read(NULL, journal->partition->address + COPY_JOURNAL_PROGRESS_OFFSET + journal->sectors_done,
+                                            progress, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (progress[i] != 0x00) {
+                return ESP_OK;
+            }
+            journal->sectors_done++;
+        }
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_copy_journal_mark(esp_self_reflasher_copy_journal_t *journal, uint32_t done_address)
+{
+    uint8_t zeros[COPY_JOURNAL_CHUNK_SIZE];
+    uint32_t sectors = esp_self_reflasher_copy_journal_sectors(&journal->header);
+    uint32_t done_len = done_address - journal->header.dest_address;
+    uint32_t target = (done_len >= journal->header.src_len) ? sectors : done_len / SPI_FLASH_SEC_SIZE;
+
+    memset(zeros, 0x00, sizeof(zeros));
+    while (journal->sectors_done < target) {
+        size_t len = MIN(target - journal->sectors_done, COPY_JOURNAL_CHUNK_SIZE);
+        esp_err_t err = esp_self_reflasher_flash_write(NULL, journal->partition->address + COPY_JOURNAL_PROGRESS_OFFSET + journal->sectors_done,
+                                                       zeros, len);
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to update the copy journal, error: 0x%x", __func__, err);
+            return err;
+        }
+        journal->sectors_done += len;
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_COMMIT_ATTR uint32_t esp_self_reflasher_copy_journal_done_len(const esp_self_reflasher_copy_journal_t *journal)
+{
+    return MIN(journal->sectors_done * SPI_FLASH_SEC_SIZE, journal->header.src_len);
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_copy_journal_end(esp_self_reflasher_copy_journal_t *journal)
+{
+    esp_err_t err = esp_self_reflasher_flash_erase(NULL, journal->partition->address, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to erase the copy journal, error: 0x%x", __func__, err);
+    }
+    return err;
+}
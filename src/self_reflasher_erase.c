@@ -0,0 +1,87 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "spi_flash_mmap.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_stats.h"
+
+DRAM_ATTR static const char TAG[] = "self_reflasher_erase";
+
+/*
+ * The esp_flash driver only exposes 64KB block and 4KB sector erase commands,
+ * so the plan is made of those two sizes.
+ */
+REFLASHER_COMMIT_ATTR uint32_t esp_self_reflasher_erase_op_size(uint32_t address, uint32_t end, uint32_t limit)
+{
+    end = ALIGN_UP(end, SPI_FLASH_SEC_SIZE);
+    limit = ALIGN_UP(limit, SPI_FLASH_SEC_SIZE);
+
+    if (address % FLASH_BLOCK_SIZE != 0 || address + FLASH_BLOCK_SIZE > limit) {
+        return SPI_FLASH_SEC_SIZE;
+    }
+
+    if (address + FLASH_BLOCK_SIZE <= end) {
+        return FLASH_BLOCK_SIZE;
+    }
+
+    // Block only partially used: erase it whole if it is cheaper than its sectors and the caller allows erasing past the footprint
+    if ((end - address) / SPI_FLASH_SEC_SIZE >= ERASE_BLOCK_MIN_SECTORS) {
+        return FLASH_BLOCK_SIZE;
+    }
+
+    return SPI_FLASH_SEC_SIZE;
+}
+
+REFLASHER_COMMIT_ATTR void esp_self_reflasher_erase_plan(uint32_t start, uint32_t end, uint32_t limit, esp_self_reflasher_erase_plan_t *plan)
+{
+    uint32_t address = start;
+
+    plan->start = start;
+    plan->block_count = 0;
+    plan->sector_count = 0;
+
+    while (address < end) {
+        uint32_t size = esp_self_reflasher_erase_op_size(address, end, limit);
+        if (size == FLASH_BLOCK_SIZE) {
+            plan->block_count++;
+        } else {
+            plan->sector_count++;
+        }
+        address += size;
+    }
+
+    plan->end = address;
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_erase_until(const esp_partition_t *partition, uint32_t *erase_addr,
+                                                               uint32_t until, uint32_t end, uint32_t limit)
+{
+    esp_err_t err;
+
+    if (*erase_addr % SPI_FLASH_SEC_SIZE != 0) {
+        ESP_DRAM_LOGE(TAG, "%s: Erase address 0x%08lx is not sector aligned", __func__, *erase_addr);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (*erase_addr < until) {
+        uint32_t size = esp_self_reflasher_erase_op_size(*erase_addr, MAX(end, until), limit);
+
+        err = esp_self_reflasher_flash_erase(partition, *erase_addr, size);
+        if (err != ESP_OK) {
+            ESP_DRAM_LOGE(TAG, "%s: Failed to erase 0x%08lx bytes at address 0x%08lx: 0x%x", __func__, size, *erase_addr, err);
+            return err;
+        }
+        ESP_DRAM_LOGD(TAG, "Erased 0x%08lx bytes at address 0x%08lx", size, *erase_addr);
+
+        *erase_addr += size;
+    }
+
+    return ESP_OK;
+}
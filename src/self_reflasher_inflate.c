@@ -0,0 +1,163 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "rom/miniz.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_inflate.h"
+
+static const char *TAG = "self_reflasher_inflate";
+
+/*
+ * tinfl from the ROM is used, so decompression keeps working while the flash
+ * holding the application is being overwritten. Without a non-wrapping output
+ * buffer it needs a dictionary of the full deflate window size.
+ */
+#define INFLATE_WINDOW_SIZE                       TINFL_LZ_DICT_SIZE
+
+struct esp_self_reflasher_inflate {
+    tinfl_decompressor                     decomp;
+    uint8_t                                *window;
+    size_t                                 window_offset;
+    esp_self_reflasher_inflate_sink_t      sink;
+    void                                   *sink_ctx;
+    esp_self_reflasher_compressed_header_t header;
+    size_t                                 header_fill;
+    uint32_t                               out_total;
+    bool                                   done;
+    mbedtls_sha256_context                 sha256_ctx;
+};
+
+REFLASHER_ATTR static void esp_self_reflasher_inflate_free(esp_self_reflasher_inflate_t *inflate)
+{
+    mbedtls_sha256_free(&inflate->sha256_ctx);
+    heap_caps_free(inflate->window);
+    heap_caps_free(inflate);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_inflate_start(esp_self_reflasher_inflate_sink_t sink, void *sink_ctx, esp_self_reflasher_inflate_t **inflate)
+{
+    esp_self_reflasher_inflate_t *ctx = heap_caps_calloc(1, sizeof(esp_self_reflasher_inflate_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (ctx == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the decompressor", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ctx->window = heap_caps_malloc(INFLATE_WINDOW_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (ctx->window == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the decompression window", __func__);
+        heap_caps_free(ctx);
+        return ESP_ERR_NO_MEM;
+    }
+
+    tinfl_init(&ctx->decomp);
+    mbedtls_sha256_init(&ctx->sha256_ctx);
+    mbedtls_sha256_starts(&ctx->sha256_ctx, 0);
+    ctx->sink = sink;
+    ctx->sink_ctx = sink_ctx;
+
+    *inflate = ctx;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_inflate_feed(esp_self_reflasher_inflate_t *inflate, const uint8_t *data, size_t len)
+{
+    if (inflate->header_fill < sizeof(esp_self_reflasher_compressed_header_t)) {
+        size_t header_len = MIN(len, sizeof(esp_self_reflasher_compressed_header_t) - inflate->header_fill);
+        memcpy((uint8_t *)&inflate->header + inflate->header_fill, data, header_len);
+        inflate->header_fill += header_len;
+        data += header_len;
+        len -= header_len;
+
+        if (inflate->header_fill == sizeof(esp_self_reflasher_compressed_header_t) &&
+            inflate->header.magic != COMPRESSED_IMAGE_MAGIC) {
+            ESP_LOGE(TAG, "%s: Invalid compressed image header magic 0x%08lx", __func__, inflate->header.magic);
+            return ESP_ERR_INVALID_VERSION;
+        }
+    }
+
+    // The output window may fill before the input is used up, tinfl then keeps output pending
+    // that is only produced by calling it again, with no more input if there is none left
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    while (!inflate->done && (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+        size_t in_len = len;
+        size_t out_len = INFLATE_WINDOW_SIZE - inflate->window_offset;
+        uint8_t *out = inflate->window + inflate->window_offset;
+
+        status = tinfl_decompress(&inflate->decomp, data, &in_len, inflate->window, out, &out_len,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_len;
+        len -= in_len;
+
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "%s: Corrupted compressed stream, status %d", __func__, status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        if (out_len > 0) {
+            if (inflate->out_total + out_len > inflate->header.image_size) {
+                ESP_LOGE(TAG, "%s: Decompressed data exceeds the image size 0x%08lx", __func__, inflate->header.image_size);
+                return ESP_ERR_INVALID_SIZE;
+            }
+            mbedtls_sha256_update(&inflate->sha256_ctx, out, out_len);
+            esp_err_t err = inflate->sink(inflate->sink_ctx, inflate->out_total, out, out_len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            inflate->out_total += out_len;
+            inflate->window_offset = (inflate->window_offset + out_len) & (INFLATE_WINDOW_SIZE - 1);
+        }
+
+        inflate->done = (status == TINFL_STATUS_DONE);
+    }
+
+    if (len > 0) {
+        ESP_LOGE(TAG, "%s: 0x%08x bytes found after the end of the compressed stream", __func__, len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR const esp_self_reflasher_compressed_header_t *esp_self_reflasher_inflate_header(const esp_self_reflasher_inflate_t *inflate)
+{
+    if (inflate->header_fill < sizeof(esp_self_reflasher_compressed_header_t)) {
+        return NULL;
+    }
+    return &inflate->header;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_inflate_finish(esp_self_reflasher_inflate_t *inflate)
+{
+    esp_err_t err = ESP_OK;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    mbedtls_sha256_finish(&inflate->sha256_ctx, digest);
+
+    if (!inflate->done || inflate->out_total != inflate->header.image_size) {
+        ESP_LOGE(TAG, "%s: Compressed stream ended after 0x%08lx bytes, expected 0x%08lx", __func__,
+                 inflate->out_total, inflate->header.image_size);
+        err = ESP_ERR_INVALID_SIZE;
+    } else if (memcmp(digest, inflate->header.image_sha256, SHA256_DIGEST_SIZE) != 0) {
+        ESP_LOGE(TAG, "%s: Decompressed image digest does not match its header", __func__);
+        err = ESP_ERR_INVALID_CRC;
+    } else {
+        ESP_LOGI(TAG, "Decompressed 0x%08lx bytes", inflate->out_total);
+    }
+
+    esp_self_reflasher_inflate_free(inflate);
+    return err;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_inflate_abort(esp_self_reflasher_inflate_t *inflate)
+{
+    esp_self_reflasher_inflate_free(inflate);
+}
@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_partition.h"
+
+static const char *TAG = "self_reflasher_job";
+
+/* Where an image of the job was staged, to copy it once all of them are staged */
+typedef struct {
+    uint32_t  copy_offset;
+    size_t    size;
+    bool      sha256_valid;
+    uint8_t   sha256[SHA256_DIGEST_SIZE];
+} esp_self_reflasher_job_staged_t;
+
+/* The staging rule of a single image, applied to every image of the job */
+REFLASHER_ATTR static bool esp_self_reflasher_job_partition_free(const esp_partition_t *part, const esp_self_reflasher_config_t *self_reflasher_config,
+                                                                 const esp_self_reflasher_job_image_t *images, size_t image_count)
+{
+    for (size_t i = 0; i < image_count; i++) {
+        const addr_region_t *base = self_reflasher_config->base_region.region_size > 0 ?
+                                    &self_reflasher_config->base_region : &images[i].dest_region;
+        if (!esp_self_reflasher_partition_apart(part, &images[i].dest_region, self_reflasher_config->delta_patch ? base : NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Every image is staged in the same partition, which must therefore be free for
+ * all of them: not the running partition, and apart from all destination regions
+ * and delta patch bases.
+ */
+REFLASHER_ATTR const esp_partition_t *esp_self_reflasher_job_partition(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                                       const esp_self_reflasher_job_image_t *images, size_t image_count)
+{
+    if (self_reflasher_config->target_partition != NULL) {
+        if (!esp_self_reflasher_job_partition_free(self_reflasher_config->target_partition, self_reflasher_config, images, image_count)) {
+            return NULL;
+        }
+        return self_reflasher_config->target_partition;
+    }
+
+    const esp_partition_t *part = NULL;
+    uint8_t part_count = esp_self_reflasher_get_ota_partition_count();
+    for (uint8_t i = 0; i < part_count; i++) {
+        part = esp_self_reflasher_get_next_partition(part);
+        if (esp_self_reflasher_job_partition_free(part, self_reflasher_config, images, image_count)) {
+            return part;
+        }
+    }
+    return NULL;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_job_image_config(esp_self_reflasher_config_t *image_config, esp_http_client_config_t *http_config,
+                                                               const esp_self_reflasher_job_image_t *image)
+{
+    http_config->url = image->url;
+    image_config->dest_region = image->dest_region;
+    image_config->expected_sha256 = image->expected_sha256;
+    image_config->expected_size = image->expected_size;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_job_stage(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_config_t *image_config,
+                                                             esp_http_client_config_t *http_config, const esp_self_reflasher_job_image_t *images,
+                                                             size_t image_count, esp_self_reflasher_job_staged_t *staged)
+{
+    for (size_t i = 0; i < image_count; i++) {
+        esp_self_reflasher_job_image_config(image_config, http_config, &images[i]);
+        esp_self_reflasher_apply_config(self_reflasher_handle, image_config);
+
+        ESP_LOGI(TAG, "Staging image %u of %u: %s", i + 1, image_count, images[i].url);
+        esp_err_t err = esp_self_reflasher_download_bin(self_reflasher_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to stage image %u, no destination region was written", __func__, i + 1);
+            return err;
+        }
+
+        staged[i].copy_offset = self_reflasher_handle->partition_curr_copy_offset;
+        staged[i].size = self_reflasher_handle->total_bin_data_size;
+        staged[i].sha256_valid = self_reflasher_handle->staged_sha256_valid;
+        memcpy(staged[i].sha256, self_reflasher_handle->staged_sha256, SHA256_DIGEST_SIZE);
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_job_commit(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_config_t *image_config,
+                                                              esp_http_client_config_t *http_config, const esp_self_reflasher_job_image_t *images,
+                                                              size_t image_count, const esp_self_reflasher_job_staged_t *staged)
+{
+    for (size_t i = 0; i < image_count; i++) {
+        esp_self_reflasher_job_image_config(image_config, http_config, &images[i]);
+        esp_self_reflasher_apply_config(self_reflasher_handle, image_config);
+
+        self_reflasher_handle->partition_curr_copy_offset = staged[i].copy_offset;
+        self_reflasher_handle->total_bin_data_size = staged[i].size;
+        self_reflasher_handle->staged_sha256_valid = staged[i].sha256_valid;
+        memcpy(self_reflasher_handle->staged_sha256, staged[i].sha256, SHA256_DIGEST_SIZE);
+
+        ESP_LOGI(TAG, "Committing image %u of %u to region: 0x%08lx", i + 1, image_count, images[i].dest_region.region_address);
+        esp_err_t err = esp_self_reflasher_copy_to_region(self_reflasher_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to commit image %u", __func__, i + 1);
+            return err;
+        }
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_run_job(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                    const esp_self_reflasher_job_image_t *images, size_t image_count)
+{
+    esp_err_t err;
+    esp_self_reflasher_handle_t handle = NULL;
+
+    if (self_reflasher_config == NULL || self_reflasher_config->http_config == NULL || images == NULL || image_count == 0) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < image_count; i++) {
+        if (images[i].url == NULL) {
+            ESP_LOGE(TAG, "%s: Image %u has no URL", __func__, i + 1);
+            return ESP_ERR_INVALID_ARG;
+        }
+        err = esp_self_reflasher_check_placement(&images[i].dest_region);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    if (self_reflasher_config->direct_stream || self_reflasher_config->resumable) {
+        ESP_LOGE(TAG, "%s: Jobs stage every image first, direct_stream and resumable are not supported", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (self_reflasher_config->source != NULL) {
+        ESP_LOGE(TAG, "%s: Job images are downloaded from their URL, a source is not supported", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const esp_partition_t *target_partition = esp_self_reflasher_job_partition(self_reflasher_config, images, image_count);
+    if (target_partition == NULL) {
+        ESP_LOGE(TAG, "%s: No staging partition free for all images", __func__);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_self_reflasher_job_staged_t *staged = calloc(image_count, sizeof(esp_self_reflasher_job_staged_t));
+    if (staged == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the job", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The URL of the configuration is replaced by the one of each image
+    esp_http_client_config_t http_config = *self_reflasher_config->http_config;
+    http_config.keep_alive_enable = true;
+
+    esp_self_reflasher_config_t image_config = *self_reflasher_config;
+    image_config.http_config = &http_config;
+    image_config.target_partition = target_partition;
+    esp_self_reflasher_job_image_config(&image_config, &http_config, &images[0]);
+
+    err = esp_self_reflasher_init(&image_config, &handle);
+    if (err == ESP_OK) {
+        esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+        self_reflasher_handle->keep_connection = true;
+        self_reflasher_handle->staging_pinned = true;
+
+        err = esp_self_reflasher_job_stage(self_reflasher_handle, &image_config, &http_config, images, image_count, staged);
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_job_commit(self_reflasher_handle, &image_config, &http_config, images, image_count, staged);
+        }
+        esp_self_reflasher_deinit(handle);
+    }
+
+    free(staged);
+    return err;
+}
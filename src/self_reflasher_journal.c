@@ -0,0 +1,103 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_journal.h"
+
+static const char *TAG = "self_reflasher_journal";
+
+#define JOURNAL_NVS_NAMESPACE                     "self_reflasher"
+#define JOURNAL_NVS_KEY                           "journal"
+#define JOURNAL_VERSION                           1
+
+REFLASHER_ATTR static uint32_t esp_self_reflasher_crc_str(uint32_t crc, const char *str)
+{
+    if (str == NULL) {
+        return crc;
+    }
+    return esp_rom_crc32_le(crc, (const uint8_t *)str, strlen(str));
+}
+
+REFLASHER_ATTR uint32_t esp_self_reflasher_journal_url_crc(const esp_http_client_config_t *http_config)
+{
+    if (http_config->url != NULL) {
+        return esp_self_reflasher_crc_str(0, http_config->url);
+    }
+
+    uint32_t crc = esp_self_reflasher_crc_str(0, http_config->host);
+    return esp_self_reflasher_crc_str(crc, http_config->path);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_journal_load(esp_self_reflasher_journal_t *journal)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(esp_self_reflasher_journal_t);
+
+    esp_err_t err = nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    err = nvs_get_blob(nvs, JOURNAL_NVS_KEY, journal, &len);
+    nvs_close(nvs);
+
+    if (err != ESP_OK || len != sizeof(esp_self_reflasher_journal_t) || journal->version != JOURNAL_VERSION) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    journal->etag[JOURNAL_ETAG_MAX_LEN - 1] = '\0';
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_journal_save(const esp_self_reflasher_journal_t *journal)
+{
+    nvs_handle_t nvs;
+    esp_self_reflasher_journal_t entry = *journal;
+
+    entry.version = JOURNAL_VERSION;
+
+    esp_err_t err = nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to open NVS namespace, error: %s", __func__, esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs, JOURNAL_NVS_KEY, &entry, sizeof(entry));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to save the download journal, error: %s", __func__, esp_err_to_name(err));
+    }
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_journal_clear(void)
+{
+    nvs_handle_t nvs;
+
+    esp_err_t err = nvs_open(JOURNAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_erase_key(nvs, JOURNAL_NVS_KEY);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = ESP_OK;
+    }
+    nvs_close(nvs);
+
+    return err;
+}
@@ -0,0 +1,291 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "spi_flash_mmap.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_partition.h"
+
+static const char *TAG = "self_reflasher_partition";
+
+static const esp_partition_t *s_partition_index[PARTITION_INDEX_MAX_COUNT];
+static size_t s_partition_count = 0;
+static bool s_partition_index_built = false;
+
+const esp_partition_t* esp_self_reflasher_get_running_partition(void)
+{
+    static const esp_partition_t *curr_partition = NULL;
+
+    /*
+     * Currently running partition is unlikely to change across reset cycle,
+     * so it can be cached here, and avoid lookup on every flash write operation.
+     */
+    if (curr_partition != NULL) {
+        return curr_partition;
+    }
+
+    /* Find the flash address of this exact function. By definition that is part
+       of the currently running firmware. Then find the enclosing partition. */
+    size_t phys_offs = spi_flash_cache2phys(esp_self_reflasher_get_running_partition);
+
+    assert (phys_offs != SPI_FLASH_CACHE2PHYS_FAIL); /* indicates cache2phys lookup is buggy */
+
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP,
+                                                     ESP_PARTITION_SUBTYPE_ANY,
+                                                     NULL);
+    assert(it != NULL); /* has to be at least one app partition */
+
+    while (it != NULL) {
+        const esp_partition_t *p = esp_partition_get(it);
+        if (p->address <= phys_offs && p->address + p->size > phys_offs) {
+            esp_partition_iterator_release(it);
+            curr_partition = p;
+            return p;
+        }
+        it = esp_partition_next(it);
+    }
+
+    abort(); /* Partition table is invalid or corrupt */
+}
+
+REFLASHER_ATTR bool esp_self_reflasher_overlaps_running(const addr_region_t *region)
+{
+    const esp_partition_t *running = esp_self_reflasher_get_running_partition();
+
+    return IS_REGION_OVERLAPPING(running->address, running->address + running->size,
+                                 region->region_address, region->region_address + region->region_size);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_check_placement(const addr_region_t *dest)
+{
+#if CONFIG_ESP_SELF_REFLASHER_PLACE_COMMIT_IN_IRAM
+    // Only the commit routines are in IRAM, the code calling them runs from flash in between
+    if (esp_self_reflasher_overlaps_running(dest)) {
+        ESP_LOGE(TAG, "%s: Destination 0x%08lx overlaps the running partition, which cannot be rewritten with the commit phase only in IRAM",
+                 __func__, dest->region_address);
+        return ESP_ERR_INVALID_STATE;
+    }
+#endif
+    return ESP_OK;
+}
+
+/* The partition table does not change at runtime, a single pass over it is enough */
+REFLASHER_ATTR static void esp_self_reflasher_partition_index_build(void)
+{
+    if (s_partition_index_built) {
+        return;
+    }
+
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    while (it != NULL) {
+        const esp_partition_t *p = esp_partition_get(it);
+        it = esp_partition_next(it);
+
+        if (p->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_MIN || p->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX ||
+            s_partition_count == PARTITION_INDEX_MAX_COUNT) {
+            continue;
+        }
+
+        size_t i = s_partition_count++;
+        while (i > 0 && s_partition_index[i - 1]->address > p->address) {
+            s_partition_index[i] = s_partition_index[i - 1];
+            i--;
+        }
+        s_partition_index[i] = p;
+    }
+    esp_partition_iterator_release(it);
+
+    s_partition_index_built = true;
+    ESP_LOGD(TAG, "%u OTA partitions indexed", s_partition_count);
+}
+
+REFLASHER_ATTR size_t esp_self_reflasher_partition_count(void)
+{
+    esp_self_reflasher_partition_index_build();
+    return s_partition_count;
+}
+
+REFLASHER_ATTR const esp_partition_t *esp_self_reflasher_partition_at(size_t index)
+{
+    esp_self_reflasher_partition_index_build();
+    return (index < s_partition_count) ? s_partition_index[index] : NULL;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_partition_find_index(const esp_partition_t *part)
+{
+    size_t count = esp_self_reflasher_partition_count();
+    for (size_t i = 0; i < count; i++) {
+        if (s_partition_index[i] == part) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+REFLASHER_ATTR uint8_t esp_self_reflasher_get_ota_partition_count(void)
+{
+    return esp_self_reflasher_partition_count();
+}
+
+/*
+ * OTA partition following `start_from` by address, or the first one when
+ * `start_from` is the last or is not an OTA partition. NULL starts from the
+ * running partition.
+ */
+REFLASHER_ATTR const esp_partition_t* esp_self_reflasher_get_next_partition(const esp_partition_t *start_from)
+{
+    size_t count = esp_self_reflasher_partition_count();
+    if (count == 0) {
+        return NULL;
+    }
+    if (start_from == NULL) {
+        start_from = esp_self_reflasher_get_running_partition();
+    }
+
+    int index = esp_self_reflasher_partition_find_index(start_from);
+    return s_partition_index[(index >= 0) ? (index + 1) % count : 0];
+}
+
+REFLASHER_ATTR bool esp_self_reflasher_partition_apart(const esp_partition_t *part, const addr_region_t *dest, const addr_region_t *base)
+{
+    if (part == esp_self_reflasher_get_running_partition()) {
+        return false;
+    }
+    if (IS_REGION_OVERLAPPING(part->address, part->address + part->size,
+                              dest->region_address, dest->region_address + dest->region_size)) {
+        return false;
+    }
+    return !(base != NULL &&
+             IS_REGION_OVERLAPPING(part->address, part->address + part->size,
+                                   base->region_address, base->region_address + base->region_size));
+}
+
+/* A partition the handle may stage into: apart from the running code and from the regions the image goes to or is patched from */
+REFLASHER_ATTR static bool esp_self_reflasher_partition_free(const esp_self_reflasher_t *self_reflasher_handle, const esp_partition_t *part)
+{
+    return esp_self_reflasher_partition_apart(part, &self_reflasher_handle->dest_region,
+                                              self_reflasher_handle->delta_patch ? &self_reflasher_handle->base_region : NULL);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_staging_select(esp_self_reflasher_t *self_reflasher_handle, const esp_partition_t *configured)
+{
+    const esp_partition_t *current = self_reflasher_handle->target_partition;
+    const esp_partition_t *part = NULL;
+    const addr_region_t *dest = &self_reflasher_handle->dest_region;
+
+    if (configured != NULL) {
+        if (!IS_REGION_OVERLAPPING(configured->address, configured->address + configured->size,
+                                   dest->region_address, dest->region_address + dest->region_size)) {
+            part = configured;
+        }
+    } else if (current != NULL && esp_self_reflasher_partition_free(self_reflasher_handle, current)) {
+        part = current;
+    } else {
+        if (current != NULL) {
+            ESP_LOGI(TAG, "Current used partition overlaps with destination. Trying to fetch next partition...");
+        }
+
+        // A partition able to hold the whole image is preferred over one that would have to be extended
+        size_t count = esp_self_reflasher_partition_count();
+        size_t needed = self_reflasher_handle->expected_size;
+        for (int pass = (needed > 0) ? 0 : 1; pass < 2 && part == NULL; pass++) {
+            const esp_partition_t *candidate = current;
+            for (size_t i = 0; i < count; i++) {
+                candidate = esp_self_reflasher_get_next_partition(candidate);
+                if (esp_self_reflasher_partition_free(self_reflasher_handle, candidate) && (pass == 1 || candidate->size >= needed)) {
+                    part = candidate;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (part == NULL) {
+        self_reflasher_handle->target_partition = NULL;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    self_reflasher_handle->target_partition = part;
+    if (part != current) {
+        self_reflasher_handle->staging_size = part->size;
+    } else if (self_reflasher_handle->staging_size > part->size) {
+        // The partitions the area was extended over may not be free for this image, the placement extends it again if needed
+        self_reflasher_handle->staging_size = part->size;
+        if (self_reflasher_handle->partition_curr_download_addr > part->size) {
+            self_reflasher_handle->partition_curr_download_addr = 0;
+            self_reflasher_handle->partition_curr_copy_offset = 0;
+            self_reflasher_handle->partition_erased_end = 0;
+        }
+        self_reflasher_handle->partition_erased_end = MIN(self_reflasher_handle->partition_erased_end, part->size);
+    }
+
+    return ESP_OK;
+}
+
+/* Size the staging area can be extended to over the free partitions lying right after it */
+REFLASHER_ATTR static size_t esp_self_reflasher_staging_extent(const esp_self_reflasher_t *self_reflasher_handle, size_t needed)
+{
+    const esp_partition_t *part = self_reflasher_handle->target_partition;
+    size_t extent = part->size;
+    int index = esp_self_reflasher_partition_find_index(part);
+
+    // Only an OTA staging partition is extended, a configured data partition is used as is
+    if (index < 0) {
+        return extent;
+    }
+    for (size_t i = index + 1; i < s_partition_count && extent < needed; i++) {
+        const esp_partition_t *next = s_partition_index[i];
+        if (next->address != part->address + extent || !esp_self_reflasher_partition_free(self_reflasher_handle, next)) {
+            break;
+        }
+        extent += next->size;
+    }
+    return extent;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_staging_place(esp_self_reflasher_t *self_reflasher_handle, size_t image_len)
+{
+    uint32_t curr = self_reflasher_handle->partition_curr_download_addr;
+
+    if (image_len == 0 || curr + image_len <= self_reflasher_handle->staging_size) {
+        return ESP_OK;
+    }
+    if (self_reflasher_handle->staging_pinned) {
+        ESP_LOGE(TAG, "%s: Blob size exceeds partition size", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (image_len > self_reflasher_handle->staging_size) {
+        size_t extent = esp_self_reflasher_staging_extent(self_reflasher_handle, image_len);
+        if (extent < image_len) {
+            ESP_LOGE(TAG, "%s: Blob size exceeds partition size, and the partitions after it are not free to span", __func__);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        ESP_LOGI(TAG, "Image spans the staging area 0x%08lx-0x%08lx", self_reflasher_handle->target_partition->address,
+                 self_reflasher_handle->target_partition->address + extent);
+        self_reflasher_handle->staging_size = extent;
+    }
+
+    if (curr > 0) {
+        // The previous images were copied already, their sectors are erased again as the new one is written
+        ESP_LOGI(TAG, "Image does not fit after the previous one, staging it from the partition start");
+        self_reflasher_handle->partition_curr_download_addr = 0;
+        self_reflasher_handle->partition_curr_copy_offset = 0;
+        self_reflasher_handle->partition_erased_end = 0;
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_COMMIT_ATTR const esp_partition_t *esp_self_reflasher_staging_partition(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    const esp_partition_t *part = self_reflasher_handle->target_partition;
+    return (self_reflasher_handle->staging_size > part->size) ? NULL : part;
+}
@@ -0,0 +1,320 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "spi_flash_mmap.h"
+#include "mbedtls/sha256.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_patch.h"
+#include "self_reflasher_verify.h"
+
+static const char *TAG = "self_reflasher_patch";
+
+/* Base image reads go through a mapped window, moved as the base position changes */
+#define PATCH_BASE_WINDOW_SIZE                    (2 * SPI_FLASH_MMU_PAGE_SIZE)
+
+typedef enum {
+    PATCH_STATE_HEADER,
+    PATCH_STATE_CONTROL,
+    PATCH_STATE_DIFF,
+    PATCH_STATE_EXTRA,
+} esp_self_reflasher_patch_state_t;
+
+struct esp_self_reflasher_patch {
+    esp_self_reflasher_patch_state_t   state;
+    esp_self_reflasher_patch_header_t  header;
+    esp_self_reflasher_patch_control_t control;
+    size_t                             fill;          /* Bytes of the header or control block received */
+    uint32_t                           remaining;     /* Bytes left in the current diff or extra block */
+    addr_region_t                      base_region;
+    uint32_t                           base_pos;
+    spi_flash_mmap_handle_t            base_mmap;
+    const uint8_t                      *base_ptr;     /* Mapped base data at base_window_start */
+    uint32_t                           base_window_start;
+    uint32_t                           base_window_end;
+    uint8_t                            *out;
+    size_t                             out_fill;
+    uint32_t                           out_total;     /* Bytes already passed to the sink */
+    esp_self_reflasher_patch_sink_t    sink;
+    void                               *sink_ctx;
+    mbedtls_sha256_context             sha256_ctx;
+};
+
+REFLASHER_ATTR static void esp_self_reflasher_patch_free(esp_self_reflasher_patch_t *patch)
+{
+    if (patch->base_ptr != NULL) {
+        spi_flash_munmap(patch->base_mmap);
+    }
+    mbedtls_sha256_free(&patch->sha256_ctx);
+    heap_caps_free(patch->out);
+    heap_caps_free(patch);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_patch_start(const addr_region_t *base_region, esp_self_reflasher_patch_sink_t sink, void *sink_ctx,
+                                                        esp_self_reflasher_patch_t **patch)
+{
+    esp_self_reflasher_patch_t *ctx = heap_caps_calloc(1, sizeof(esp_self_reflasher_patch_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (ctx == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the patch context", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ctx->out = (uint8_t *)esp_self_reflasher_alloc_buffer(BUFFER_SIZE);
+    if (ctx->out == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the patch output buffer", __func__);
+        heap_caps_free(ctx);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ctx->state = PATCH_STATE_HEADER;
+    ctx->base_region = *base_region;
+    ctx->sink = sink;
+    ctx->sink_ctx = sink_ctx;
+    mbedtls_sha256_init(&ctx->sha256_ctx);
+    mbedtls_sha256_starts(&ctx->sha256_ctx, 0);
+
+    *patch = ctx;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_flush(esp_self_reflasher_patch_t *patch)
+{
+    if (patch->out_fill == 0) {
+        return ESP_OK;
+    }
+
+    mbedtls_sha256_update(&patch->sha256_ctx, patch->out, patch->out_fill);
+    esp_err_t err = patch->sink(patch->sink_ctx, patch->out_total, patch->out, patch->out_fill);
+    patch->out_total += patch->out_fill;
+    patch->out_fill = 0;
+
+    return err;
+}
+
+/*
+ * Make the base data at the current base position available, returning how
+ * many bytes can be read from `*ptr` before the window has to move.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_map_base(esp_self_reflasher_patch_t *patch, const uint8_t **ptr, size_t *avail)
+{
+    uint32_t address = patch->base_region.region_address + patch->base_pos;
+
+    if (patch->base_ptr == NULL || address < patch->base_window_start || address >= patch->base_window_end) {
+        if (patch->base_ptr != NULL) {
+            spi_flash_munmap(patch->base_mmap);
+            patch->base_ptr = NULL;
+        }
+
+        uint32_t window_start = address & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+        uint32_t window_end = MIN(window_start + PATCH_BASE_WINDOW_SIZE,
+                                  patch->base_region.region_address + patch->header.base_size);
+        const void *map_ptr;
+        esp_err_t err = spi_flash_mmap(window_start, window_end - window_start, SPI_FLASH_MMAP_DATA, &map_ptr, &patch->base_mmap);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to map the base image, address: 0x%08lx, error: %s", __func__, window_start, esp_err_to_name(err));
+            return err;
+        }
+        patch->base_ptr = map_ptr;
+        patch->base_window_start = window_start;
+        patch->base_window_end = window_end;
+    }
+
+    *ptr = patch->base_ptr + (address - patch->base_window_start);
+    *avail = patch->base_window_end - address;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_check_header(esp_self_reflasher_patch_t *patch)
+{
+    const esp_self_reflasher_patch_header_t *header = &patch->header;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (header->magic != PATCH_IMAGE_MAGIC) {
+        ESP_LOGE(TAG, "%s: Invalid patch header magic 0x%08lx", __func__, header->magic);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (header->base_size > patch->base_region.region_size) {
+        ESP_LOGE(TAG, "%s: Patch base size 0x%08lx exceeds the base region size", __func__, header->base_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // A patch applied to anything but the base it was made from produces garbage
+    esp_err_t err = esp_self_reflasher_sha256_region(patch->base_region.region_address, header->base_size, digest);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (memcmp(digest, header->base_sha256, SHA256_DIGEST_SIZE) != 0) {
+        ESP_LOGE(TAG, "%s: Base region 0x%08lx does not hold the image the patch was made from", __func__,
+                 patch->base_region.region_address);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ESP_LOGI(TAG, "Patching 0x%08lx bytes at 0x%08lx into a 0x%08lx bytes image", header->base_size,
+             patch->base_region.region_address, header->target_size);
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_check_control(esp_self_reflasher_patch_t *patch)
+{
+    const esp_self_reflasher_patch_control_t *control = &patch->control;
+    uint32_t out_pos = patch->out_total + patch->out_fill;
+
+    if (control->diff_len > patch->header.target_size - out_pos ||
+        control->extra_len > patch->header.target_size - out_pos - control->diff_len ||
+        control->diff_len > patch->header.base_size - patch->base_pos) {
+        ESP_LOGE(TAG, "%s: Patch record exceeds the image bounds", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_patch_seek(esp_self_reflasher_patch_t *patch)
+{
+    int64_t base_pos = (int64_t)patch->base_pos + patch->control.seek;
+
+    if (base_pos < 0 || base_pos > patch->header.base_size) {
+        ESP_LOGE(TAG, "%s: Patch seeks outside of the base image", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    patch->base_pos = (uint32_t)base_pos;
+    patch->state = PATCH_STATE_CONTROL;
+    patch->fill = 0;
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_patch_feed(esp_self_reflasher_patch_t *patch, const uint8_t *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+
+    while (len > 0 && err == ESP_OK) {
+        size_t n;
+
+        switch (patch->state) {
+        case PATCH_STATE_HEADER:
+            n = MIN(len, sizeof(esp_self_reflasher_patch_header_t) - patch->fill);
+            memcpy((uint8_t *)&patch->header + patch->fill, data, n);
+            patch->fill += n;
+            if (patch->fill == sizeof(esp_self_reflasher_patch_header_t)) {
+                err = esp_self_reflasher_patch_check_header(patch);
+                patch->state = PATCH_STATE_CONTROL;
+                patch->fill = 0;
+            }
+            break;
+
+        case PATCH_STATE_CONTROL:
+            n = MIN(len, sizeof(esp_self_reflasher_patch_control_t) - patch->fill);
+            memcpy((uint8_t *)&patch->control + patch->fill, data, n);
+            patch->fill += n;
+            if (patch->fill == sizeof(esp_self_reflasher_patch_control_t)) {
+                err = esp_self_reflasher_patch_check_control(patch);
+                if (err != ESP_OK) {
+                    break;
+                }
+                if (patch->control.diff_len > 0) {
+                    patch->state = PATCH_STATE_DIFF;
+                    patch->remaining = patch->control.diff_len;
+                } else if (patch->control.extra_len > 0) {
+                    patch->state = PATCH_STATE_EXTRA;
+                    patch->remaining = patch->control.extra_len;
+                } else {
+                    err = esp_self_reflasher_patch_seek(patch);
+                }
+            }
+            break;
+
+        case PATCH_STATE_DIFF: {
+            const uint8_t *base;
+            size_t base_avail;
+            err = esp_self_reflasher_patch_map_base(patch, &base, &base_avail);
+            if (err != ESP_OK) {
+                break;
+            }
+            n = MIN(MIN(len, patch->remaining), MIN(base_avail, BUFFER_SIZE - patch->out_fill));
+            for (size_t i = 0; i < n; i++) {
+                patch->out[patch->out_fill + i] = data[i] + base[i];
+            }
+            patch->out_fill += n;
+            patch->base_pos += n;
+            patch->remaining -= n;
+            if (patch->remaining == 0) {
+                if (patch->control.extra_len > 0) {
+                    patch->state = PATCH_STATE_EXTRA;
+                    patch->remaining = patch->control.extra_len;
+                } else {
+                    err = esp_self_reflasher_patch_seek(patch);
+                }
+            }
+            break;
+        }
+
+        case PATCH_STATE_EXTRA:
+            n = MIN(MIN(len, patch->remaining), BUFFER_SIZE - patch->out_fill);
+            memcpy(patch->out + patch->out_fill, data, n);
+            patch->out_fill += n;
+            patch->remaining -= n;
+            if (patch->remaining == 0) {
+                err = esp_self_reflasher_patch_seek(patch);
+            }
+            break;
+
+        default:
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        data += n;
+        len -= n;
+
+        if (err == ESP_OK && patch->out_fill == BUFFER_SIZE) {
+            err = esp_self_reflasher_patch_flush(patch);
+        }
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR const esp_self_reflasher_patch_header_t *esp_self_reflasher_patch_header(const esp_self_reflasher_patch_t *patch)
+{
+    if (patch->state == PATCH_STATE_HEADER) {
+        return NULL;
+    }
+    return &patch->header;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_patch_finish(esp_self_reflasher_patch_t *patch)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    esp_err_t err = esp_self_reflasher_patch_flush(patch);
+    mbedtls_sha256_finish(&patch->sha256_ctx, digest);
+
+    if (err != ESP_OK) {
+        // Already reported by the sink
+    } else if (patch->state != PATCH_STATE_CONTROL || patch->fill != 0 || patch->out_total != patch->header.target_size) {
+        ESP_LOGE(TAG, "%s: Patch ended after 0x%08lx bytes of output, expected 0x%08lx", __func__,
+                 patch->out_total, patch->header.target_size);
+        err = ESP_ERR_INVALID_SIZE;
+    } else if (memcmp(digest, patch->header.target_sha256, SHA256_DIGEST_SIZE) != 0) {
+        ESP_LOGE(TAG, "%s: Patched image digest does not match the patch header", __func__);
+        err = ESP_ERR_INVALID_CRC;
+    } else {
+        ESP_LOGI(TAG, "Patched image of 0x%08lx bytes verified", patch->out_total);
+    }
+
+    esp_self_reflasher_patch_free(patch);
+    return err;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_patch_abort(esp_self_reflasher_patch_t *patch)
+{
+    esp_self_reflasher_patch_free(patch);
+}
@@ -0,0 +1,162 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_pipeline.h"
+
+static const char *TAG = "self_reflasher_pipeline";
+
+#if CONFIG_ESP_SELF_REFLASHER_PIPELINE_WRITER_CORE_0
+#define PIPELINE_WRITER_CORE_ID                   0
+#elif CONFIG_ESP_SELF_REFLASHER_PIPELINE_WRITER_CORE_1
+#define PIPELINE_WRITER_CORE_ID                   1
+#else
+#define PIPELINE_WRITER_CORE_ID                   tskNO_AFFINITY
+#endif
+
+typedef struct {
+    char      *buffer;    /* NULL marks the end of the download */
+    size_t    len;
+    uint32_t  offset;
+} esp_self_reflasher_chunk_t;
+
+struct esp_self_reflasher_pipeline {
+    esp_self_reflasher_t  *handle;
+    char                  *buffers;
+    QueueHandle_t         free_queue;   /* Buffers ready to receive into */
+    QueueHandle_t         full_queue;   /* Chunks waiting to be written */
+    SemaphoreHandle_t     writer_done;
+    volatile esp_err_t    err;
+};
+
+REFLASHER_ATTR static void esp_self_reflasher_pipeline_writer(void *arg)
+{
+    esp_self_reflasher_pipeline_t *pipeline = (esp_self_reflasher_pipeline_t *)arg;
+    esp_self_reflasher_chunk_t chunk;
+
+    while (xQueueReceive(pipeline->full_queue, &chunk, portMAX_DELAY) == pdTRUE) {
+        if (chunk.buffer == NULL) {
+            break;
+        }
+
+        // After a failure, keep draining so the receiving side never blocks on a free buffer
+        if (pipeline->err == ESP_OK) {
+            esp_err_t err = esp_self_reflasher_stage_input(pipeline->handle, chunk.offset, chunk.buffer, chunk.len);
+            if (err != ESP_OK) {
+                pipeline->err = err;
+            }
+        }
+
+        xQueueSend(pipeline->free_queue, &chunk.buffer, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(pipeline->writer_done);
+    vTaskDelete(NULL);
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_pipeline_free(esp_self_reflasher_pipeline_t *pipeline)
+{
+    if (pipeline->writer_done != NULL) {
+        vSemaphoreDelete(pipeline->writer_done);
+    }
+    if (pipeline->full_queue != NULL) {
+        vQueueDelete(pipeline->full_queue);
+    }
+    if (pipeline->free_queue != NULL) {
+        vQueueDelete(pipeline->free_queue);
+    }
+    heap_caps_free(pipeline->buffers);
+    free(pipeline);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_pipeline_start(esp_self_reflasher_t *self_reflasher_handle, size_t buffer_count,
+                                                           esp_self_reflasher_pipeline_t **pipeline)
+{
+    esp_self_reflasher_pipeline_t *p = calloc(1, sizeof(esp_self_reflasher_pipeline_t));
+    if (p == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the download pipeline", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    p->handle = self_reflasher_handle;
+    p->err = ESP_OK;
+    p->buffers = esp_self_reflasher_alloc_buffer(buffer_count * BUFFER_SIZE);
+    p->free_queue = xQueueCreate(buffer_count, sizeof(char *));
+    p->full_queue = xQueueCreate(buffer_count + 1, sizeof(esp_self_reflasher_chunk_t));
+    p->writer_done = xSemaphoreCreateBinary();
+    if (p->buffers == NULL || p->free_queue == NULL || p->full_queue == NULL || p->writer_done == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the download pipeline", __func__);
+        esp_self_reflasher_pipeline_free(p);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < buffer_count; i++) {
+        char *buffer = p->buffers + i * BUFFER_SIZE;
+        xQueueSend(p->free_queue, &buffer, 0);
+    }
+
+    if (xTaskCreatePinnedToCore(esp_self_reflasher_pipeline_writer, "reflasher_writer",
+                                CONFIG_ESP_SELF_REFLASHER_PIPELINE_WRITER_STACK_SIZE, p,
+                                CONFIG_ESP_SELF_REFLASHER_PIPELINE_WRITER_PRIORITY, NULL,
+                                PIPELINE_WRITER_CORE_ID) != pdPASS) {
+        ESP_LOGE(TAG, "%s: Failed to create the flash writer task", __func__);
+        esp_self_reflasher_pipeline_free(p);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGD(TAG, "Download pipeline started with %d buffers", buffer_count);
+    *pipeline = p;
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_pipeline_acquire(esp_self_reflasher_pipeline_t *pipeline, char **buffer)
+{
+    xQueueReceive(pipeline->free_queue, buffer, portMAX_DELAY);
+
+    return pipeline->err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_pipeline_submit(esp_self_reflasher_pipeline_t *pipeline, char *buffer, size_t len, uint32_t offset)
+{
+    esp_self_reflasher_chunk_t chunk = {
+        .buffer = buffer,
+        .len = len,
+        .offset = offset,
+    };
+
+    xQueueSend(pipeline->full_queue, &chunk, portMAX_DELAY);
+
+    return pipeline->err;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_pipeline_release(esp_self_reflasher_pipeline_t *pipeline, char *buffer)
+{
+    xQueueSend(pipeline->free_queue, &buffer, portMAX_DELAY);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_pipeline_finish(esp_self_reflasher_pipeline_t *pipeline)
+{
+    esp_self_reflasher_chunk_t end_marker = {
+        .buffer = NULL,
+    };
+
+    xQueueSend(pipeline->full_queue, &end_marker, portMAX_DELAY);
+    xSemaphoreTake(pipeline->writer_done, portMAX_DELAY);
+
+    esp_err_t err = pipeline->err;
+    esp_self_reflasher_pipeline_free(pipeline);
+
+    return err;
+}
@@ -0,0 +1,564 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_partition.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_commit.h"
+#include "self_reflasher_stats.h"
+#include "self_reflasher_verify.h"
+
+static const char *TAG = "self_reflasher_plan";
+
+/*
+ * Typical figures of the SPI NOR flash the modules ship with. Erase and program
+ * times depend on the flash chip alone, reads on the flash clock and mode the
+ * target defaults to.
+ */
+#if CONFIG_IDF_TARGET_ESP32
+#define DEFAULT_READ_KB_US                        100        /* 40MHz DIO */
+#elif CONFIG_IDF_TARGET_ESP32H2
+#define DEFAULT_READ_KB_US                        64         /* 64MHz DIO */
+#elif CONFIG_IDF_TARGET_LINUX
+#define DEFAULT_READ_KB_US                        25
+#else
+#define DEFAULT_READ_KB_US                        50         /* 80MHz DIO */
+#endif
+
+static const esp_self_reflasher_cost_t s_default_cost = {
+    .sector_erase_us = 45000,
+    .block_erase_us = 150000,
+    .page_program_us = 700,
+    .read_kb_us = DEFAULT_READ_KB_US,
+    .download_kb_us = 0,
+};
+
+#define CALIBRATION_PROGRAM_SIZE                  SPI_FLASH_SEC_SIZE
+
+/* An image as the planner sees it: what is received, and what ends up in its destination region */
+typedef struct {
+    addr_region_t  dest_region;
+    size_t         download_size;
+    size_t         image_size;
+    bool           digest;       /* An expected digest is set */
+} esp_self_reflasher_plan_input_t;
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_get_default_cost(esp_self_reflasher_cost_t *cost)
+{
+    if (cost == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *cost = s_default_cost;
+    return ESP_OK;
+}
+
+/*
+ * The block erase is timed first, so that the page programs and the reads go
+ * to freshly erased sectors, then one of its sectors is erased again.
+ */
+REFLASHER_ATTR esp_err_t esp_self_reflasher_calibrate_cost(const esp_partition_t *scratch_partition, esp_self_reflasher_cost_t *cost)
+{
+    esp_err_t err;
+
+    if (scratch_partition == NULL || cost == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t address = ALIGN_UP(scratch_partition->address, FLASH_BLOCK_SIZE);
+    if (address + FLASH_BLOCK_SIZE > scratch_partition->address + scratch_partition->size) {
+        ESP_LOGE(TAG, "%s: Scratch partition holds no whole 64KB block", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (scratch_partition == esp_self_reflasher_get_running_partition()) {
+        ESP_LOGE(TAG, "%s: The running partition cannot be used as scratch", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char *data = esp_self_reflasher_alloc_buffer(CALIBRATION_PROGRAM_SIZE);
+    if (data == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the calibration", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    // No page may be blank, or programming it would be skipped
+    for (size_t i = 0; i < CALIBRATION_PROGRAM_SIZE; i++) {
+        data[i] = (char)(i ^ 0x5a);
+    }
+
+    int64_t start = esp_timer_get_time();
+    err = esp_self_reflasher_flash_erase(scratch_partition, address, FLASH_BLOCK_SIZE);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+    int64_t block_erase_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    err = esp_self_reflasher_flash_write(scratch_partition, address, data, CALIBRATION_PROGRAM_SIZE);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+    int64_t program_us = esp_timer_get_time() - start;
+
+    const uint8_t *window;
+    spi_flash_mmap_handle_t mmap_handle;
+    start = esp_timer_get_time();
+    err = esp_self_reflasher_map_window(address, FLASH_BLOCK_SIZE, &window, &mmap_handle);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+    for (uint32_t offset = 0; offset < FLASH_BLOCK_SIZE; offset += CALIBRATION_PROGRAM_SIZE) {
+        memcpy(data, window + offset, CALIBRATION_PROGRAM_SIZE);
+    }
+    spi_flash_munmap(mmap_handle);
+    int64_t read_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    err = esp_self_reflasher_flash_erase(scratch_partition, address, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) {
+        goto cleanup;
+    }
+    int64_t sector_erase_us = esp_timer_get_time() - start;
+
+    cost->block_erase_us = (uint32_t)block_erase_us;
+    cost->sector_erase_us = (uint32_t)sector_erase_us;
+    cost->page_program_us = (uint32_t)(program_us / (CALIBRATION_PROGRAM_SIZE / FLASH_PAGE_SIZE));
+    cost->read_kb_us = (uint32_t)(read_us / (FLASH_BLOCK_SIZE / 1024));
+    ESP_LOGI(TAG, "Calibrated flash costs: sector erase %luus, block erase %luus, page program %luus, read %luus/KB",
+             cost->sector_erase_us, cost->block_erase_us, cost->page_program_us, cost->read_kb_us);
+
+cleanup:
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Flash operation failed, error: %s", __func__, esp_err_to_name(err));
+    }
+    heap_caps_free(data);
+    return err;
+}
+
+/*
+ * Each of these accounts for a flash operation in the plan, and returns its
+ * estimated duration for the caller to add to the phase it belongs to.
+ */
+REFLASHER_ATTR static int64_t esp_self_reflasher_plan_erase(esp_self_reflasher_plan_t *plan, const esp_self_reflasher_cost_t *cost,
+                                                            uint32_t *erase_addr, uint32_t until, uint32_t limit)
+{
+    if (*erase_addr >= until) {
+        return 0;
+    }
+
+    esp_self_reflasher_erase_plan_t erase;
+    esp_self_reflasher_erase_plan(*erase_addr, until, limit, &erase);
+    *erase_addr = erase.end;
+
+    plan->block_erases += erase.block_count;
+    plan->sector_erases += erase.sector_count;
+    plan->bytes_erased += erase.end - erase.start;
+    if (erase.block_count > 0) {
+        plan->longest_operation_us = MAX(plan->longest_operation_us, cost->block_erase_us);
+    }
+    if (erase.sector_count > 0) {
+        plan->longest_operation_us = MAX(plan->longest_operation_us, cost->sector_erase_us);
+    }
+
+    int64_t us = (int64_t)erase.block_count * cost->block_erase_us + (int64_t)erase.sector_count * cost->sector_erase_us;
+    plan->flash_time_us += us;
+    return us;
+}
+
+/* Data is written with calls of `call_size` bytes at most, each a single critical section */
+REFLASHER_ATTR static int64_t esp_self_reflasher_plan_program(esp_self_reflasher_plan_t *plan, const esp_self_reflasher_cost_t *cost,
+                                                              uint32_t address, size_t len, size_t call_size)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    uint32_t pages = (ALIGN_UP(address + len, FLASH_PAGE_SIZE) - ALIGN_DOWN(address, FLASH_PAGE_SIZE)) / FLASH_PAGE_SIZE;
+    uint32_t call_pages = (MIN(len, call_size) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+    plan->bytes_programmed += len;
+    plan->longest_operation_us = MAX(plan->longest_operation_us, (int64_t)call_pages * cost->page_program_us);
+
+    int64_t us = (int64_t)pages * cost->page_program_us;
+    plan->flash_time_us += us;
+    return us;
+}
+
+REFLASHER_ATTR static int64_t esp_self_reflasher_plan_read(esp_self_reflasher_plan_t *plan, const esp_self_reflasher_cost_t *cost, size_t len)
+{
+    plan->bytes_read += len;
+
+    int64_t us = (int64_t)len * cost->read_kb_us / 1024;
+    plan->flash_time_us += us;
+    return us;
+}
+
+/* Receiving overlaps with writing the received data to flash when the download is pipelined */
+REFLASHER_ATTR static void esp_self_reflasher_plan_download(const esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_plan_t *plan,
+                                                            const esp_self_reflasher_cost_t *cost, size_t len, int64_t flash_us)
+{
+    int64_t network_us = (int64_t)len * cost->download_kb_us / 1024;
+
+    plan->download_bytes += len;
+    plan->phase_time_us[ESP_SELF_REFLASHER_PHASE_DOWNLOAD] += self_reflasher_handle->pipelined_download ?
+                                                              MAX(network_us, flash_us) : network_us + flash_us;
+}
+
+/*
+ * Stage every image, packed in the staging area as the handle places them, then
+ * copy each of them to its destination region, as esp_self_reflasher_run_job does.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_plan_staged(esp_self_reflasher_t *self_reflasher_handle, const esp_self_reflasher_plan_input_t *inputs,
+                                                               size_t input_count, const esp_self_reflasher_cost_t *cost,
+                                                               esp_self_reflasher_plan_t *plan, uint32_t *staging_addresses)
+{
+    const esp_partition_t *part = self_reflasher_handle->target_partition;
+    int64_t *phase_time_us = plan->phase_time_us;
+    uint32_t erase_addr = part->address;
+
+    // Compressed images are staged as downloaded and decompressed by the copy, patches are applied while staging
+    bool staged_compressed = self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch;
+    bool header_last = self_reflasher_handle->commit_header_last && !staged_compressed;
+
+    if (!self_reflasher_handle->erase_on_demand) {
+        phase_time_us[ESP_SELF_REFLASHER_PHASE_ERASE] += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, part->address + part->size,
+                                                                                      part->address + part->size);
+        self_reflasher_handle->partition_erased_end = part->size;
+    }
+
+    for (size_t i = 0; i < input_count; i++) {
+        size_t staged_len = staged_compressed ? inputs[i].download_size : inputs[i].image_size;
+
+        esp_err_t err = esp_self_reflasher_staging_place(self_reflasher_handle, staged_len);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        uint32_t staged_addr = part->address + self_reflasher_handle->partition_curr_download_addr;
+        if (i == 0) {
+            plan->staging_address = staged_addr;
+        }
+        if (staging_addresses != NULL) {
+            staging_addresses[i] = staged_addr;
+        }
+
+        erase_addr = part->address + self_reflasher_handle->partition_erased_end;
+        int64_t flash_us = esp_self_reflasher_plan_erase(plan, cost, &erase_addr, staged_addr + staged_len,
+                                                         part->address + self_reflasher_handle->staging_size);
+        flash_us += esp_self_reflasher_plan_program(plan, cost, staged_addr, staged_len, BUFFER_SIZE);
+        esp_self_reflasher_plan_download(self_reflasher_handle, plan, cost, inputs[i].download_size, flash_us);
+
+        self_reflasher_handle->partition_erased_end = MAX(self_reflasher_handle->partition_erased_end, erase_addr - part->address);
+        self_reflasher_handle->partition_curr_download_addr += staged_len;
+        plan->staged_bytes += staged_len;
+    }
+
+    plan->staging_partition = part;
+    plan->staging_size = self_reflasher_handle->staging_size;
+
+    for (size_t i = 0; i < input_count; i++) {
+        const addr_region_t *dest = &inputs[i].dest_region;
+        uint32_t dest_end = dest->region_address + dest->region_size;
+        uint32_t erase_end = self_reflasher_handle->erase_clear_tail ? dest_end : dest->region_address + inputs[i].image_size;
+        size_t staged_len = staged_compressed ? inputs[i].download_size : inputs[i].image_size;
+
+        erase_addr = dest->region_address;
+        int64_t copy_us = esp_self_reflasher_plan_read(plan, cost, staged_len);
+        if (inputs[i].digest && !staged_compressed) {
+            // The staged image is hashed again before the destination is erased
+            copy_us += esp_self_reflasher_plan_read(plan, cost, inputs[i].image_size);
+        }
+        if (header_last) {
+            // The header sector is erased on its own once the rest is written, and everything is compared with the staged data
+            uint32_t header_end = dest->region_address + SPI_FLASH_SEC_SIZE;
+            erase_addr = header_end;
+            copy_us += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, erase_end, erase_end);
+            erase_addr = dest->region_address;
+            copy_us += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, header_end, header_end);
+            copy_us += esp_self_reflasher_plan_read(plan, cost, 2 * inputs[i].image_size);
+        } else {
+            if (self_reflasher_handle->differential_copy) {
+                // Worst case: every destination sector is compared, and differs
+                copy_us += esp_self_reflasher_plan_read(plan, cost, inputs[i].image_size);
+            }
+            copy_us += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, erase_end, erase_end);
+        }
+        copy_us += esp_self_reflasher_plan_program(plan, cost, dest->region_address, inputs[i].image_size, COPY_BATCH_SIZE);
+        phase_time_us[ESP_SELF_REFLASHER_PHASE_COPY] += copy_us;
+        plan->copied_bytes += inputs[i].image_size;
+
+        if (self_reflasher_handle->verify_after_copy) {
+            // A decompressed image is checked against its digest, other ones compared with the staged copy
+            int64_t verify_us = esp_self_reflasher_plan_read(plan, cost, inputs[i].image_size);
+            if (!staged_compressed) {
+                verify_us += esp_self_reflasher_plan_read(plan, cost, inputs[i].image_size);
+            }
+            phase_time_us[ESP_SELF_REFLASHER_PHASE_VERIFY] += verify_us;
+        }
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_plan_direct_stream(const esp_self_reflasher_t *self_reflasher_handle,
+                                                                      const esp_self_reflasher_plan_input_t *input,
+                                                                      const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan)
+{
+    const addr_region_t *dest = &input->dest_region;
+    uint32_t dest_end = dest->region_address + dest->region_size;
+    uint32_t image_end = dest->region_address + input->image_size;
+    uint32_t erase_addr = dest->region_address;
+
+    if (dest->region_address % SPI_FLASH_SEC_SIZE != 0) {
+        ESP_LOGE(TAG, "%s: Destination address 0x%08lx is not sector aligned", __func__, dest->region_address);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int64_t flash_us = esp_self_reflasher_plan_erase(plan, cost, &erase_addr, image_end,
+                                                     self_reflasher_handle->erase_clear_tail ? dest_end : image_end);
+    flash_us += esp_self_reflasher_plan_program(plan, cost, dest->region_address, input->image_size, BUFFER_SIZE);
+    if (self_reflasher_handle->erase_clear_tail) {
+        flash_us += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, dest_end, dest_end);
+    }
+    esp_self_reflasher_plan_download(self_reflasher_handle, plan, cost, input->download_size, flash_us);
+    plan->copied_bytes = input->image_size;
+
+    // Only the digest can be checked, that of the decoded data or the expected one
+    bool decoded = self_reflasher_handle->compressed || self_reflasher_handle->delta_patch;
+    if (self_reflasher_handle->verify_after_copy && (input->digest || decoded)) {
+        plan->phase_time_us[ESP_SELF_REFLASHER_PHASE_VERIFY] += esp_self_reflasher_plan_read(plan, cost, input->image_size);
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_plan_direct_copy(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                               const esp_self_reflasher_plan_input_t *input,
+                                                               const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan)
+{
+    const addr_region_t *dest = &input->dest_region;
+    uint32_t dest_end = dest->region_address + dest->region_size;
+    uint32_t erase_end = self_reflasher_config->erase_clear_tail ? dest_end : dest->region_address + input->image_size;
+    uint32_t erase_addr = dest->region_address;
+    size_t src_len = self_reflasher_config->src_bin_size;
+
+    int64_t copy_us = 0;
+    if (input->digest) {
+        // The source is checked before the destination is touched
+        copy_us += esp_self_reflasher_plan_read(plan, cost, src_len);
+    }
+    copy_us += esp_self_reflasher_plan_read(plan, cost, src_len);
+    copy_us += esp_self_reflasher_plan_erase(plan, cost, &erase_addr, erase_end, erase_end);
+    copy_us += esp_self_reflasher_plan_program(plan, cost, dest->region_address, input->image_size, COPY_BATCH_SIZE);
+    plan->phase_time_us[ESP_SELF_REFLASHER_PHASE_COPY] += copy_us;
+    plan->copied_bytes = input->image_size;
+
+    if (self_reflasher_config->verify_after_copy) {
+        bool overlapping = IS_REGION_OVERLAPPING(self_reflasher_config->src_region.region_address,
+                                                 self_reflasher_config->src_region.region_address + src_len,
+                                                 dest->region_address, dest_end);
+        int64_t verify_us = esp_self_reflasher_plan_read(plan, cost, input->image_size);
+        if (!overlapping && !self_reflasher_config->compressed) {
+            verify_us += esp_self_reflasher_plan_read(plan, cost, src_len);
+        }
+        plan->phase_time_us[ESP_SELF_REFLASHER_PHASE_VERIFY] += verify_us;
+    }
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_plan_finish(esp_self_reflasher_plan_t *plan)
+{
+    plan->total_time_us = 0;
+    for (int i = 0; i < ESP_SELF_REFLASHER_PHASE_MAX; i++) {
+        plan->total_time_us += plan->phase_time_us[i];
+    }
+
+    ESP_LOGI(TAG, "Plan: %u bytes downloaded, %u staged, %u copied, %lu block and %lu sector erases, about %lld ms",
+             plan->download_bytes, plan->staged_bytes, plan->copied_bytes, plan->block_erases, plan->sector_erases,
+             plan->total_time_us / 1000);
+}
+
+/*
+ * The staging decisions are made by the same partition code as a real run, on
+ * a handle of its own that never reaches the flash accessors.
+ */
+REFLASHER_ATTR static esp_self_reflasher_t *esp_self_reflasher_plan_handle(const esp_self_reflasher_config_t *self_reflasher_config)
+{
+    esp_self_reflasher_t *self_reflasher_handle = calloc(1, sizeof(esp_self_reflasher_t));
+    if (self_reflasher_handle == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the plan", __func__);
+        return NULL;
+    }
+
+    esp_self_reflasher_apply_config(self_reflasher_handle, self_reflasher_config);
+    return self_reflasher_handle;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_plan(const esp_self_reflasher_config_t *self_reflasher_config, size_t image_size,
+                                                 const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan)
+{
+    esp_err_t err = ESP_OK;
+
+    if (self_reflasher_config == NULL || plan == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (cost == NULL) {
+        cost = &s_default_cost;
+    }
+
+    bool downloaded = (self_reflasher_config->http_config != NULL || self_reflasher_config->source != NULL);
+    size_t received_size = downloaded ? self_reflasher_config->expected_size : self_reflasher_config->src_bin_size;
+    esp_self_reflasher_plan_input_t input = {
+        .dest_region = self_reflasher_config->dest_region,
+        .image_size = (image_size > 0) ? image_size : received_size,
+        .download_size = (received_size > 0) ? received_size : image_size,
+        .digest = (self_reflasher_config->expected_sha256 != NULL),
+    };
+
+    if (input.image_size == 0) {
+        ESP_LOGE(TAG, "%s: Image size unknown, set image_size or expected_size", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (input.image_size > input.dest_region.region_size) {
+        ESP_LOGE(TAG, "%s: Image size exceeds destination region size", __func__);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memset(plan, 0, sizeof(esp_self_reflasher_plan_t));
+
+    if (!downloaded) {
+        esp_self_reflasher_plan_direct_copy(self_reflasher_config, &input, cost, plan);
+        esp_self_reflasher_plan_finish(plan);
+        return ESP_OK;
+    }
+
+    esp_self_reflasher_t *self_reflasher_handle = esp_self_reflasher_plan_handle(self_reflasher_config);
+    if (self_reflasher_handle == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (self_reflasher_handle->direct_stream) {
+        err = esp_self_reflasher_plan_direct_stream(self_reflasher_handle, &input, cost, plan);
+    } else {
+        err = esp_self_reflasher_staging_select(self_reflasher_handle, self_reflasher_config->target_partition);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: No staging partition apart from the destination region", __func__);
+        } else {
+            err = esp_self_reflasher_plan_staged(self_reflasher_handle, &input, 1, cost, plan, NULL);
+        }
+    }
+
+    if (err == ESP_OK) {
+        esp_self_reflasher_plan_finish(plan);
+    }
+    free(self_reflasher_handle);
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_plan_job(const esp_self_reflasher_config_t *self_reflasher_config,
+                                                     const esp_self_reflasher_job_image_t *images, size_t image_count,
+                                                     const esp_self_reflasher_cost_t *cost, esp_self_reflasher_plan_t *plan,
+                                                     uint32_t *staging_addresses)
+{
+    esp_err_t err;
+
+    if (self_reflasher_config == NULL || images == NULL || image_count == 0 || plan == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (self_reflasher_config->direct_stream || self_reflasher_config->resumable) {
+        ESP_LOGE(TAG, "%s: Jobs stage every image first, direct_stream and resumable are not supported", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (self_reflasher_config->source != NULL) {
+        ESP_LOGE(TAG, "%s: Job images are downloaded from their URL, a source is not supported", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (cost == NULL) {
+        cost = &s_default_cost;
+    }
+
+    const esp_partition_t *target_partition = esp_self_reflasher_job_partition(self_reflasher_config, images, image_count);
+    if (target_partition == NULL) {
+        ESP_LOGE(TAG, "%s: No staging partition apart from all destination regions", __func__);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_self_reflasher_plan_input_t *inputs = calloc(image_count, sizeof(esp_self_reflasher_plan_input_t));
+    if (inputs == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the plan", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < image_count; i++) {
+        if (images[i].expected_size == 0 || images[i].expected_size > images[i].dest_region.region_size) {
+            ESP_LOGE(TAG, "%s: Image %u size is unknown or exceeds its destination region", __func__, i + 1);
+            free(inputs);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        inputs[i].dest_region = images[i].dest_region;
+        inputs[i].download_size = images[i].expected_size;
+        inputs[i].image_size = images[i].expected_size;
+        inputs[i].digest = (images[i].expected_sha256 != NULL);
+    }
+
+    esp_self_reflasher_t *self_reflasher_handle = esp_self_reflasher_plan_handle(self_reflasher_config);
+    if (self_reflasher_handle == NULL) {
+        free(inputs);
+        return ESP_ERR_NO_MEM;
+    }
+
+    memset(plan, 0, sizeof(esp_self_reflasher_plan_t));
+    self_reflasher_handle->dest_region = images[0].dest_region;
+    err = esp_self_reflasher_staging_select(self_reflasher_handle, target_partition);
+    if (err == ESP_OK) {
+        self_reflasher_handle->staging_pinned = true;
+        err = esp_self_reflasher_plan_staged(self_reflasher_handle, inputs, image_count, cost, plan, staging_addresses);
+    }
+    if (err == ESP_OK) {
+        esp_self_reflasher_plan_finish(plan);
+    }
+
+    free(self_reflasher_handle);
+    free(inputs);
+    return err;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_plan_check(const esp_self_reflasher_plan_t *plan, const esp_self_reflasher_plan_budget_t *budget)
+{
+    if (plan == NULL || budget == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (budget->max_total_time_us > 0 && plan->total_time_us > budget->max_total_time_us) {
+        ESP_LOGW(TAG, "%s: Estimated duration %lld ms exceeds the budget of %lld ms", __func__,
+                 plan->total_time_us / 1000, budget->max_total_time_us / 1000);
+        return ESP_ERR_TIMEOUT;
+    }
+    if (budget->max_flash_time_us > 0 && plan->flash_time_us > budget->max_flash_time_us) {
+        ESP_LOGW(TAG, "%s: Estimated flash time %lld ms exceeds the budget of %lld ms", __func__,
+                 plan->flash_time_us / 1000, budget->max_flash_time_us / 1000);
+        return ESP_ERR_TIMEOUT;
+    }
+    if (budget->max_operation_us > 0 && plan->longest_operation_us > budget->max_operation_us) {
+        ESP_LOGW(TAG, "%s: A flash operation of %lld us exceeds the budget of %lld us", __func__,
+                 plan->longest_operation_us, budget->max_operation_us);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
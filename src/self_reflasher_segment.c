@@ -0,0 +1,295 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "spi_flash_mmap.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_pipeline.h"
+#include "self_reflasher_segment.h"
+#include "self_reflasher_stats.h"
+
+static const char *TAG = "self_reflasher_segment";
+
+#define SEGMENT_MAX_COUNT                         CONFIG_ESP_SELF_REFLASHER_SEGMENT_CONNECTIONS
+#define SEGMENT_MIN_SIZE                          0x10000    /* Smaller ranges are not worth a connection */
+#define SEGMENT_BUFFERS_PER_CONNECTION            2
+#define SEGMENT_PROGRESS_INTERVAL_MS              200
+
+typedef struct esp_self_reflasher_segmented esp_self_reflasher_segmented_t;
+
+typedef struct {
+    esp_self_reflasher_segmented_t  *download;
+    esp_http_client_handle_t        client;     /* Open on the range still to receive, or NULL */
+    uint32_t                        start;      /* Image offset of the range */
+    uint32_t                        end;
+    uint32_t                        done;       /* Bytes of the range handed over to the writer */
+    esp_err_t                       err;
+} esp_self_reflasher_segment_t;
+
+struct esp_self_reflasher_segmented {
+    esp_self_reflasher_t           *handle;
+    esp_self_reflasher_pipeline_t  *pipeline;
+    SemaphoreHandle_t              segment_done;
+    volatile esp_err_t             err;        /* First range that failed for good stops the others */
+    size_t                         image_len;
+    size_t                         segment_count;
+    esp_self_reflasher_segment_t   segments[SEGMENT_MAX_COUNT];
+};
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_segment_open(esp_self_reflasher_segment_t *segment)
+{
+    esp_self_reflasher_t *self_reflasher_handle = segment->download->handle;
+    uint32_t from = segment->start + segment->done;
+    char range[32];
+
+    segment->client = esp_http_client_init(self_reflasher_handle->http_config);
+    if (segment->client == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to initialise HTTP connection", __func__);
+        return ESP_FAIL;
+    }
+
+    snprintf(range, sizeof(range), "bytes=%lu-%lu", from, segment->end - 1);
+    esp_http_client_set_header(segment->client, "Range", range);
+
+    esp_err_t err = esp_http_client_open(segment->client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to open HTTP connection: %s", __func__, esp_err_to_name(err));
+        return err;
+    }
+
+    int64_t content_length = esp_http_client_fetch_headers(segment->client);
+    if (esp_http_client_get_status_code(segment->client) != HttpStatus_PartialContent ||
+        content_length != (int64_t)(segment->end - from)) {
+        ESP_LOGE(TAG, "%s: Unexpected response to the request of range 0x%08lx-0x%08lx", __func__, from, segment->end);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Progress is reported from the calling task only, which receives the first
+ * range and then waits for the others.
+ */
+REFLASHER_ATTR static void esp_self_reflasher_segmented_report(esp_self_reflasher_segmented_t *download)
+{
+    size_t done = 0;
+
+    for (size_t i = 0; i < download->segment_count; i++) {
+        done += download->segments[i].done;
+    }
+    esp_self_reflasher_report_progress(download->handle, ESP_SELF_REFLASHER_PHASE_DOWNLOAD, done, download->image_len);
+}
+
+/*
+ * Receive the rest of the range into bursts handed over to the writer. As in
+ * the single connection download, bursts end on flash page boundaries.
+ */
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_segment_read(esp_self_reflasher_segment_t *segment)
+{
+    esp_self_reflasher_segmented_t *download = segment->download;
+    esp_self_reflasher_t *self_reflasher_handle = download->handle;
+    uint32_t len = segment->end - segment->start;
+    esp_err_t err = ESP_OK;
+
+    while (segment->done < len && err == ESP_OK) {
+        char *buffer;
+        size_t buffer_fill = 0;
+        uint32_t offset = self_reflasher_handle->partition_curr_download_addr + segment->start + segment->done;
+        size_t burst_len = MIN(BUFFER_SIZE - (offset % FLASH_PAGE_SIZE), len - segment->done);
+
+        err = esp_self_reflasher_pipeline_acquire(download->pipeline, &buffer);
+        if (err != ESP_OK) {
+            esp_self_reflasher_pipeline_release(download->pipeline, buffer);
+            return err;
+        }
+
+        while (buffer_fill < burst_len) {
+            if (download->err != ESP_OK) {
+                err = download->err;
+                break;
+            }
+
+            int data_read = esp_self_reflasher_http_read(segment->client, buffer + buffer_fill, burst_len - buffer_fill);
+            if (data_read < 0) {
+                ESP_LOGE(TAG, "%s: Error: SSL data read error", __func__);
+                err = ESP_ERR_HTTP_EAGAIN;
+                break;
+            } else if (data_read > 0) {
+                buffer_fill += data_read;
+            } else if (errno == ECONNRESET || errno == ENOTCONN ||
+                       esp_http_client_is_complete_data_received(segment->client)) {
+                ESP_LOGE(TAG, "%s: Connection closed before the end of the range", __func__);
+                err = ESP_ERR_HTTP_EAGAIN;
+                break;
+            }
+        }
+
+        // What was received before a failure is kept, the retry starts right after it
+        if (buffer_fill == 0) {
+            esp_self_reflasher_pipeline_release(download->pipeline, buffer);
+            break;
+        }
+        esp_err_t submit_err = esp_self_reflasher_pipeline_submit(download->pipeline, buffer, buffer_fill, offset);
+        segment->done += buffer_fill;
+        if (err == ESP_OK) {
+            err = submit_err;
+        }
+        if (segment == &download->segments[0]) {
+            esp_self_reflasher_segmented_report(download);
+        }
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_segment_close(esp_self_reflasher_segment_t *segment)
+{
+    if (segment->client != NULL) {
+        http_cleanup(segment->client);
+        segment->client = NULL;
+    }
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_segment_receive(esp_self_reflasher_segment_t *segment)
+{
+    esp_self_reflasher_segmented_t *download = segment->download;
+    esp_err_t err = ESP_OK;
+
+    for (int attempt = 0; ; attempt++) {
+        if (segment->client == NULL) {
+            err = esp_self_reflasher_segment_open(segment);
+        }
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_segment_read(segment);
+        }
+        esp_self_reflasher_segment_close(segment);
+
+        if (err == ESP_OK || download->err != ESP_OK || attempt == CONFIG_ESP_SELF_REFLASHER_SEGMENT_RETRIES) {
+            break;
+        }
+        ESP_LOGW(TAG, "Range 0x%08lx-0x%08lx failed at 0x%08lx, retrying (%d/%d)", segment->start, segment->end,
+                 segment->start + segment->done, attempt + 1, CONFIG_ESP_SELF_REFLASHER_SEGMENT_RETRIES);
+        err = ESP_OK;
+    }
+
+    if (err != ESP_OK && download->err == ESP_OK) {
+        download->err = err;
+    }
+    return err;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_segment_task(void *arg)
+{
+    esp_self_reflasher_segment_t *segment = (esp_self_reflasher_segment_t *)arg;
+
+    segment->err = esp_self_reflasher_segment_receive(segment);
+
+    xSemaphoreGive(segment->download->segment_done);
+    vTaskDelete(NULL);
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_segmented_download(esp_self_reflasher_t *self_reflasher_handle, esp_http_client_handle_t probe_client,
+                                                               size_t image_len)
+{
+    esp_err_t err;
+    size_t started = 0;
+
+    esp_self_reflasher_segmented_t *download = calloc(1, sizeof(esp_self_reflasher_segmented_t));
+    if (download == NULL) {
+        ESP_LOGE(TAG, "%s: Couldn't allocate memory for the segmented download", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Ranges are split on sector boundaries of the target, whatever the image start
+    uint32_t image_start = self_reflasher_handle->partition_curr_download_addr;
+    size_t segment_count = MAX(1, MIN(SEGMENT_MAX_COUNT, image_len / SEGMENT_MIN_SIZE));
+    uint32_t boundary = image_start;
+    for (size_t i = 0; i < segment_count; i++) {
+        esp_self_reflasher_segment_t *segment = &download->segments[i];
+        uint32_t next = ALIGN_UP(image_start + image_len * (i + 1) / segment_count, SPI_FLASH_SEC_SIZE);
+
+        segment->download = download;
+        segment->start = boundary - image_start;
+        segment->end = MIN(next - image_start, image_len);
+        boundary = image_start + segment->end;
+        if (segment->start == segment->end) {
+            break;
+        }
+        download->segment_count++;
+    }
+
+    download->handle = self_reflasher_handle;
+    download->err = ESP_OK;
+    download->image_len = image_len;
+    download->segment_done = xSemaphoreCreateCounting(SEGMENT_MAX_COUNT, 0);
+    if (download->segment_done == NULL) {
+        free(download);
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = esp_self_reflasher_pipeline_start(self_reflasher_handle, download->segment_count * SEGMENT_BUFFERS_PER_CONNECTION,
+                                            &download->pipeline);
+    if (err != ESP_OK) {
+        vSemaphoreDelete(download->segment_done);
+        free(download);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Downloading 0x%08x bytes over %u connections", image_len, download->segment_count);
+
+    // The first range keeps going over the probe connection, the others get their own task
+    for (size_t i = 1; i < download->segment_count; i++) {
+        if (xTaskCreatePinnedToCore(esp_self_reflasher_segment_task, "reflasher_seg",
+                                    CONFIG_ESP_SELF_REFLASHER_SEGMENT_TASK_STACK_SIZE, &download->segments[i],
+                                    CONFIG_ESP_SELF_REFLASHER_SEGMENT_TASK_PRIORITY, NULL, tskNO_AFFINITY) != pdPASS) {
+            ESP_LOGE(TAG, "%s: Failed to create a receiving task", __func__);
+            download->err = ESP_ERR_NO_MEM;
+            break;
+        }
+        started++;
+    }
+
+    if (download->err == ESP_OK) {
+        esp_self_reflasher_segment_t *first = &download->segments[0];
+        first->client = probe_client;
+        first->err = esp_self_reflasher_segment_read(first);
+        // The probe connection belongs to the caller, a retry opens a new one
+        first->client = NULL;
+        if (first->err != ESP_OK && download->err == ESP_OK) {
+            ESP_LOGW(TAG, "Range 0x%08lx-0x%08lx failed at 0x%08lx, retrying", first->start, first->end, first->start + first->done);
+            esp_self_reflasher_segment_receive(first);
+        }
+    }
+
+    for (size_t i = 0; i < started; ) {
+        if (xSemaphoreTake(download->segment_done, pdMS_TO_TICKS(SEGMENT_PROGRESS_INTERVAL_MS)) == pdTRUE) {
+            i++;
+        }
+        esp_self_reflasher_segmented_report(download);
+    }
+
+    esp_err_t pipeline_err = esp_self_reflasher_pipeline_finish(download->pipeline);
+    err = (download->err != ESP_OK) ? download->err : pipeline_err;
+
+    self_reflasher_handle->total_bin_data_size = 0;
+    for (size_t i = 0; i < download->segment_count; i++) {
+        self_reflasher_handle->total_bin_data_size += download->segments[i].done;
+    }
+
+    vSemaphoreDelete(download->segment_done);
+    free(download);
+
+    return err;
+}
@@ -0,0 +1,515 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "spi_flash_mmap.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_memory_utils.h"
+#endif
+#include "self_reflasher_placement.h"
+#include "self_reflasher_source.h"
+#include "self_reflasher_stats.h"
+#include "self_reflasher_verify.h"
+
+static const char *TAG = "self_reflasher_source";
+
+/* Built-in sources keep their state right after the esp_self_reflasher_source_t they hand out */
+
+typedef struct {
+    esp_self_reflasher_source_t    source;
+    const esp_http_client_config_t *http_config;
+    esp_http_client_handle_t       client;
+    size_t                         size;
+} esp_self_reflasher_http_source_t;
+
+typedef struct {
+    esp_self_reflasher_source_t    source;
+    FILE                           *file;
+    size_t                         size;
+    char                           path[];
+} esp_self_reflasher_file_source_t;
+
+typedef struct {
+    esp_self_reflasher_source_t    source;
+    esp_self_reflasher_stream_read_t read;
+    void                           *arg;
+    size_t                         size;
+    size_t                         offset;
+} esp_self_reflasher_stream_source_t;
+
+typedef struct {
+    esp_self_reflasher_source_t    source;
+    uint32_t                       address;
+    size_t                         size;
+    size_t                         offset;
+    const uint8_t                  *window;        /* Flash mapped from window_start up to window_end, NULL when none is */
+    uint32_t                       window_start;
+    uint32_t                       window_end;
+    spi_flash_mmap_handle_t        mmap_handle;
+} esp_self_reflasher_flash_source_t;
+
+typedef struct {
+    esp_self_reflasher_source_t    source;
+    const char                     *data;
+    size_t                         size;
+    size_t                         offset;
+} esp_self_reflasher_memory_source_t;
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_open(const esp_self_reflasher_source_t *source, size_t *size)
+{
+    if (source == NULL || source->ops == NULL || source->ops->open == NULL || source->ops->read == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = source->ops->open(source->ctx);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to open the image source: %s", __func__, esp_err_to_name(err));
+        return err;
+    }
+
+    *size = (source->ops->size != NULL) ? source->ops->size(source->ctx) : 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR int esp_self_reflasher_source_read(const esp_self_reflasher_source_t *source, char *buffer, size_t len)
+{
+    int64_t start = esp_timer_get_time();
+
+    int data_read = source->ops->read(source->ctx, buffer, len);
+
+    esp_self_reflasher_stats_count_input(esp_timer_get_time() - start, data_read);
+    return data_read;
+}
+
+REFLASHER_ATTR bool esp_self_reflasher_source_can_map(const esp_self_reflasher_source_t *source)
+{
+    return source->ops->map != NULL;
+}
+
+REFLASHER_ATTR int esp_self_reflasher_source_map(const esp_self_reflasher_source_t *source, const char **data, size_t len)
+{
+    int64_t start = esp_timer_get_time();
+
+    int data_read = source->ops->map(source->ctx, data, len);
+
+    esp_self_reflasher_stats_count_input(esp_timer_get_time() - start, data_read);
+    return data_read;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_source_close(const esp_self_reflasher_source_t *source)
+{
+    if (source->ops->close != NULL) {
+        source->ops->close(source->ctx);
+    }
+}
+
+/* HTTP */
+
+REFLASHER_ATTR static void esp_self_reflasher_http_source_close(void *ctx)
+{
+    esp_self_reflasher_http_source_t *http = (esp_self_reflasher_http_source_t *)ctx;
+
+    if (http->client != NULL) {
+        esp_http_client_close(http->client);
+        esp_http_client_cleanup(http->client);
+        http->client = NULL;
+    }
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_http_source_open(void *ctx)
+{
+    esp_self_reflasher_http_source_t *http = (esp_self_reflasher_http_source_t *)ctx;
+
+    http->client = esp_http_client_init(http->http_config);
+    if (http->client == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to initialise HTTP connection", __func__);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = esp_http_client_open(http->client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: Failed to open HTTP connection: %s", __func__, esp_err_to_name(err));
+        esp_self_reflasher_http_source_close(http);
+        return err;
+    }
+
+    int64_t content_length = esp_http_client_fetch_headers(http->client);
+    if (esp_http_client_get_status_code(http->client) != HttpStatus_Ok) {
+        ESP_LOGE(TAG, "%s: HTTP request error", __func__);
+        esp_self_reflasher_http_source_close(http);
+        return ESP_ERR_HTTP_CONNECT;
+    }
+
+    http->size = (content_length > 0) ? content_length : 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_http_source_size(void *ctx)
+{
+    return ((esp_self_reflasher_http_source_t *)ctx)->size;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_http_source_read(void *ctx, char *buffer, size_t len)
+{
+    esp_self_reflasher_http_source_t *http = (esp_self_reflasher_http_source_t *)ctx;
+
+    while (true) {
+        int data_read = esp_http_client_read(http->client, buffer, len);
+        if (data_read != 0) {
+            return data_read;
+        }
+        // esp_http_client_read never returns a negative error code, a closed transport shows in errno
+        if (errno == ECONNRESET || errno == ENOTCONN) {
+            ESP_LOGE(TAG, "%s: Connection closed, errno = %d", __func__, errno);
+            return -1;
+        }
+        if (esp_http_client_is_complete_data_received(http->client)) {
+            return 0;
+        }
+    }
+}
+
+static const esp_self_reflasher_source_ops_t s_http_source_ops = {
+    .open = esp_self_reflasher_http_source_open,
+    .size = esp_self_reflasher_http_source_size,
+    .read = esp_self_reflasher_http_source_read,
+    .close = esp_self_reflasher_http_source_close,
+};
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_http_create(const esp_http_client_config_t *http_config, esp_self_reflasher_source_t **source)
+{
+    if (http_config == NULL || source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_http_source_t *http = calloc(1, sizeof(esp_self_reflasher_http_source_t));
+    if (http == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to allocate the source", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    http->source.ops = &s_http_source_ops;
+    http->source.ctx = http;
+    http->http_config = http_config;
+
+    *source = &http->source;
+    return ESP_OK;
+}
+
+/* VFS file */
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_file_source_open(void *ctx)
+{
+    esp_self_reflasher_file_source_t *file = (esp_self_reflasher_file_source_t *)ctx;
+    struct stat st;
+
+    file->file = fopen(file->path, "rb");
+    if (file->file == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to open %s, errno = %d", __func__, file->path, errno);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Character devices have no length, the image then ends where the file does
+    file->size = (fstat(fileno(file->file), &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_file_source_size(void *ctx)
+{
+    return ((esp_self_reflasher_file_source_t *)ctx)->size;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_file_source_read(void *ctx, char *buffer, size_t len)
+{
+    esp_self_reflasher_file_source_t *file = (esp_self_reflasher_file_source_t *)ctx;
+
+    size_t data_read = fread(buffer, 1, len, file->file);
+    if (data_read == 0 && ferror(file->file)) {
+        ESP_LOGE(TAG, "%s: Failed to read %s, errno = %d", __func__, file->path, errno);
+        return -1;
+    }
+    return data_read;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_file_source_close(void *ctx)
+{
+    esp_self_reflasher_file_source_t *file = (esp_self_reflasher_file_source_t *)ctx;
+
+    if (file->file != NULL) {
+        fclose(file->file);
+        file->file = NULL;
+    }
+}
+
+static const esp_self_reflasher_source_ops_t s_file_source_ops = {
+    .open = esp_self_reflasher_file_source_open,
+    .size = esp_self_reflasher_file_source_size,
+    .read = esp_self_reflasher_file_source_read,
+    .close = esp_self_reflasher_file_source_close,
+};
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_file_create(const char *path, esp_self_reflasher_source_t **source)
+{
+    if (path == NULL || source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_file_source_t *file = calloc(1, sizeof(esp_self_reflasher_file_source_t) + strlen(path) + 1);
+    if (file == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to allocate the source", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    file->source.ops = &s_file_source_ops;
+    file->source.ctx = file;
+    strcpy(file->path, path);
+
+    *source = &file->source;
+    return ESP_OK;
+}
+
+/* Byte stream */
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_stream_source_open(void *ctx)
+{
+    ((esp_self_reflasher_stream_source_t *)ctx)->offset = 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_stream_source_size(void *ctx)
+{
+    return ((esp_self_reflasher_stream_source_t *)ctx)->size;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_stream_source_read(void *ctx, char *buffer, size_t len)
+{
+    esp_self_reflasher_stream_source_t *stream = (esp_self_reflasher_stream_source_t *)ctx;
+
+    if (stream->offset == stream->size) {
+        return 0;
+    }
+
+    int data_read = stream->read(stream->arg, buffer, MIN(len, stream->size - stream->offset));
+    if (data_read == 0) {
+        ESP_LOGE(TAG, "%s: Stream timed out at offset 0x%08x", __func__, stream->offset);
+        return -1;
+    }
+    if (data_read > 0) {
+        stream->offset += data_read;
+    }
+    return data_read;
+}
+
+static const esp_self_reflasher_source_ops_t s_stream_source_ops = {
+    .open = esp_self_reflasher_stream_source_open,
+    .size = esp_self_reflasher_stream_source_size,
+    .read = esp_self_reflasher_stream_source_read,
+};
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_stream_create(esp_self_reflasher_stream_read_t read, void *arg, size_t size,
+                                                                 esp_self_reflasher_source_t **source)
+{
+    if (read == NULL || size == 0 || source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_stream_source_t *stream = calloc(1, sizeof(esp_self_reflasher_stream_source_t));
+    if (stream == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to allocate the source", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    stream->source.ops = &s_stream_source_ops;
+    stream->source.ctx = stream;
+    stream->read = read;
+    stream->arg = arg;
+    stream->size = size;
+
+    *source = &stream->source;
+    return ESP_OK;
+}
+
+/* Flash region */
+
+REFLASHER_ATTR static void esp_self_reflasher_flash_source_unmap(esp_self_reflasher_flash_source_t *flash)
+{
+    if (flash->window != NULL) {
+        spi_flash_munmap(flash->mmap_handle);
+        flash->window = NULL;
+    }
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_flash_source_open(void *ctx)
+{
+    esp_self_reflasher_flash_source_t *flash = (esp_self_reflasher_flash_source_t *)ctx;
+
+    esp_self_reflasher_flash_source_unmap(flash);
+    flash->offset = 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_flash_source_size(void *ctx)
+{
+    return ((esp_self_reflasher_flash_source_t *)ctx)->size;
+}
+
+/* The region is read through mmap windows, sparing a flash driver call per read */
+REFLASHER_ATTR static int esp_self_reflasher_flash_source_read(void *ctx, char *buffer, size_t len)
+{
+    esp_self_reflasher_flash_source_t *flash = (esp_self_reflasher_flash_source_t *)ctx;
+    uint32_t address = flash->address + flash->offset;
+
+    if (flash->offset == flash->size) {
+        return 0;
+    }
+
+    if (flash->window == NULL || address >= flash->window_end) {
+        esp_self_reflasher_flash_source_unmap(flash);
+        size_t window_len = MIN(VERIFY_WINDOW_SIZE, flash->size - flash->offset);
+        if (esp_self_reflasher_map_window(address, window_len, &flash->window, &flash->mmap_handle) != ESP_OK) {
+            flash->window = NULL;
+            return -1;
+        }
+        flash->window_start = address;
+        flash->window_end = address + window_len;
+    }
+
+    size_t data_read = MIN(len, flash->window_end - address);
+    memcpy(buffer, flash->window + (address - flash->window_start), data_read);
+    flash->offset += data_read;
+    return data_read;
+}
+
+REFLASHER_ATTR static void esp_self_reflasher_flash_source_close(void *ctx)
+{
+    esp_self_reflasher_flash_source_unmap((esp_self_reflasher_flash_source_t *)ctx);
+}
+
+static const esp_self_reflasher_source_ops_t s_flash_source_ops = {
+    .open = esp_self_reflasher_flash_source_open,
+    .size = esp_self_reflasher_flash_source_size,
+    .read = esp_self_reflasher_flash_source_read,
+    .close = esp_self_reflasher_flash_source_close,
+};
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_flash_create(uint32_t address, size_t size, esp_self_reflasher_source_t **source)
+{
+    if (size == 0 || source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_flash_source_t *flash = calloc(1, sizeof(esp_self_reflasher_flash_source_t));
+    if (flash == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to allocate the source", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    flash->source.ops = &s_flash_source_ops;
+    flash->source.ctx = flash;
+    flash->address = address;
+    flash->size = size;
+
+    *source = &flash->source;
+    return ESP_OK;
+}
+
+/* Memory region */
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_memory_source_open(void *ctx)
+{
+    ((esp_self_reflasher_memory_source_t *)ctx)->offset = 0;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_memory_source_size(void *ctx)
+{
+    return ((esp_self_reflasher_memory_source_t *)ctx)->size;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_memory_source_map(void *ctx, const char **data, size_t len)
+{
+    esp_self_reflasher_memory_source_t *memory = (esp_self_reflasher_memory_source_t *)ctx;
+
+    size_t data_read = MIN(len, memory->size - memory->offset);
+    *data = memory->data + memory->offset;
+    memory->offset += data_read;
+    return data_read;
+}
+
+REFLASHER_ATTR static int esp_self_reflasher_memory_source_read(void *ctx, char *buffer, size_t len)
+{
+    const char *data;
+
+    int data_read = esp_self_reflasher_memory_source_map(ctx, &data, len);
+    memcpy(buffer, data, data_read);
+    return data_read;
+}
+
+static const esp_self_reflasher_source_ops_t s_memory_source_ops = {
+    .open = esp_self_reflasher_memory_source_open,
+    .size = esp_self_reflasher_memory_source_size,
+    .read = esp_self_reflasher_memory_source_read,
+    .map = esp_self_reflasher_memory_source_map,
+};
+
+/* The flash driver programs from external memory through a small bounce buffer, such data is copied into the chunk buffer instead */
+static const esp_self_reflasher_source_ops_t s_memory_source_copy_ops = {
+    .open = esp_self_reflasher_memory_source_open,
+    .size = esp_self_reflasher_memory_source_size,
+    .read = esp_self_reflasher_memory_source_read,
+};
+
+REFLASHER_ATTR static bool esp_self_reflasher_in_internal_ram(const void *data)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return true;
+#else
+    return esp_ptr_internal(data);
+#endif
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_memory_create(const void *data, size_t size, esp_self_reflasher_source_t **source)
+{
+    if (data == NULL || size == 0 || source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_memory_source_t *memory = calloc(1, sizeof(esp_self_reflasher_memory_source_t));
+    if (memory == NULL) {
+        ESP_LOGE(TAG, "%s: Failed to allocate the source", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    memory->source.ops = esp_self_reflasher_in_internal_ram(data) ? &s_memory_source_ops : &s_memory_source_copy_ops;
+    memory->source.ctx = memory;
+    memory->data = data;
+    memory->size = size;
+
+    *source = &memory->source;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_source_delete(esp_self_reflasher_source_t *source)
+{
+    if (source == NULL) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_source_close(source);
+    // The source is the first member of every built-in source
+    free(source);
+    return ESP_OK;
+}
@@ -0,0 +1,277 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_flash.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_stats.h"
+
+static const char *TAG = "self_reflasher_stats";
+
+extern esp_flash_t *esp_flash_default_chip;
+
+#if CONFIG_ESP_SELF_REFLASHER_STATS_EVENTS
+ESP_EVENT_DEFINE_BASE(ESP_SELF_REFLASHER_EVENT);
+#endif
+
+/* Segment receiving tasks and the flash writer task account concurrently */
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_self_reflasher_stats_t *s_stats = NULL;
+/* Flash operations since boot, counted whether a phase is accounted or not */
+static uint32_t s_flash_ops = 0;
+
+REFLASHER_ATTR int64_t esp_self_reflasher_stats_phase_begin(esp_self_reflasher_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats = stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    return esp_timer_get_time();
+}
+
+REFLASHER_ATTR void esp_self_reflasher_stats_phase_pause(esp_self_reflasher_stats_t *stats, esp_self_reflasher_phase_t phase, int64_t start)
+{
+    int64_t duration = esp_timer_get_time() - start;
+    uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+    size_t heap_free = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats = NULL;
+    stats->phase_time_us[phase] += duration;
+    if (stats->stack_high_water_mark == 0 || stack_free < stats->stack_high_water_mark) {
+        stats->stack_high_water_mark = stack_free;
+    }
+    stats->min_free_heap = heap_free;
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    ESP_LOGD(TAG, "Phase %d ran for %lld us", phase, duration);
+}
+
+REFLASHER_ATTR void esp_self_reflasher_stats_phase_end(esp_self_reflasher_stats_t *stats, esp_self_reflasher_phase_t phase, int64_t start)
+{
+    esp_self_reflasher_stats_phase_pause(stats, phase, start);
+
+#if CONFIG_ESP_SELF_REFLASHER_STATS_EVENTS
+    // Never block the reflash on a full event queue
+    esp_err_t err = esp_event_post(ESP_SELF_REFLASHER_EVENT, phase, stats, sizeof(esp_self_reflasher_stats_t), 0);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "%s: Failed to post the phase stats: %s", __func__, esp_err_to_name(err));
+    }
+#endif
+}
+
+REFLASHER_COMMIT_ATTR void esp_self_reflasher_stats_count_mapped(size_t len)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    if (s_stats != NULL) {
+        s_stats->bytes_read += len;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_flash_erase(const esp_partition_t *partition, uint32_t address, size_t len)
+{
+    esp_err_t err;
+    int64_t start = esp_timer_get_time();
+
+    if (partition != NULL) {
+        err = esp_partition_erase_range(partition, address - partition->address, len);
+    } else {
+        err = esp_flash_erase_region(esp_flash_default_chip, address, len);
+    }
+
+    int64_t duration = esp_timer_get_time() - start;
+    portENTER_CRITICAL(&s_stats_lock);
+    s_flash_ops++;
+    if (s_stats != NULL && err == ESP_OK) {
+        s_stats->flash_critical_sections++;
+        s_stats->erase_time_us += duration;
+        s_stats->bytes_erased += len;
+        if (len == FLASH_BLOCK_SIZE) {
+            s_stats->block_erases++;
+        } else {
+            s_stats->sector_erases += len / SPI_FLASH_SEC_SIZE;
+        }
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    return err;
+}
+
+REFLASHER_COMMIT_ATTR static esp_err_t esp_self_reflasher_flash_program(const esp_partition_t *partition, uint32_t address, const void *data, size_t len)
+{
+    esp_err_t err;
+    int64_t start = esp_timer_get_time();
+
+    if (partition != NULL) {
+        err = esp_partition_write(partition, address - partition->address, data, len);
+    } else {
+        err = esp_flash_write(esp_flash_default_chip, data, address, len);
+    }
+
+    int64_t duration = esp_timer_get_time() - start;
+    portENTER_CRITICAL(&s_stats_lock);
+    s_flash_ops++;
+    if (s_stats != NULL && err == ESP_OK) {
+        s_stats->flash_critical_sections++;
+        s_stats->write_time_us += duration;
+        s_stats->bytes_written += len;
+        s_stats->write_calls++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    return err;
+}
+
+#if CONFIG_ESP_SELF_REFLASHER_SKIP_BLANK_PAGES
+REFLASHER_COMMIT_ATTR static bool esp_self_reflasher_is_blank(const uint8_t *data, size_t len)
+{
+    // Byte compare up to the first word boundary, then a word at a time
+    while (len > 0 && ((uintptr_t)data & (sizeof(uint32_t) - 1)) != 0) {
+        if (*data != 0xFF) {
+            return false;
+        }
+        data++;
+        len--;
+    }
+
+    const uint32_t *word = (const uint32_t *)data;
+    uint32_t acc = UINT32_MAX;
+    for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t)) {
+        acc &= *word++;
+    }
+    if (acc != UINT32_MAX) {
+        return false;
+    }
+
+    data = (const uint8_t *)word;
+    while (len > 0) {
+        if (*data++ != 0xFF) {
+            return false;
+        }
+        len--;
+    }
+    return true;
+}
+#endif
+
+/*
+ * Programming can only clear bits, so writing 0xFF never changes the flash
+ * contents. Pages whose data is all 0xFF are left out, and the pages between
+ * them are written in as few calls as possible. Encrypted partitions are
+ * written as is, as their ciphertext of 0xFF data is not blank.
+ */
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_flash_write(const esp_partition_t *partition, uint32_t address, const void *data, size_t len)
+{
+#if CONFIG_ESP_SELF_REFLASHER_SKIP_BLANK_PAGES
+    if (partition != NULL && partition->encrypted) {
+        return esp_self_reflasher_flash_program(partition, address, data, len);
+    }
+
+    const uint8_t *bytes = data;
+    size_t run_start = 0;
+    size_t offset = 0;
+    uint32_t skipped = 0;
+
+    while (offset < len) {
+        size_t page_len = MIN(FLASH_PAGE_SIZE - ((address + offset) % FLASH_PAGE_SIZE), len - offset);
+
+        if (esp_self_reflasher_is_blank(bytes + offset, page_len)) {
+            if (offset > run_start) {
+                esp_err_t err = esp_self_reflasher_flash_program(partition, address + run_start, bytes + run_start, offset - run_start);
+                if (err != ESP_OK) {
+                    return err;
+                }
+            }
+            run_start = offset + page_len;
+            skipped++;
+        }
+        offset += page_len;
+    }
+
+    if (skipped > 0) {
+        portENTER_CRITICAL(&s_stats_lock);
+        if (s_stats != NULL) {
+            s_stats->blank_pages_skipped += skipped;
+        }
+        portEXIT_CRITICAL(&s_stats_lock);
+    }
+
+    if (len > run_start) {
+        return esp_self_reflasher_flash_program(partition, address + run_start, bytes + run_start, len - run_start);
+    }
+    return ESP_OK;
+#else
+    return esp_self_reflasher_flash_program(partition, address, data, len);
+#endif
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_flash_read(const esp_partition_t *partition, uint32_t address, void *data, size_t len)
+{
+    esp_err_t err;
+    int64_t start = esp_timer_get_time();
+
+    if (partition != NULL) {
+        err = esp_partition_read(partition, address - partition->address, data, len);
+    } else {
+        err = esp_flash_read(esp_flash_default_chip, data, address, len);
+    }
+
+    int64_t duration = esp_timer_get_time() - start;
+    portENTER_CRITICAL(&s_stats_lock);
+    s_flash_ops++;
+    if (s_stats != NULL && err == ESP_OK) {
+        s_stats->flash_critical_sections++;
+        s_stats->read_time_us += duration;
+        s_stats->bytes_read += len;
+        s_stats->read_calls++;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    return err;
+}
+
+REFLASHER_COMMIT_ATTR uint32_t esp_self_reflasher_flash_op_count(void)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    uint32_t count = s_flash_ops;
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    return count;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_stats_count_input(int64_t duration_us, int data_read)
+{
+    portENTER_CRITICAL(&s_stats_lock);
+    if (s_stats != NULL) {
+        s_stats->http_read_time_us += duration_us;
+        if (data_read > 0) {
+            s_stats->http_read_calls++;
+            s_stats->http_bytes_read += data_read;
+        }
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+REFLASHER_ATTR int esp_self_reflasher_http_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    int64_t start = esp_timer_get_time();
+
+    int data_read = esp_http_client_read(client, buffer, len);
+
+    esp_self_reflasher_stats_count_input(esp_timer_get_time() - start, data_read);
+    return data_read;
+}
@@ -0,0 +1,408 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "spi_flash_mmap.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher_priv.h"
+#include "self_reflasher_erase.h"
+#include "self_reflasher_verify.h"
+#include "self_reflasher_stats.h"
+#include "self_reflasher_commit.h"
+#include "self_reflasher_partition.h"
+
+static const char *TAG = "self_reflasher_step";
+
+typedef struct {
+    size_t    budget_bytes;
+    uint32_t  budget_us;
+    int64_t   start_us;
+    size_t    bytes;          /* Bytes processed by the step so far */
+} esp_self_reflasher_budget_t;
+
+REFLASHER_ATTR static bool esp_self_reflasher_budget_spent(const esp_self_reflasher_budget_t *budget)
+{
+    return (budget->budget_bytes > 0 && budget->bytes >= budget->budget_bytes) ||
+           (budget->budget_us > 0 && esp_timer_get_time() - budget->start_us >= budget->budget_us);
+}
+
+REFLASHER_ATTR static esp_self_reflasher_phase_t esp_self_reflasher_step_phase(esp_self_reflasher_step_state_t state)
+{
+    switch (state) {
+    case STEP_STATE_COPY:
+        return ESP_SELF_REFLASHER_PHASE_COPY;
+    case STEP_STATE_VERIFY:
+        return ESP_SELF_REFLASHER_PHASE_VERIFY;
+    default:
+        return ESP_SELF_REFLASHER_PHASE_DOWNLOAD;
+    }
+}
+
+/*
+ * A compressed image copied from the staging partition was decompressed, so
+ * the destination is checked against the digest of its header, as is a direct
+ * stream, which has no staged copy to compare against.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_step_verify_digest(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    return self_reflasher_handle->direct_stream || (self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch);
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_step_verify_len(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    if (!self_reflasher_handle->direct_stream && self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch) {
+        return self_reflasher_handle->inflated_header.image_size;
+    }
+    return self_reflasher_handle->total_bin_data_size;
+}
+
+REFLASHER_ATTR static size_t esp_self_reflasher_step_total(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    switch (self_reflasher_handle->step.state) {
+    case STEP_STATE_DOWNLOAD:
+        return self_reflasher_handle->download_len;
+    case STEP_STATE_COPY:
+        return self_reflasher_handle->total_bin_data_size;
+    case STEP_STATE_VERIFY:
+    case STEP_STATE_DONE:
+        return esp_self_reflasher_step_verify_len(self_reflasher_handle);
+    default:
+        return 0;
+    }
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_step_enter_verify(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+
+    step->offset = 0;
+    step->state = STEP_STATE_DONE;
+    if (!self_reflasher_handle->verify_after_copy) {
+        return ESP_OK;
+    }
+    if (self_reflasher_handle->direct_stream && !self_reflasher_handle->staged_sha256_valid) {
+        ESP_LOGW(TAG, "%s: No expected digest set, destination region not verified", __func__);
+        return ESP_OK;
+    }
+
+    step->state = STEP_STATE_VERIFY;
+    if (esp_self_reflasher_step_verify_digest(self_reflasher_handle)) {
+        esp_self_reflasher_sha256_start(&self_reflasher_handle->sha256_ctx);
+        step->sha256_running = true;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Only a plain copy is split over several steps. It erases the destination
+ * just ahead of the writes instead of all up front, so no step is stuck
+ * erasing the whole footprint.
+ */
+REFLASHER_ATTR static bool esp_self_reflasher_step_copy_whole(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    return self_reflasher_handle->differential_copy || self_reflasher_handle->commit_header_last ||
+           (self_reflasher_handle->compressed && !self_reflasher_handle->delta_patch);
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_step_enter_copy(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+
+    if (self_reflasher_handle->direct_stream) {
+        return esp_self_reflasher_step_enter_verify(self_reflasher_handle);
+    }
+
+    // The application code runs between the steps, so it cannot be the one being overwritten
+    if (esp_self_reflasher_overlaps_running(&self_reflasher_handle->dest_region)) {
+        ESP_LOGE(TAG, "%s: Destination overlaps the running partition, which cannot be rewritten step by step", __func__);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    step->state = STEP_STATE_COPY;
+    step->offset = 0;
+    step->erase_addr = self_reflasher_handle->dest_region.region_address;
+    if (esp_self_reflasher_step_copy_whole(self_reflasher_handle)) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = esp_self_reflasher_copy_prepare(self_reflasher_handle, &step->copy_journal, &step->journal);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Hash the staged data again as it is copied, chunk by chunk ahead of the copy, to catch it changing after the download
+    if (self_reflasher_handle->staged_sha256_valid) {
+        esp_self_reflasher_sha256_start(&self_reflasher_handle->sha256_ctx);
+        step->sha256_running = true;
+    }
+    return ESP_OK;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_step_download(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_budget_t *budget)
+{
+    esp_err_t err;
+    bool finished = false;
+
+    do {
+        size_t received = self_reflasher_handle->total_bin_data_size;
+        err = esp_self_reflasher_receive_burst(self_reflasher_handle, &finished);
+        budget->bytes += self_reflasher_handle->total_bin_data_size - received;
+    } while (err == ESP_OK && !finished && !esp_self_reflasher_budget_spent(budget));
+
+    if (err != ESP_OK || finished) {
+        // The download releases everything it holds when it ends, successful or not
+        self_reflasher_handle->step.state = STEP_STATE_IDLE;
+        err = esp_self_reflasher_download_end(self_reflasher_handle, err);
+        if (err == ESP_OK) {
+            err = esp_self_reflasher_step_enter_copy(self_reflasher_handle);
+        }
+    }
+
+    return err;
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_step_copy(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_budget_t *budget)
+{
+    esp_err_t err;
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+
+    if (esp_self_reflasher_step_copy_whole(self_reflasher_handle)) {
+        err = esp_self_reflasher_copy(self_reflasher_handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+        budget->bytes += self_reflasher_handle->total_bin_data_size;
+        return esp_self_reflasher_step_enter_verify(self_reflasher_handle);
+    }
+
+    size_t len = self_reflasher_handle->total_bin_data_size;
+    uint32_t dest_start = self_reflasher_handle->dest_region.region_address;
+    uint32_t dest_end = dest_start + self_reflasher_handle->dest_region.region_size;
+    uint32_t erase_end = self_reflasher_handle->erase_clear_tail ? dest_end : dest_start + len;
+    mbedtls_sha256_context *sha256_ctx = step->sha256_running ? &self_reflasher_handle->sha256_ctx : NULL;
+
+    while (step->offset < len) {
+        size_t data_len = MIN(len - step->offset, BUFFER_SIZE);
+        uint32_t address_write = dest_start + step->offset;
+
+        if (sha256_ctx != NULL) {
+            err = esp_self_reflasher_sha256_update_staged(self_reflasher_handle, self_reflasher_handle->partition_curr_copy_offset + step->offset,
+                                                          data_len, self_reflasher_handle->buffer, BUFFER_SIZE, sha256_ctx);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        err = esp_self_reflasher_erase_until(NULL, &step->erase_addr, address_write + data_len, erase_end, erase_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+            return err;
+        }
+
+        err = esp_self_reflasher_copy_range(self_reflasher_handle, self_reflasher_handle->partition_curr_copy_offset + step->offset,
+                                            address_write, data_len, self_reflasher_handle->buffer, BUFFER_SIZE, step->journal);
+        if (err != ESP_OK) {
+            return err;
+        }
+        step->offset += data_len;
+        budget->bytes += data_len;
+        esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_COPY, step->offset, len);
+
+        if (esp_self_reflasher_budget_spent(budget)) {
+            return ESP_OK;
+        }
+    }
+
+    // Erase whatever the writes did not reach, the whole tail when erase_clear_tail is set
+    while (step->erase_addr < erase_end) {
+        uint32_t erase_addr = step->erase_addr;
+        err = esp_self_reflasher_erase_until(NULL, &step->erase_addr, erase_addr + SPI_FLASH_SEC_SIZE, erase_end, erase_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: Failed to erase flash destination region, error: %s", __func__, esp_err_to_name(err));
+            return err;
+        }
+        budget->bytes += step->erase_addr - erase_addr;
+
+        if (step->erase_addr < erase_end && esp_self_reflasher_budget_spent(budget)) {
+            return ESP_OK;
+        }
+    }
+
+    if (step->sha256_running) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        esp_self_reflasher_sha256_finish(&self_reflasher_handle->sha256_ctx, digest);
+        step->sha256_running = false;
+        err = esp_self_reflasher_sha256_check(self_reflasher_handle->staged_sha256, digest);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (step->journal != NULL) {
+        err = esp_self_reflasher_copy_journal_end(step->journal);
+        step->journal = NULL;
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    ESP_LOGI(TAG, "Data copied from partition address 0x%08lx offset 0x%08lx to region: 0x%08lx",
+             self_reflasher_handle->target_partition->address, self_reflasher_handle->partition_curr_copy_offset, dest_start);
+
+    return esp_self_reflasher_step_enter_verify(self_reflasher_handle);
+}
+
+REFLASHER_ATTR static esp_err_t esp_self_reflasher_step_verify(esp_self_reflasher_t *self_reflasher_handle, esp_self_reflasher_budget_t *budget)
+{
+    esp_err_t err;
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+    size_t len = esp_self_reflasher_step_verify_len(self_reflasher_handle);
+    uint32_t dest_address = self_reflasher_handle->dest_region.region_address;
+
+    while (step->offset < len) {
+        size_t window_len = MIN(len - step->offset, VERIFY_WINDOW_SIZE);
+        if (budget->budget_bytes > 0) {
+            window_len = MIN(window_len, MAX(budget->budget_bytes, BUFFER_SIZE));
+        }
+
+        if (step->sha256_running) {
+            err = esp_self_reflasher_sha256_update_region(&self_reflasher_handle->sha256_ctx, dest_address + step->offset, window_len);
+        } else {
+            uint32_t src_address = self_reflasher_handle->target_partition->address + self_reflasher_handle->partition_curr_copy_offset;
+            err = esp_self_reflasher_verify_region(dest_address + step->offset, src_address + step->offset, window_len, NULL);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        step->offset += window_len;
+        budget->bytes += window_len;
+        esp_self_reflasher_report_progress(self_reflasher_handle, ESP_SELF_REFLASHER_PHASE_VERIFY, step->offset, len);
+
+        if (step->offset < len && esp_self_reflasher_budget_spent(budget)) {
+            return ESP_OK;
+        }
+    }
+
+    if (step->sha256_running) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        const uint8_t *expected = self_reflasher_handle->direct_stream ? self_reflasher_handle->staged_sha256 :
+                                  self_reflasher_handle->inflated_header.image_sha256;
+        esp_self_reflasher_sha256_finish(&self_reflasher_handle->sha256_ctx, digest);
+        step->sha256_running = false;
+        err = esp_self_reflasher_sha256_check(expected, digest);
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "Region 0x%08lx digest verified", dest_address);
+    }
+
+    step->state = STEP_STATE_DONE;
+    return ESP_OK;
+}
+
+REFLASHER_ATTR bool esp_self_reflasher_step_busy(const esp_self_reflasher_t *self_reflasher_handle)
+{
+    return self_reflasher_handle->step.state != STEP_STATE_IDLE && self_reflasher_handle->step.state != STEP_STATE_DONE;
+}
+
+REFLASHER_ATTR void esp_self_reflasher_step_abort(esp_self_reflasher_t *self_reflasher_handle)
+{
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+
+    if (esp_self_reflasher_step_busy(self_reflasher_handle)) {
+        ESP_LOGW(TAG, "Aborting the reflash being stepped");
+    }
+    if (step->state == STEP_STATE_DOWNLOAD) {
+        esp_self_reflasher_download_end(self_reflasher_handle, ESP_ERR_INVALID_STATE);
+    }
+    if (step->sha256_running) {
+        mbedtls_sha256_free(&self_reflasher_handle->sha256_ctx);
+        step->sha256_running = false;
+    }
+    step->journal = NULL;
+    step->state = STEP_STATE_IDLE;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_step(esp_self_reflasher_handle_t handle, size_t budget_bytes, uint32_t budget_us,
+                                                 esp_self_reflasher_progress_t *progress)
+{
+    esp_err_t err = ESP_OK;
+    esp_self_reflasher_t *self_reflasher_handle = (esp_self_reflasher_t *)handle;
+
+    if (self_reflasher_handle == NULL ||
+        (self_reflasher_handle->target_partition == NULL && !self_reflasher_handle->direct_stream) ||
+        (self_reflasher_handle->http_config == NULL && self_reflasher_handle->source == NULL)) {
+        ESP_LOGE(TAG, "%s: Invalid argument", __func__);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_self_reflasher_step_t *step = &self_reflasher_handle->step;
+    esp_self_reflasher_step_state_t state = step->state;
+    esp_self_reflasher_budget_t budget = {
+        .budget_bytes = budget_bytes,
+        .budget_us = budget_us,
+        .start_us = esp_timer_get_time(),
+    };
+
+    if (state != STEP_STATE_DONE) {
+        int64_t start = esp_self_reflasher_stats_phase_begin(&self_reflasher_handle->stats);
+
+        switch (state) {
+        case STEP_STATE_IDLE:
+            err = esp_self_reflasher_download_begin(self_reflasher_handle, false);
+            if (err == ESP_OK) {
+                step->state = STEP_STATE_DOWNLOAD;
+            }
+            break;
+        case STEP_STATE_DOWNLOAD:
+            err = esp_self_reflasher_step_download(self_reflasher_handle, &budget);
+            break;
+        case STEP_STATE_COPY:
+            err = esp_self_reflasher_step_copy(self_reflasher_handle, &budget);
+            break;
+        case STEP_STATE_VERIFY:
+            err = esp_self_reflasher_step_verify(self_reflasher_handle, &budget);
+            break;
+        default:
+            break;
+        }
+
+        esp_self_reflasher_phase_t phase = esp_self_reflasher_step_phase(state);
+        if (err != ESP_OK || esp_self_reflasher_step_phase(step->state) != phase || step->state == STEP_STATE_DONE) {
+            esp_self_reflasher_stats_phase_end(&self_reflasher_handle->stats, phase, start);
+        } else {
+            esp_self_reflasher_stats_phase_pause(&self_reflasher_handle->stats, phase, start);
+        }
+    }
+
+    if (err != ESP_OK) {
+        esp_self_reflasher_step_abort(self_reflasher_handle);
+    }
+
+    if (progress != NULL) {
+        progress->phase = esp_self_reflasher_step_phase(step->state);
+        progress->bytes_total = esp_self_reflasher_step_total(self_reflasher_handle);
+        switch (step->state) {
+        case STEP_STATE_DOWNLOAD:
+            progress->bytes_done = self_reflasher_handle->total_bin_data_size;
+            break;
+        case STEP_STATE_DONE:
+            progress->bytes_done = progress->bytes_total;
+            break;
+        default:
+            progress->bytes_done = step->offset;
+            break;
+        }
+    }
+
+    if (err != ESP_OK) {
+        return err;
+    }
+    return (step->state == STEP_STATE_DONE) ? ESP_OK : ESP_ERR_NOT_FINISHED;
+}
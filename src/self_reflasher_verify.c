@@ -0,0 +1,142 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "spi_flash_mmap.h"
+#include "mbedtls/sha256.h"
+#include "self_reflasher_placement.h"
+#include "self_reflasher.h"
+#include "self_reflasher_verify.h"
+#include "self_reflasher_stats.h"
+
+DRAM_ATTR static const char TAG[] = "self_reflasher_verify";
+
+/*
+ * Map [address, address + len) for data reads. spi_flash_mmap needs an MMU
+ * page aligned start, so the mapping starts below and the pointer is moved up.
+ */
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_map_window(uint32_t address, size_t len, const uint8_t **ptr,
+                                                              spi_flash_mmap_handle_t *mmap_handle)
+{
+    uint32_t map_start = address & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    const void *map_ptr;
+
+    esp_err_t err = spi_flash_mmap(map_start, address - map_start + len, SPI_FLASH_MMAP_DATA, &map_ptr, mmap_handle);
+    if (err != ESP_OK) {
+        ESP_DRAM_LOGE(TAG, "%s: Failed to map flash, address: 0x%08lx, error: 0x%x", __func__, address, err);
+        return err;
+    }
+
+    esp_self_reflasher_stats_count_mapped(len);
+    *ptr = (const uint8_t *)map_ptr + (address - map_start);
+    return ESP_OK;
+}
+
+/*
+ * Index of the first differing byte, or len when both buffers match. Words are
+ * compared when both pointers share the same alignment, which is the common case.
+ */
+REFLASHER_COMMIT_ATTR static size_t esp_self_reflasher_first_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+
+    if (((uintptr_t)a & 3) == ((uintptr_t)b & 3)) {
+        while (i < len && ((uintptr_t)(a + i) & 3) != 0) {
+            if (a[i] != b[i]) {
+                return i;
+            }
+            i++;
+        }
+        while (i + sizeof(uint32_t) <= len && *(const uint32_t *)(a + i) == *(const uint32_t *)(b + i)) {
+            i += sizeof(uint32_t);
+        }
+    }
+
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+REFLASHER_COMMIT_ATTR esp_err_t esp_self_reflasher_verify_region(uint32_t dest_address, uint32_t src_address, size_t len, uint32_t *mismatch_offset)
+{
+    esp_err_t err = ESP_OK;
+    size_t offset = 0;
+
+    while (offset < len) {
+        size_t window_len = MIN(len - offset, VERIFY_WINDOW_SIZE);
+        spi_flash_mmap_handle_t dest_mmap, src_mmap;
+        const uint8_t *dest_ptr, *src_ptr;
+
+        err = esp_self_reflasher_map_window(dest_address + offset, window_len, &dest_ptr, &dest_mmap);
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = esp_self_reflasher_map_window(src_address + offset, window_len, &src_ptr, &src_mmap);
+        if (err != ESP_OK) {
+            spi_flash_munmap(dest_mmap);
+            return err;
+        }
+
+        size_t mismatch = esp_self_reflasher_first_mismatch(dest_ptr, src_ptr, window_len);
+
+        spi_flash_munmap(src_mmap);
+        spi_flash_munmap(dest_mmap);
+
+        if (mismatch < window_len) {
+            ESP_DRAM_LOGE(TAG, "%s: Region 0x%08lx differs from 0x%08lx at offset 0x%08x", __func__,
+                          dest_address, src_address, offset + mismatch);
+            if (mismatch_offset != NULL) {
+                *mismatch_offset = offset + mismatch;
+            }
+            return ESP_ERR_INVALID_CRC;
+        }
+        offset += window_len;
+    }
+
+    ESP_DRAM_LOGI(TAG, "Region 0x%08lx verified, 0x%08x bytes", dest_address, len);
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_sha256_update_region(mbedtls_sha256_context *sha256_ctx, uint32_t address, size_t len)
+{
+    size_t offset = 0;
+
+    while (offset < len) {
+        size_t window_len = MIN(len - offset, VERIFY_WINDOW_SIZE);
+        spi_flash_mmap_handle_t mmap_handle;
+        const uint8_t *ptr;
+
+        esp_err_t err = esp_self_reflasher_map_window(address + offset, window_len, &ptr, &mmap_handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+        mbedtls_sha256_update(sha256_ctx, ptr, window_len);
+        spi_flash_munmap(mmap_handle);
+
+        offset += window_len;
+    }
+
+    return ESP_OK;
+}
+
+REFLASHER_ATTR esp_err_t esp_self_reflasher_sha256_region(uint32_t address, size_t len, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    mbedtls_sha256_context sha256_ctx;
+
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts(&sha256_ctx, 0);
+
+    esp_err_t err = esp_self_reflasher_sha256_update_region(&sha256_ctx, address, len);
+
+    mbedtls_sha256_finish(&sha256_ctx, digest);
+    mbedtls_sha256_free(&sha256_ctx);
+
+    return err;
+}
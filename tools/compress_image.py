@@ -0,0 +1,38 @@
+#!/usr/bin/env python
+#
+# SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Compress a reflashing image for the `compressed` option of esp-self-reflasher.
+#
+# The output is a small header (magic, image size and SHA-256 digest of the
+# image) followed by a zlib stream of the image.
+
+import argparse
+import hashlib
+import struct
+import zlib
+
+COMPRESSED_IMAGE_MAGIC = 0x315a4652  # "RFZ1"
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compress a reflashing image for esp-self-reflasher')
+    parser.add_argument('input', type=argparse.FileType('rb'), help='Image to compress')
+    parser.add_argument('output', type=argparse.FileType('wb'), help='Compressed image')
+    parser.add_argument('--level', type=int, default=9, choices=range(0, 10), help='zlib compression level')
+    args = parser.parse_args()
+
+    image = args.input.read()
+    header = struct.pack('<II32s', COMPRESSED_IMAGE_MAGIC, len(image), hashlib.sha256(image).digest())
+    # The decompressor keeps a 32KB window, which matches the zlib default wbits
+    payload = zlib.compress(image, args.level)
+    args.output.write(header + payload)
+
+    print('{}: {} -> {} bytes ({:.1f}%)'.format(args.output.name, len(image), len(header) + len(payload),
+                                                100.0 * (len(header) + len(payload)) / max(len(image), 1)))
+
+
+if __name__ == '__main__':
+    main()
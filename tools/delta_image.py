@@ -0,0 +1,55 @@
+#!/usr/bin/env python
+#
+# SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Create a delta patch for the `delta_patch` option of esp-self-reflasher.
+#
+# The output is a header (magic, base and target sizes and their SHA-256
+# digests) followed by bsdiff style records: a control block of diff length,
+# extra length and seek, the diff bytes (added to the base image) and the
+# extra bytes (copied as is). The diff bytes are mostly zeros, so the patch is
+# meant to be compressed with compress_image.py and downloaded with both
+# `delta_patch` and `compressed` set.
+#
+# Requires the bsdiff4 package (pip install bsdiff4).
+
+import argparse
+import hashlib
+import struct
+
+import bsdiff4.core
+
+PATCH_IMAGE_MAGIC = 0x31444652  # "RFD1"
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Create a delta patch for esp-self-reflasher')
+    parser.add_argument('base', type=argparse.FileType('rb'), help='Image currently in the base region')
+    parser.add_argument('target', type=argparse.FileType('rb'), help='New image')
+    parser.add_argument('output', type=argparse.FileType('wb'), help='Patch')
+    args = parser.parse_args()
+
+    base = args.base.read()
+    target = args.target.read()
+
+    control, diff, extra = bsdiff4.core.diff(base, target)
+
+    out = bytearray(struct.pack('<III32s32s', PATCH_IMAGE_MAGIC, len(base), len(target),
+                                hashlib.sha256(base).digest(), hashlib.sha256(target).digest()))
+    diff_pos = 0
+    extra_pos = 0
+    for diff_len, extra_len, seek in control:
+        out += struct.pack('<IIi', diff_len, extra_len, seek)
+        out += diff[diff_pos:diff_pos + diff_len]
+        out += extra[extra_pos:extra_pos + extra_len]
+        diff_pos += diff_len
+        extra_pos += extra_len
+
+    args.output.write(out)
+    print('{}: {} bytes, {} records'.format(args.output.name, len(out), len(control)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,206 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Encoders for the compressed and delta patch images of the benchmark. They
+ * only produce what the component decodes, without searching for the smallest
+ * encoding, so the benchmark needs neither zlib nor bsdiff on the host.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "bench_server.h"
+#include "bench_codec.h"
+
+#define COMPRESSED_IMAGE_MAGIC  0x315a4652    /* "RFZ1", as written by tools/compress_image.py */
+#define PATCH_IMAGE_MAGIC       0x31444652    /* "RFD1", as written by tools/delta_image.py */
+#define DIGEST_SIZE             32
+#define PATCH_HEADER_SIZE       (3 * 4 + 2 * DIGEST_SIZE)
+#define PATCH_RECORD_SIZE       (3 * 4)
+
+#define STORED_BLOCK_SIZE       0x4000
+#define ADLER_MOD               65521
+#define MATCH_LEN_MAX           258
+
+static const char *TAG = "bench_codec";
+
+typedef struct {
+    FILE      *file;
+    uint32_t  bits;
+    int       count;
+} bit_writer_t;
+
+uint8_t bench_padded_byte(uint32_t seed, size_t data_len, size_t offset)
+{
+    return (offset < data_len) ? bench_image_byte(seed, offset) : 0xFF;
+}
+
+static void image_sha256(uint32_t seed, size_t data_len, size_t size, uint8_t *digest)
+{
+    mbedtls_sha256_context ctx;
+    uint8_t buffer[256];
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        size_t len = MIN(size - offset, sizeof(buffer));
+        for (size_t i = 0; i < len; i++) {
+            buffer[i] = bench_padded_byte(seed, data_len, offset + i);
+        }
+        mbedtls_sha256_update(&ctx, buffer, len);
+    }
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+}
+
+static void put_u32_le(FILE *file, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        fputc((value >> (8 * i)) & 0xFF, file);
+    }
+}
+
+/* Deflate packs fields from the least significant bit */
+static void put_bits(bit_writer_t *writer, uint32_t value, int count)
+{
+    writer->bits |= value << writer->count;
+    writer->count += count;
+    while (writer->count >= 8) {
+        fputc(writer->bits & 0xFF, writer->file);
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+/* Huffman codes, unlike the other fields, are packed from their most significant bit */
+static void put_code(bit_writer_t *writer, uint32_t code, int length)
+{
+    for (int i = length - 1; i >= 0; i--) {
+        put_bits(writer, (code >> i) & 1, 1);
+    }
+}
+
+static void put_align(bit_writer_t *writer)
+{
+    if (writer->count > 0) {
+        put_bits(writer, 0, 8 - writer->count);
+    }
+}
+
+/* Fixed Huffman code of the literal 0xFF, in the 9-bit range starting at 144 */
+static void put_literal_ff(bit_writer_t *writer)
+{
+    put_code(writer, 0x190 + (0xFF - 144), 9);
+}
+
+esp_err_t bench_write_compressed(const char *path, uint32_t seed, size_t data_len, size_t size, size_t *len)
+{
+    uint8_t digest[DIGEST_SIZE];
+    uint32_t adler_a = 1;
+    uint32_t adler_b = 0;
+
+    data_len = MIN(data_len, size);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return ESP_FAIL;
+    }
+
+    image_sha256(seed, data_len, size, digest);
+    put_u32_le(file, COMPRESSED_IMAGE_MAGIC);
+    put_u32_le(file, size);
+    fwrite(digest, 1, sizeof(digest), file);
+
+    // zlib header: deflate with a 32KB window, no preset dictionary
+    fputc(0x78, file);
+    fputc(0x01, file);
+
+    bit_writer_t writer = { .file = file };
+    for (size_t offset = 0; offset < data_len; offset += STORED_BLOCK_SIZE) {
+        uint16_t block_len = MIN(data_len - offset, STORED_BLOCK_SIZE);
+        put_bits(&writer, 0, 1);    // BFINAL
+        put_bits(&writer, 0, 2);    // BTYPE stored
+        put_align(&writer);
+        fputc(block_len & 0xFF, file);
+        fputc(block_len >> 8, file);
+        fputc(~block_len & 0xFF, file);
+        fputc((uint16_t)~block_len >> 8, file);
+        for (size_t i = 0; i < block_len; i++) {
+            uint8_t byte = bench_image_byte(seed, offset + i);
+            fputc(byte, file);
+            adler_a = (adler_a + byte) % ADLER_MOD;
+            adler_b = (adler_b + adler_a) % ADLER_MOD;
+        }
+    }
+
+    // The padding: one literal, then matches of the byte before at distance 1
+    size_t pad = size - data_len;
+    put_bits(&writer, 1, 1);        // BFINAL
+    put_bits(&writer, 1, 2);        // BTYPE fixed Huffman
+    for (size_t i = 0; i < pad; i++) {
+        adler_a = (adler_a + 0xFF) % ADLER_MOD;
+        adler_b = (adler_b + adler_a) % ADLER_MOD;
+    }
+    if (pad > 0) {
+        put_literal_ff(&writer);
+        pad--;
+    }
+    for (; pad >= MATCH_LEN_MAX; pad -= MATCH_LEN_MAX) {
+        put_code(&writer, 0xC0 + (285 - 280), 8);   // Length 258, symbol 285
+        put_code(&writer, 0, 5);                    // Distance 1, code 0
+    }
+    for (; pad > 0; pad--) {
+        put_literal_ff(&writer);
+    }
+    put_code(&writer, 0, 7);        // End of block
+    put_align(&writer);
+
+    uint32_t adler = (adler_b << 16) | adler_a;
+    for (int i = 3; i >= 0; i--) {
+        fputc((adler >> (8 * i)) & 0xFF, file);
+    }
+
+    *len = ftell(file);
+    return (fclose(file) == 0) ? ESP_OK : ESP_FAIL;
+}
+
+size_t bench_patch_len(size_t size)
+{
+    return PATCH_HEADER_SIZE + PATCH_RECORD_SIZE + size;
+}
+
+esp_err_t bench_write_patch(const char *path, uint32_t base_seed, uint32_t target_seed, size_t size, size_t *len)
+{
+    uint8_t digest[DIGEST_SIZE];
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return ESP_FAIL;
+    }
+
+    put_u32_le(file, PATCH_IMAGE_MAGIC);
+    put_u32_le(file, size);
+    put_u32_le(file, size);
+    image_sha256(base_seed, size, size, digest);
+    fwrite(digest, 1, sizeof(digest), file);
+    image_sha256(target_seed, size, size, digest);
+    fwrite(digest, 1, sizeof(digest), file);
+
+    // A single record whose diff bytes, added to the base, give the target
+    put_u32_le(file, size);
+    put_u32_le(file, 0);
+    put_u32_le(file, 0);
+    for (size_t offset = 0; offset < size; offset++) {
+        fputc((uint8_t)(bench_image_byte(target_seed, offset) - bench_image_byte(base_seed, offset)), file);
+    }
+
+    *len = ftell(file);
+    return (fclose(file) == 0) ? ESP_OK : ESP_FAIL;
+}
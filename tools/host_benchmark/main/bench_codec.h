@@ -0,0 +1,47 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief  Byte `offset` of image `seed` once its bytes from `data_len` on are replaced by 0xFF padding.
+ */
+uint8_t bench_padded_byte(uint32_t seed, size_t data_len, size_t offset);
+
+/**
+ * @brief  Write the `size` bytes image `seed`, padded from `data_len` on, compressed as by tools/compress_image.py.
+ *
+ * The data goes in stored deflate blocks and the padding in a fixed Huffman block
+ * of 258-byte matches, so the end of the stream decompresses to far more bytes than
+ * the decompression window holds.
+ *
+ * @param len  Length of the written file
+ */
+esp_err_t bench_write_compressed(const char *path, uint32_t seed, size_t data_len, size_t size, size_t *len);
+
+/**
+ * @brief  Length of the patch bench_write_patch() writes for `size` bytes images.
+ */
+size_t bench_patch_len(size_t size);
+
+/**
+ * @brief  Write a delta patch, in the format of tools/delta_image.py, turning the `size` bytes image `base_seed` into image `target_seed`.
+ *
+ * @param len  Length of the written file
+ */
+esp_err_t bench_write_patch(const char *path, uint32_t base_seed, uint32_t target_seed, size_t size, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,205 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Minimal HTTP/1.1 server for the benchmark. It runs on host threads rather
+ * than FreeRTOS tasks, so that blocking socket calls do not stall the scheduler.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "esp_log.h"
+#include "bench_server.h"
+
+#define SECTOR_SIZE          0x1000
+#define REQUEST_MAX_LEN      2048
+#define SEND_CHUNK_SIZE      0x4000
+
+static const char *TAG = "bench_server";
+
+static int s_listen_fd = -1;
+
+uint8_t bench_image_byte(uint32_t seed, size_t offset)
+{
+    // Every eighth sector ends with a quarter of padding
+    if ((offset / SECTOR_SIZE) % 8 == 7 && offset % SECTOR_SIZE >= SECTOR_SIZE * 3 / 4) {
+        return 0xFF;
+    }
+
+    uint32_t x = (uint32_t)offset * 2654435761u ^ (seed * 0x9E3779B9u);
+    x ^= x >> 15;
+    x *= 0x2C1B3C6Du;
+    x ^= x >> 12;
+    return (uint8_t)x;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Read one request head, up to the empty line; the benchmark never sends a body */
+static int read_request(int fd, char *request, size_t size)
+{
+    size_t len = 0;
+
+    while (len < size - 1) {
+        ssize_t received = recv(fd, request + len, 1, 0);
+        if (received <= 0) {
+            return -1;
+        }
+        len++;
+        request[len] = '\0';
+        if (len >= 4 && memcmp(request + len - 4, "\r\n\r\n", 4) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int send_image(int fd, uint32_t seed, size_t image_size, const char *request)
+{
+    char head[256];
+    size_t start = 0;
+    size_t end = image_size;
+    bool ranged = false;
+
+    const char *range = strstr(request, "\r\nRange: bytes=");
+    if (range != NULL) {
+        char *next;
+        range += strlen("\r\nRange: bytes=");
+        start = strtoul(range, &next, 10);
+        if (*next == '-' && next[1] >= '0' && next[1] <= '9') {
+            end = MIN(strtoul(next + 1, NULL, 10) + 1, image_size);
+        }
+        ranged = true;
+    }
+
+    if (start >= end) {
+        snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\n"
+                 "Content-Length: 0\r\n\r\n", image_size);
+        return send_all(fd, head, strlen(head));
+    }
+
+    if (ranged) {
+        snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\n"
+                 "Content-Length: %zu\r\nETag: \"%lu-%zu\"\r\nAccept-Ranges: bytes\r\n\r\n",
+                 start, end - 1, image_size, end - start, (unsigned long)seed, image_size);
+    } else {
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nETag: \"%lu-%zu\"\r\n"
+                 "Accept-Ranges: bytes\r\n\r\n", image_size, (unsigned long)seed, image_size);
+    }
+    if (send_all(fd, head, strlen(head)) != 0) {
+        return -1;
+    }
+
+    char *chunk = malloc(SEND_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return -1;
+    }
+    int ret = 0;
+    for (size_t offset = start; offset < end && ret == 0; ) {
+        size_t len = MIN(end - offset, SEND_CHUNK_SIZE);
+        for (size_t i = 0; i < len; i++) {
+            chunk[i] = bench_image_byte(seed, offset + i);
+        }
+        ret = send_all(fd, chunk, len);
+        offset += len;
+    }
+    free(chunk);
+    return ret;
+}
+
+static void *connection_thread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char *request = malloc(REQUEST_MAX_LEN);
+
+    while (request != NULL && read_request(fd, request, REQUEST_MAX_LEN) == 0) {
+        unsigned long seed;
+        size_t image_size;
+
+        if (sscanf(request, "GET /image/%lu/%zu ", &seed, &image_size) != 2) {
+            const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+            if (send_all(fd, not_found, strlen(not_found)) != 0) {
+                break;
+            }
+            continue;
+        }
+        if (send_image(fd, seed, image_size, request) != 0) {
+            break;
+        }
+    }
+
+    free(request);
+    close(fd);
+    return NULL;
+}
+
+static void *accept_thread(void *arg)
+{
+    while (1) {
+        pthread_t thread;
+        int fd = accept(s_listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, connection_thread, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+esp_err_t bench_server_start(uint16_t *port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t addr_len = sizeof(addr);
+    pthread_t thread;
+
+    s_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s_listen_fd < 0) {
+        ESP_LOGE(TAG, "%s: Failed to create the socket", __func__);
+        return ESP_FAIL;
+    }
+    if (bind(s_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(s_listen_fd, 8) != 0 ||
+        getsockname(s_listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        ESP_LOGE(TAG, "%s: Failed to listen on the loopback interface", __func__);
+        close(s_listen_fd);
+        return ESP_FAIL;
+    }
+    if (pthread_create(&thread, NULL, accept_thread, NULL) != 0) {
+        close(s_listen_fd);
+        return ESP_FAIL;
+    }
+    pthread_detach(thread);
+
+    *port = ntohs(addr.sin_port);
+    return ESP_OK;
+}
@@ -0,0 +1,37 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief  Byte `offset` of the generated image `seed`.
+ *
+ * Images look like firmware: mostly incompressible data, with the end of some
+ * sectors left as 0xFF padding.
+ */
+uint8_t bench_image_byte(uint32_t seed, size_t offset);
+
+/**
+ * @brief  Start serving generated images on the loopback interface.
+ *
+ * `GET /image/<seed>/<size>` returns the image `seed` truncated to `size` bytes,
+ * honouring Range requests and keeping connections alive.
+ *
+ * @param port  Port the server listens on
+ */
+esp_err_t bench_server_start(uint16_t *port);
+
+#ifdef __cplusplus
+}
+#endif
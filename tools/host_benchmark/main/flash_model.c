@@ -0,0 +1,203 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * The linux target emulates the flash through the partition API only. The
+ * raw flash accesses of the component are served by the partition holding
+ * the address, and every operation is counted on the way, the partition ones
+ * included, through the --wrap link options of main/CMakeLists.txt.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_flash.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "sdkconfig.h"
+#include "flash_model.h"
+
+#define FLASH_PAGE_SIZE      0x100
+#define FLASH_BLOCK_SIZE     0x10000
+
+static const char *TAG = "flash_model";
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static flash_model_counters_t s_counters;
+
+__attribute__((weak)) esp_flash_t *esp_flash_default_chip = NULL;
+
+esp_err_t __real_esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+esp_err_t __real_esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size);
+esp_err_t __real_esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+
+void flash_model_reset(void)
+{
+    pthread_mutex_lock(&s_lock);
+    memset(&s_counters, 0, sizeof(s_counters));
+    pthread_mutex_unlock(&s_lock);
+}
+
+void flash_model_get(flash_model_counters_t *counters)
+{
+    pthread_mutex_lock(&s_lock);
+    *counters = s_counters;
+    pthread_mutex_unlock(&s_lock);
+}
+
+uint64_t flash_model_time_us(const flash_model_counters_t *counters)
+{
+    return (uint64_t)counters->sector_erases * CONFIG_BENCH_COST_SECTOR_ERASE_US +
+           (uint64_t)counters->block_erases * CONFIG_BENCH_COST_BLOCK_ERASE_US +
+           (uint64_t)counters->pages_programmed * CONFIG_BENCH_COST_PAGE_PROGRAM_US +
+           (uint64_t)counters->write_calls * CONFIG_BENCH_COST_WRITE_CALL_US +
+           (uint64_t)counters->read_calls * CONFIG_BENCH_COST_READ_CALL_US +
+           counters->bytes_read * CONFIG_BENCH_COST_READ_KB_US / 1024;
+}
+
+/* As the flash driver does, aligned 64KB blocks are erased at once, the rest sector by sector */
+static void count_erase(uint32_t address, size_t len)
+{
+    pthread_mutex_lock(&s_lock);
+    s_counters.bytes_erased += len;
+    while (len > 0) {
+        if (address % FLASH_BLOCK_SIZE == 0 && len >= FLASH_BLOCK_SIZE) {
+            s_counters.block_erases++;
+            address += FLASH_BLOCK_SIZE;
+            len -= FLASH_BLOCK_SIZE;
+        } else {
+            s_counters.sector_erases++;
+            address += SPI_FLASH_SEC_SIZE;
+            len -= MIN(len, SPI_FLASH_SEC_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&s_lock);
+}
+
+static void count_write(uint32_t address, size_t len)
+{
+    pthread_mutex_lock(&s_lock);
+    s_counters.write_calls++;
+    s_counters.bytes_written += len;
+    if (len > 0) {
+        s_counters.pages_programmed += (address + len - 1) / FLASH_PAGE_SIZE - address / FLASH_PAGE_SIZE + 1;
+    }
+    pthread_mutex_unlock(&s_lock);
+}
+
+static void count_read(size_t len)
+{
+    pthread_mutex_lock(&s_lock);
+    s_counters.read_calls++;
+    s_counters.bytes_read += len;
+    pthread_mutex_unlock(&s_lock);
+}
+
+static const esp_partition_t *partition_at(uint32_t address, size_t len)
+{
+    const esp_partition_t *found = NULL;
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+
+    while (it != NULL) {
+        const esp_partition_t *p = esp_partition_get(it);
+        if (p->address <= address && address + len <= p->address + p->size) {
+            found = p;
+            break;
+        }
+        it = esp_partition_next(it);
+    }
+    esp_partition_iterator_release(it);
+
+    if (found == NULL) {
+        ESP_LOGE(TAG, "%s: Range 0x%08lx-0x%08lx is not inside a partition of the benchmark table", __func__,
+                 (unsigned long)address, (unsigned long)(address + len));
+    }
+    return found;
+}
+
+esp_err_t __wrap_esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    esp_err_t err = __real_esp_partition_erase_range(partition, offset, size);
+    if (err == ESP_OK) {
+        count_erase(partition->address + offset, size);
+    }
+    return err;
+}
+
+esp_err_t __wrap_esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    esp_err_t err = __real_esp_partition_write(partition, dst_offset, src, size);
+    if (err == ESP_OK) {
+        count_write(partition->address + dst_offset, size);
+    }
+    return err;
+}
+
+esp_err_t __wrap_esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    esp_err_t err = __real_esp_partition_read(partition, src_offset, dst, size);
+    if (err == ESP_OK) {
+        count_read(size);
+    }
+    return err;
+}
+
+esp_err_t __wrap_esp_flash_erase_region(esp_flash_t *chip, uint32_t start, uint32_t len)
+{
+    const esp_partition_t *partition = partition_at(start, len);
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return __wrap_esp_partition_erase_range(partition, start - partition->address, len);
+}
+
+esp_err_t __wrap_esp_flash_write(esp_flash_t *chip, const void *buffer, uint32_t address, uint32_t length)
+{
+    const esp_partition_t *partition = partition_at(address, length);
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return __wrap_esp_partition_write(partition, address - partition->address, buffer, length);
+}
+
+esp_err_t __wrap_esp_flash_read(esp_flash_t *chip, void *buffer, uint32_t address, uint32_t length)
+{
+    const esp_partition_t *partition = partition_at(address, length);
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return __wrap_esp_partition_read(partition, address - partition->address, buffer, length);
+}
+
+esp_err_t __wrap_spi_flash_mmap(size_t src_addr, size_t size, spi_flash_mmap_memory_t memory, const void **out_ptr,
+                                spi_flash_mmap_handle_t *out_handle)
+{
+    const esp_partition_t *partition = partition_at(src_addr, size);
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = esp_partition_mmap(partition, src_addr - partition->address, size, ESP_PARTITION_MMAP_DATA, out_ptr,
+                                       (esp_partition_mmap_handle_t *)out_handle);
+    if (err == ESP_OK) {
+        // A mapped window is charged as if it was read whole
+        count_read(size);
+    }
+    return err;
+}
+
+void __wrap_spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+    esp_partition_munmap((esp_partition_mmap_handle_t)handle);
+}
+
+/* The benchmark runs from the factory partition, as far as the component can tell */
+size_t __wrap_spi_flash_cache2phys(const void *cached)
+{
+    const esp_partition_t *factory = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, NULL);
+    return (factory != NULL) ? factory->address + FLASH_PAGE_SIZE : SPI_FLASH_CACHE2PHYS_FAIL;
+}
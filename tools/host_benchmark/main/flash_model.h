@@ -0,0 +1,40 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t  sector_erases;
+    uint32_t  block_erases;
+    uint32_t  write_calls;
+    uint32_t  pages_programmed;
+    uint32_t  read_calls;       /*!< Flash reads and mmap windows */
+    uint64_t  bytes_erased;
+    uint64_t  bytes_written;
+    uint64_t  bytes_read;       /*!< Read, or mapped */
+} flash_model_counters_t;
+
+/**
+ * @brief  Zero the operation counters.
+ */
+void flash_model_reset(void);
+
+void flash_model_get(flash_model_counters_t *counters);
+
+/**
+ * @brief  Flash time the counted operations would take on a device, as per the Kconfig cost model.
+ */
+uint64_t flash_model_time_us(const flash_model_counters_t *counters);
+
+#ifdef __cplusplus
+}
+#endif
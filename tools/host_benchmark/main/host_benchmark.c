@@ -0,0 +1,424 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "sdkconfig.h"
+
+#include "self_reflasher.h"
+#include "bench_server.h"
+#include "bench_codec.h"
+#include "flash_model.h"
+
+static const char *TAG = "host_benchmark";
+
+#define IMAGE_SIZES_MAX     16
+#define URL_MAX_LEN         64
+#define PATH_MAX_LEN        80
+#define STEP_BUDGET_BYTES   0x10000
+
+typedef struct {
+    const char  *name;
+    bool        erase_on_demand;
+    bool        differential_copy;
+    bool        verify_after_copy;
+    bool        file_source;        /* Read the images from host files instead of the HTTP server */
+    bool        compressed;         /* Compressed images whose second half is 0xFF padding, read from host files */
+    bool        delta_patch;        /* The second image is a patch against the first one, read from a host file */
+    bool        direct_stream;
+    bool        pipelined_download;
+    bool        segmented_download;
+    bool        resumable;
+    bool        copy_journal;
+    bool        commit_header_last;
+    bool        step;               /* Move each reflash forward with esp_self_reflasher_step */
+    bool        job;                /* Reflash both images with a single esp_self_reflasher_run_job */
+} bench_scenario_t;
+
+static const bench_scenario_t s_scenarios[] = {
+    { .name = "default" },
+    { .name = "on_demand", .erase_on_demand = true },
+    { .name = "diff_verify", .erase_on_demand = true, .differential_copy = true, .verify_after_copy = true },
+    { .name = "file_source", .erase_on_demand = true, .file_source = true },
+    { .name = "compressed", .erase_on_demand = true, .compressed = true, .verify_after_copy = true },
+    { .name = "delta_patch", .erase_on_demand = true, .delta_patch = true },
+    { .name = "direct_stream", .direct_stream = true, .verify_after_copy = true },
+    { .name = "pipelined", .erase_on_demand = true, .pipelined_download = true },
+    { .name = "segmented", .erase_on_demand = true, .segmented_download = true },
+    { .name = "resumable", .erase_on_demand = true, .resumable = true },
+    { .name = "copy_journal", .erase_on_demand = true, .copy_journal = true },
+    { .name = "header_last", .erase_on_demand = true, .commit_header_last = true },
+    { .name = "step", .erase_on_demand = true, .verify_after_copy = true, .step = true },
+    { .name = "run_job", .erase_on_demand = true, .job = true },
+};
+
+typedef struct {
+    const char              *operation;
+    flash_model_counters_t  counters;
+    int64_t                 wall_us;
+} bench_result_t;
+
+static const esp_partition_t *s_staging;
+static const esp_partition_t *s_dest;
+static int s_failures;
+
+static void print_header(void)
+{
+    printf("%-13s %8s %-16s %6s %6s %7s %7s %10s %10s %10s %11s %9s\n",
+           "scenario", "size", "operation", "sect", "block", "writes", "pages",
+           "erased", "written", "read", "model_ms", "wall_ms");
+}
+
+static void print_result(const char *scenario, size_t size, const bench_result_t *result)
+{
+    const flash_model_counters_t *c = &result->counters;
+    printf("%-13s %8zu %-16s %6lu %6lu %7lu %7lu %10llu %10llu %10llu %11.1f %9.1f\n",
+           scenario, size, result->operation,
+           (unsigned long)c->sector_erases, (unsigned long)c->block_erases,
+           (unsigned long)c->write_calls, (unsigned long)c->pages_programmed,
+           (unsigned long long)c->bytes_erased, (unsigned long long)c->bytes_written, (unsigned long long)c->bytes_read,
+           flash_model_time_us(c) / 1000.0, result->wall_us / 1000.0);
+}
+
+static void begin(bench_result_t *result, const char *operation)
+{
+    result->operation = operation;
+    flash_model_reset();
+    result->wall_us = esp_timer_get_time();
+}
+
+static void end(bench_result_t *result, esp_err_t err, const char *scenario, size_t size)
+{
+    result->wall_us = esp_timer_get_time() - result->wall_us;
+    flash_model_get(&result->counters);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s %zu: %s failed: %s", scenario, size, result->operation, esp_err_to_name(err));
+        s_failures++;
+    }
+    print_result(scenario, size, result);
+}
+
+/*
+ * The regression part: the destination, from `dest_offset` into it, must hold the
+ * image the server generated, padded with 0xFF from `data_len` on
+ */
+static void check_dest(const char *scenario, uint32_t seed, size_t dest_offset, size_t data_len, size_t size)
+{
+    uint8_t buffer[256];
+
+    for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        size_t len = MIN(size - offset, sizeof(buffer));
+        if (esp_partition_read(s_dest, dest_offset + offset, buffer, len) != ESP_OK) {
+            s_failures++;
+            return;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (buffer[i] != bench_padded_byte(seed, data_len, offset + i)) {
+                ESP_LOGE(TAG, "%s %zu: image %lu differs at offset 0x%08zx", scenario, size, (unsigned long)seed, offset + i);
+                s_failures++;
+                return;
+            }
+        }
+    }
+}
+
+/* Write the image the server would generate to a host file */
+static esp_err_t bench_write_image(const char *path, uint32_t seed, size_t size)
+{
+    uint8_t buffer[256];
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Failed to create %s", path);
+        return ESP_FAIL;
+    }
+    for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        size_t len = MIN(size - offset, sizeof(buffer));
+        for (size_t i = 0; i < len; i++) {
+            buffer[i] = bench_image_byte(seed, offset + i);
+        }
+        fwrite(buffer, 1, len, file);
+    }
+    fclose(file);
+
+    return ESP_OK;
+}
+
+/*
+ * Write image `seed` to a host file when the scenario reads it from there, as is,
+ * compressed, or as a patch against image 1, and make a source reading it.
+ * `source` is left NULL when the image is downloaded from the server,
+ * `fetched_len` is set to the length read from the source, which the image is
+ * placed by, and `staged_len` to the length it takes in the staging partition.
+ */
+static esp_err_t bench_source(const bench_scenario_t *scenario, uint32_t seed, size_t size,
+                              esp_self_reflasher_source_t **source, size_t *fetched_len, size_t *staged_len)
+{
+    char path[PATH_MAX_LEN];
+    esp_err_t err;
+
+    *source = NULL;
+    *fetched_len = size;
+    *staged_len = size;
+    if (scenario->compressed) {
+        snprintf(path, sizeof(path), "/tmp/self_reflasher_bench_%lu_%zu.rfz", (unsigned long)seed, size);
+        err = bench_write_compressed(path, seed, size / 2, size, fetched_len);
+        *staged_len = *fetched_len;
+    } else if (scenario->delta_patch && seed != 1) {
+        // The patched image is what gets staged
+        snprintf(path, sizeof(path), "/tmp/self_reflasher_bench_1_%lu_%zu.rfd", (unsigned long)seed, size);
+        err = bench_write_patch(path, 1, seed, size, fetched_len);
+    } else if (scenario->file_source) {
+        snprintf(path, sizeof(path), "/tmp/self_reflasher_bench_%lu_%zu.bin", (unsigned long)seed, size);
+        err = bench_write_image(path, seed, size);
+    } else {
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    return esp_self_reflasher_source_file_create(path, source);
+}
+
+/* Download and copy the configured image, with the blocking calls or step by step */
+static esp_err_t bench_reflash(const bench_scenario_t *scenario, esp_self_reflasher_handle_t handle, size_t size)
+{
+    bench_result_t result;
+    esp_err_t err;
+
+    if (scenario->step) {
+        begin(&result, "step");
+        do {
+            err = esp_self_reflasher_step(handle, STEP_BUDGET_BYTES, 0, NULL);
+        } while (err == ESP_ERR_NOT_FINISHED);
+        end(&result, err, scenario->name, size);
+        return err;
+    }
+
+    begin(&result, "download_bin");
+    err = esp_self_reflasher_download_bin(handle);
+    end(&result, err, scenario->name, size);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    begin(&result, "copy_to_region");
+    err = esp_self_reflasher_copy_to_region(handle);
+    end(&result, err, scenario->name, size);
+    return err;
+}
+
+/* Both images in a single job, each copied to its half of the destination partition */
+static void run_job_scenario(const bench_scenario_t *scenario, uint16_t port, size_t size)
+{
+    char urls[2][URL_MAX_LEN];
+    bench_result_t result;
+    size_t half = s_dest->size / 2;
+    size_t image_size = MIN(size, half);
+    esp_self_reflasher_job_image_t images[2];
+
+    esp_http_client_config_t http_config = {
+        .url = urls[0],
+        .keep_alive_enable = true,
+    };
+    esp_self_reflasher_config_t config = {
+        .http_config = &http_config,
+        .target_partition = s_staging,
+        .erase_on_demand = scenario->erase_on_demand,
+        .verify_after_copy = scenario->verify_after_copy,
+    };
+
+    for (size_t i = 0; i < 2; i++) {
+        snprintf(urls[i], sizeof(urls[i]), "http://127.0.0.1:%u/image/%zu/%zu", port, i + 1, image_size);
+        images[i] = (esp_self_reflasher_job_image_t) {
+            .url = urls[i],
+            .dest_region = {
+                .region_address = s_dest->address + i * half,
+                .region_size = half,
+            },
+        };
+    }
+
+    begin(&result, "run_job");
+    esp_err_t err = esp_self_reflasher_run_job(&config, images, 2);
+    end(&result, err, scenario->name, size);
+    if (err == ESP_OK) {
+        for (size_t i = 0; i < 2; i++) {
+            check_dest(scenario->name, i + 1, i * half, image_size, image_size);
+        }
+    }
+}
+
+static void run_scenario(const bench_scenario_t *scenario, uint16_t port, size_t size)
+{
+    char url[URL_MAX_LEN];
+    bench_result_t result;
+    esp_err_t err;
+    esp_self_reflasher_source_t *source = NULL;
+    size_t first_len;
+    size_t second_len;
+    size_t fetched_len;
+    // Compressed images end with a long run of padding, the case where the decompressor output outgrows its input the most
+    size_t data_len = scenario->compressed ? size / 2 : size;
+
+    if (scenario->job) {
+        run_job_scenario(scenario, port, size);
+        return;
+    }
+
+    // The patch is placed by its own length, which needs room for its header and records on top of the image
+    if (scenario->delta_patch && bench_patch_len(size) > s_staging->size) {
+        ESP_LOGW(TAG, "%s %zu: skipped, the patch does not fit in the staging partition", scenario->name, size);
+        return;
+    }
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/image/1/%zu", port, size);
+    esp_http_client_config_t http_config = {
+        .url = url,
+        .keep_alive_enable = true,
+    };
+    esp_self_reflasher_config_t config = {
+        .http_config = &http_config,
+        .target_partition = s_staging,
+        .dest_region = {
+            .region_address = s_dest->address,
+            .region_size = s_dest->size,
+        },
+        .erase_on_demand = scenario->erase_on_demand,
+        .differential_copy = scenario->differential_copy,
+        .verify_after_copy = scenario->verify_after_copy,
+        .compressed = scenario->compressed,
+        .direct_stream = scenario->direct_stream,
+        .pipelined_download = scenario->pipelined_download,
+        .segmented_download = scenario->segmented_download,
+        .resumable = scenario->resumable,
+        .copy_journal = scenario->copy_journal,
+        .commit_header_last = scenario->commit_header_last,
+    };
+    esp_self_reflasher_handle_t handle = NULL;
+
+    if (bench_source(scenario, 1, size, &source, &fetched_len, &first_len) != ESP_OK) {
+        s_failures++;
+        return;
+    }
+    config.source = source;
+
+    begin(&result, "init");
+    err = esp_self_reflasher_init(&config, &handle);
+    end(&result, err, scenario->name, size);
+    if (err != ESP_OK) {
+        if (source != NULL) {
+            esp_self_reflasher_source_delete(source);
+        }
+        return;
+    }
+
+    if (bench_reflash(scenario, handle, size) == ESP_OK) {
+        check_dest(scenario->name, 1, 0, data_len, size);
+    }
+
+    // A second image, copied over the first one, or patching it
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/image/2/%zu", port, size);
+    if (source != NULL) {
+        esp_self_reflasher_source_delete(source);
+    }
+    if (bench_source(scenario, 2, size, &source, &fetched_len, &second_len) != ESP_OK) {
+        s_failures++;
+    }
+    config.source = source;
+    config.delta_patch = scenario->delta_patch;
+    begin(&result, "upd_next_config");
+    err = esp_self_reflasher_upd_next_config(&config, handle);
+    end(&result, err, scenario->name, size);
+
+    if (err == ESP_OK && bench_reflash(scenario, handle, size) == ESP_OK) {
+        check_dest(scenario->name, 2, 0, data_len, size);
+    }
+
+    esp_self_reflasher_deinit(handle);
+    if (source != NULL) {
+        esp_self_reflasher_source_delete(source);
+    }
+
+    // Nothing is staged when streaming to the destination
+    if (scenario->direct_stream) {
+        return;
+    }
+
+    // The second image is still staged, after the first one when its fetched length fit there, copy it again without a handle
+    uint32_t staged_offset = (first_len + fetched_len <= s_staging->size) ? first_len : 0;
+    esp_self_reflasher_config_t direct_config = {
+        .src_region = {
+            .region_address = s_staging->address + staged_offset,
+            .region_size = second_len,
+        },
+        .dest_region = config.dest_region,
+        .src_bin_size = second_len,
+        .compressed = scenario->compressed,
+        .copy_journal = scenario->copy_journal,
+    };
+    begin(&result, "directly_copy");
+    err = esp_self_reflasher_directly_copy_to_region(&direct_config);
+    end(&result, err, scenario->name, size);
+    check_dest(scenario->name, 2, 0, data_len, size);
+}
+
+void app_main(void)
+{
+    size_t sizes[IMAGE_SIZES_MAX];
+    size_t size_count = 0;
+    uint16_t port;
+
+    ESP_ERROR_CHECK(nvs_flash_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    s_staging = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    s_dest = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    if (s_staging == NULL || s_dest == NULL) {
+        ESP_LOGE(TAG, "The benchmark partition table needs ota_0 and ota_1 partitions");
+        exit(1);
+    }
+
+    for (const char *p = CONFIG_BENCH_IMAGE_SIZES; *p != '\0' && size_count < IMAGE_SIZES_MAX; ) {
+        char *next;
+        size_t size = strtoul(p, &next, 0);
+        if (next == p) {
+            break;
+        }
+        if (size > 0 && size <= s_staging->size && size <= s_dest->size) {
+            sizes[size_count++] = size;
+        } else {
+            ESP_LOGW(TAG, "Skipping image size %zu, it does not fit the partitions", size);
+        }
+        p = next;
+    }
+
+    ESP_ERROR_CHECK(bench_server_start(&port));
+    ESP_LOGI(TAG, "Serving images on port %u", port);
+
+    print_header();
+    for (size_t s = 0; s < sizeof(s_scenarios) / sizeof(s_scenarios[0]); s++) {
+        for (size_t i = 0; i < size_count; i++) {
+            for (int run = 0; run < CONFIG_BENCH_REPEAT; run++) {
+                run_scenario(&s_scenarios[s], port, sizes[i]);
+            }
+        }
+    }
+
+    printf("%d failure(s)\n", s_failures);
+    fflush(stdout);
+    exit(s_failures == 0 ? 0 : 1);
+}
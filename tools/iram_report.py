@@ -0,0 +1,257 @@
+#!/usr/bin/env python
+#
+# SPDX-FileCopyrightText: 2017-2024 Espressif Systems (Shanghai) CO LTD
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Report the IRAM taken by esp-self-reflasher, from the link map of an application.
+#
+# The size of every input section placed in an IRAM output section is summed per
+# archive, for the component and for the libraries its linker fragment pulls into
+# IRAM, and per object file for the component itself. The library figures include
+# what ESP-IDF places in IRAM on its own, so the cost of a placement mode is best
+# read as the difference between two builds.
+#
+# With --check, the relocations of the component archive are read with objdump,
+# and the script fails when code marked REFLASHER_COMMIT_ATTR, whose sections are
+# named .iram1.reflasher_commit.<N>, references a symbol the link map places in
+# flash, or is not placed in IRAM itself. Symbols the map does not place, which
+# the linker scripts provide from ROM, are taken as safe.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+from collections import defaultdict
+
+COMPONENT_ARCHIVE = 'libesp-self-reflasher.a'
+FRAGMENT_ARCHIVES = ['libspi_flash.a', 'libesp_mm.a', 'libesp_partition.a', 'libesp_rom.a', 'libesp_system.a', 'libmain.a']
+
+OUTPUT_SECTION_RE = re.compile(r'^(\.\S+)(?:\s+0x[0-9a-f]+\s+0x([0-9a-f]+))?')
+INPUT_SECTION_RE = re.compile(r'^ (\.\S+|COMMON)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*))?$')
+INPUT_SECTION_CONT_RE = re.compile(r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+ARCHIVE_MEMBER_RE = re.compile(r'([^/\\]+\.a)\((.+)\)$')
+SYMBOL_RE = re.compile(r'^\s+0x([0-9a-f]+)\s+([A-Za-z_][\w.$]*)$')
+
+COMMIT_SECTION_MARKER = 'reflasher_commit.'
+FLASH_TEXT_SECTIONS = ['.flash.text']
+
+OBJDUMP_MEMBER_RE = re.compile(r'^(\S+):\s+file format')
+OBJDUMP_SYMBOL_RE = re.compile(r'^[0-9a-f]+ (.{7}) (\S+)\s+[0-9a-f]+ (.+)$')
+OBJDUMP_RELOC_HEADER_RE = re.compile(r'^RELOCATION RECORDS FOR \[(.+)\]:$')
+OBJDUMP_RELOC_RE = re.compile(r'^[0-9a-f]+\s+\S+\s+(\S+)$')
+RELOC_ADDEND_RE = re.compile(r'[+-]0x[0-9a-f]+$')
+
+
+def is_iram(section):
+    return section.startswith('.iram0.')
+
+
+def parse_map(lines):
+    """Return the total IRAM size and the IRAM bytes per (archive, object)"""
+    total = 0
+    sizes = defaultdict(int)
+    output_section = None
+    pending = False
+
+    for line in lines:
+        line = line.rstrip('\n')
+        if line.startswith('.'):
+            match = OUTPUT_SECTION_RE.match(line)
+            output_section = match.group(1)
+            if is_iram(output_section) and match.group(2):
+                total += int(match.group(2), 16)
+            pending = False
+            continue
+        if output_section is None or not is_iram(output_section):
+            continue
+
+        match = INPUT_SECTION_RE.match(line)
+        if match:
+            if match.group(2) is None:
+                # Long section names are followed by the address, size and file on the next line
+                pending = True
+                continue
+            size, origin = int(match.group(3), 16), match.group(4)
+        elif pending:
+            match = INPUT_SECTION_CONT_RE.match(line)
+            pending = False
+            if not match:
+                continue
+            size, origin = int(match.group(2), 16), match.group(3)
+        else:
+            continue
+
+        member = ARCHIVE_MEMBER_RE.search(origin)
+        if member:
+            sizes[(member.group(1), member.group(2))] += size
+        else:
+            sizes[(os.path.basename(origin), '')] += size
+
+    return total, sizes
+
+
+def parse_placement(lines):
+    """Return the output section of every (archive, object, input section), and of every global symbol"""
+    sections = {}
+    symbols = {}
+    output_section = None
+    pending = None
+
+    for line in lines:
+        line = line.rstrip('\n')
+        if line.startswith('.'):
+            output_section = OUTPUT_SECTION_RE.match(line).group(1)
+            pending = None
+            continue
+        if output_section is None:
+            continue
+
+        match = SYMBOL_RE.match(line)
+        if match:
+            symbols[match.group(2)] = output_section
+            continue
+
+        match = INPUT_SECTION_RE.match(line)
+        if match:
+            if match.group(2) is None:
+                pending = match.group(1)
+                continue
+            name, origin = match.group(1), match.group(4)
+        elif pending is not None:
+            match = INPUT_SECTION_CONT_RE.match(line)
+            name, pending = pending, None
+            if not match:
+                continue
+            origin = match.group(3)
+        else:
+            continue
+
+        member = ARCHIVE_MEMBER_RE.search(origin)
+        if member:
+            sections[(member.group(1), member.group(2), name)] = output_section
+
+    return sections, symbols
+
+
+def parse_objdump(lines):
+    """Return the defining section of the symbols of every object, and the symbols referenced from commit sections"""
+    defined = defaultdict(dict)
+    references = []
+    member = None
+    reloc_section = None
+
+    for line in lines:
+        line = line.rstrip('\n')
+        match = OBJDUMP_MEMBER_RE.match(line)
+        if match:
+            member = match.group(1)
+            reloc_section = None
+            continue
+        if member is None:
+            continue
+
+        match = OBJDUMP_RELOC_HEADER_RE.match(line)
+        if match:
+            reloc_section = match.group(1) if COMMIT_SECTION_MARKER in match.group(1) else None
+            continue
+        if not line.strip():
+            reloc_section = None
+            continue
+
+        if reloc_section is not None:
+            match = OBJDUMP_RELOC_RE.match(line)
+            if match:
+                symbol = RELOC_ADDEND_RE.sub('', match.group(1))
+                # Local labels stay within the section they are defined in
+                if symbol != '*ABS*' and not symbol.startswith('.L'):
+                    references.append((member, reloc_section, symbol))
+            continue
+
+        match = OBJDUMP_SYMBOL_RE.match(line)
+        if match and match.group(2) not in ('*UND*', '*ABS*', '*COM*'):
+            defined[member][match.group(3)] = match.group(2)
+
+    return defined, references
+
+
+def check(archive, objdump, sections, symbols):
+    """Return the placement errors of the commit code of the component archive"""
+    result = subprocess.run([objdump, '-r', '-t', archive], stdout=subprocess.PIPE, universal_newlines=True, check=True)
+    defined, references = parse_objdump(result.stdout.splitlines())
+    archive_name = os.path.basename(archive)
+    errors = []
+
+    commit_sections = sorted(key for key in sections if key[0] == archive_name and COMMIT_SECTION_MARKER in key[2])
+    if not commit_sections:
+        errors.append('no {}* section of {} found in the link map'.format(COMMIT_SECTION_MARKER, archive_name))
+    for key in commit_sections:
+        if not is_iram(sections[key]):
+            errors.append('{}({}): {} is placed in {}'.format(archive_name, key[1], key[2], sections[key]))
+
+    for member, section, symbol in sorted(set(references)):
+        if symbol in defined[member]:
+            placed = sections.get((archive_name, member, defined[member][symbol]))
+        else:
+            placed = symbols.get(symbol)
+        if placed in FLASH_TEXT_SECTIONS:
+            errors.append('{}({}): {} references {}, placed in {}'.format(archive_name, member, section, symbol, placed))
+
+    return errors
+
+
+def report(total, sizes):
+    per_archive = defaultdict(int)
+    for (archive, _), size in sizes.items():
+        per_archive[archive] += size
+
+    out = []
+    out.append('esp-self-reflasher IRAM usage')
+    out.append('{:<40} {:>10}'.format('Archive', 'IRAM bytes'))
+    for archive in [COMPONENT_ARCHIVE] + FRAGMENT_ARCHIVES:
+        out.append('{:<40} {:>10}'.format(archive, per_archive.get(archive, 0)))
+    out.append('')
+    out.append('{:<40} {:>10}'.format(COMPONENT_ARCHIVE + ' object', 'IRAM bytes'))
+    for (archive, obj), size in sorted(sizes.items(), key=lambda item: -item[1]):
+        if archive == COMPONENT_ARCHIVE:
+            out.append('{:<40} {:>10}'.format(obj, size))
+    out.append('')
+    out.append('{:<40} {:>10}'.format('Total IRAM of the application', total))
+    return '\n'.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Report the IRAM taken by esp-self-reflasher')
+    parser.add_argument('map', type=argparse.FileType('r'), help='Link map of the application (build/<project>.map)')
+    parser.add_argument('--output', type=argparse.FileType('w'), help='Also write the report to this file')
+    parser.add_argument('--no-report', action='store_true', help='Do not print the report')
+    parser.add_argument('--check', metavar='ARCHIVE',
+                        help='Fail when commit code of this component archive references code placed in flash')
+    parser.add_argument('--objdump', default='objdump', help='objdump of the toolchain the archive was built with')
+    args = parser.parse_args()
+
+    lines = args.map.readlines()
+
+    if not args.no_report:
+        total, sizes = parse_map(lines)
+        text = report(total, sizes)
+
+        print(text)
+        if args.output:
+            args.output.write(text + '\n')
+
+    if args.check:
+        sections, symbols = parse_placement(lines)
+        errors = check(args.check, args.objdump, sections, symbols)
+        for error in errors:
+            print('error: ' + error, file=sys.stderr)
+        if errors:
+            print('esp-self-reflasher: REFLASHER_COMMIT_ATTR code must only reach IRAM and ROM, '
+                  'see private_include/self_reflasher_placement.h', file=sys.stderr)
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())